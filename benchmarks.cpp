@@ -0,0 +1,305 @@
+// Throughput benchmarks of the per-event kernels used in massscales_data.cpp, compared to the implementations they replaced
+// Does not need ROOT nor input files: the kinematics are drawn at random
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <boost/program_options.hpp>
+#include <memory>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <cstdlib>
+#include "binning.h"
+#include "dimuon.h"
+
+using namespace std;
+using namespace boost::program_options;
+
+// 4D bin lookup as originally done in massscales_data.cpp, walking all the 4D bins
+unsigned int index_nested_loop(const vector<float>& pt_edges, const vector<float>& eta_edges, float etaP, float ptP, float etaM, float ptM) {
+  unsigned int n_pt_bins  = pt_edges.size()-1;
+  unsigned int n_eta_bins = eta_edges.size()-1;
+  unsigned int out = n_pt_bins*n_pt_bins*n_eta_bins*n_eta_bins;
+  unsigned int ibin = 0;
+  for(unsigned int ieta_p = 0; ieta_p<n_eta_bins; ieta_p++){
+    float eta_p_low = eta_edges[ieta_p];
+    float eta_p_up  = eta_edges[ieta_p+1];
+    for(unsigned int ipt_p = 0; ipt_p<n_pt_bins; ipt_p++){
+      float pt_p_low = pt_edges[ipt_p];
+      float pt_p_up  = pt_edges[ipt_p+1];
+      for(unsigned int ieta_m = 0; ieta_m<n_eta_bins; ieta_m++){
+        float eta_m_low = eta_edges[ieta_m];
+        float eta_m_up  = eta_edges[ieta_m+1];
+        for(unsigned int ipt_m = 0; ipt_m<n_pt_bins; ipt_m++){
+          float pt_m_low = pt_edges[ipt_m];
+          float pt_m_up  = pt_edges[ipt_m+1];
+          if( etaP>=eta_p_low && etaP<eta_p_up &&
+              etaM>=eta_m_low && etaM<eta_m_up &&
+              ptP>=pt_p_low   && ptP<pt_p_up &&
+              ptM>=pt_m_low   && ptM<pt_m_up
+              ) out = ibin;
+          ibin++;
+        }
+      }
+    }
+  }
+  return out;
+}
+
+// Invariant mass of a pair as computed by ROOT::Math::PtEtaPhiMVector (p1 + p2).M(): both muons converted to (px, py, pz, E) and summed
+double mass_cartesian(double pt1, double eta1, double phi1, double m1, double pt2, double eta2, double phi2, double m2) {
+  double p1 = pt1*std::cosh(eta1);
+  double p2 = pt2*std::cosh(eta2);
+  double px = pt1*std::cos(phi1) + pt2*std::cos(phi2);
+  double py = pt1*std::sin(phi1) + pt2*std::sin(phi2);
+  double pz = pt1*std::sinh(eta1) + pt2*std::sinh(eta2);
+  double e  = std::sqrt(p1*p1 + m1*m1) + std::sqrt(p2*p2 + m2*m2);
+  double mm = e*e - (px*px + py*py + pz*pz);
+  return mm>=0. ? std::sqrt(mm) : -std::sqrt(-mm);
+}
+
+// Time a kernel over all events, returns events per second
+template<class F> double events_per_second(unsigned int n_events, F kernel) {
+  auto start = chrono::steady_clock::now();
+  kernel();
+  auto stop = chrono::steady_clock::now();
+  double secs = chrono::duration<double>(stop - start).count();
+  return n_events/secs;
+}
+
+void bench_binning(const Binning4D& binning, unsigned int n_events, int seed) {
+
+  cout << "--- 4D bin lookup: " << binning.n_bins() << " 4D bins (" << binning.n_pt_bins() << " pt bins, " << binning.n_eta_bins() << " eta bins) ---" << endl;
+
+  // Muons slightly beyond the binning in pt and eta, to include the out of range lookups
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<float> pt_dist( binning.pt_edges().front()-2.0, binning.pt_edges().back()+2.0 );
+  std::uniform_real_distribution<float> eta_dist( binning.eta_edges().front()-0.1, binning.eta_edges().back()+0.1 );
+  vector<float> etaP(n_events), ptP(n_events), etaM(n_events), ptM(n_events);
+  for(unsigned int i=0; i<n_events; i++) {
+    etaP[i] = eta_dist(gen);
+    ptP[i]  = pt_dist(gen);
+    etaM[i] = eta_dist(gen);
+    ptM[i]  = pt_dist(gen);
+  }
+  // Include values exactly on the edges
+  for(unsigned int i=0; i<n_events && i<binning.pt_edges().size(); i++) ptP[i] = binning.pt_edges()[i];
+  for(unsigned int i=0; i<n_events && i<binning.eta_edges().size(); i++) etaM[i] = binning.eta_edges()[i];
+
+  vector<unsigned int> out_ref(n_events), out_new(n_events);
+
+  // The nested loop is slow, time it on a subset of the events
+  unsigned int n_ref = n_events/100 > 0 ? n_events/100 : n_events;
+  double rate_ref = events_per_second(n_ref, [&]() {
+    for(unsigned int i=0; i<n_ref; i++)
+      out_ref[i] = index_nested_loop(binning.pt_edges(), binning.eta_edges(), etaP[i], ptP[i], etaM[i], ptM[i]);
+  });
+  double rate_new = events_per_second(n_events, [&]() {
+    for(unsigned int i=0; i<n_events; i++)
+      out_new[i] = binning.index(etaP[i], ptP[i], etaM[i], ptM[i]);
+  });
+
+  unsigned int n_diff = 0;
+  for(unsigned int i=0; i<n_ref; i++) {
+    if(out_ref[i]!=out_new[i]) n_diff++;
+  }
+
+  cout << "Nested loop:  " << rate_ref << " events/s (" << n_ref << " events)" << endl;
+  cout << "Binning4D:    " << rate_new << " events/s (" << n_events << " events)" << endl;
+  cout << "Speed-up:     " << rate_new/rate_ref << endl;
+  cout << "Differences:  " << n_diff << " / " << n_ref << endl;
+}
+
+// Muon selection as originally done in massscales_data.cpp, applying the cuts one after the other
+template<class VB, class VF> SelectedMuons select_muons_branchy(unsigned int nMuon, const VB& Muon_looseId, const VF& Muon_dxybs, const VB& Muon_isGlobal,
+                                                                const VB& Muon_highPurity, const VB& Muon_mediumId, const VF& Muon_pfRelIso04_all,
+                                                                const VF& Muon_pt, const VF& Muon_eta, const MuonCuts& cuts) {
+  SelectedMuons out;
+  for(unsigned int i = 0; i < nMuon; i++){
+    if( Muon_looseId[i] && std::abs(Muon_dxybs[i]) < 0.05 && Muon_isGlobal[i] && Muon_highPurity[i] && Muon_mediumId[i] && Muon_pfRelIso04_all[i]<0.15 &&
+        Muon_pt[i] >= cuts.pt_low && Muon_pt[i] < cuts.pt_high  && Muon_eta[i]>=cuts.eta_low && Muon_eta[i]<=cuts.eta_high ) out.add(i);
+  }
+  return out;
+}
+
+void bench_selection(const Binning4D& binning, unsigned int n_events, int seed) {
+
+  cout << "--- Muon selection ---" << endl;
+
+  const MuonCuts cuts = {binning.pt_edges().front(), binning.pt_edges().back(), binning.eta_edges().front(), binning.eta_edges().back()};
+
+  // Events with 0 to 7 muons, flattened as in the NanoAOD baskets. Each cut is passed by 70-95% of the muons,
+  // so that most events are rejected by the exactly-two-muons requirement downstream, as in data
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<unsigned int> n_dist(0, 7);
+  std::uniform_real_distribution<float> u(0., 1.);
+  std::uniform_real_distribution<float> pt_dist( binning.pt_edges().front()-10.0, binning.pt_edges().back()+10.0 );
+  std::uniform_real_distribution<float> eta_dist( binning.eta_edges().front()-0.3, binning.eta_edges().back()+0.3 );
+  vector<unsigned int> nMuon(n_events), offset(n_events+1, 0);
+  for(unsigned int i=0; i<n_events; i++) {
+    nMuon[i] = n_dist(gen);
+    offset[i+1] = offset[i] + nMuon[i];
+  }
+  unsigned int n_muons = offset[n_events];
+  std::unique_ptr<bool[]> looseId(new bool[n_muons]), isGlobal(new bool[n_muons]), highPurity(new bool[n_muons]), mediumId(new bool[n_muons]);
+  vector<float> dxybs(n_muons), iso(n_muons), pt(n_muons), eta(n_muons);
+  for(unsigned int i=0; i<n_muons; i++) {
+    looseId[i]    = u(gen) < 0.95;
+    isGlobal[i]   = u(gen) < 0.9;
+    highPurity[i] = u(gen) < 0.95;
+    mediumId[i]   = u(gen) < 0.85;
+    dxybs[i]      = (u(gen)-0.5)*0.2;
+    iso[i]        = u(gen)*0.5;
+    pt[i]         = pt_dist(gen);
+    eta[i]        = eta_dist(gen);
+  }
+
+  vector<SelectedMuons> out_ref(n_events), out_new(n_events);
+  double rate_ref = events_per_second(n_events, [&]() {
+    for(unsigned int i=0; i<n_events; i++) {
+      unsigned int o = offset[i];
+      out_ref[i] = select_muons_branchy(nMuon[i], &looseId[o], &dxybs[o], &isGlobal[o], &highPurity[o], &mediumId[o], &iso[o], &pt[o], &eta[o], cuts);
+    }
+  });
+  double rate_new = events_per_second(n_events, [&]() {
+    for(unsigned int i=0; i<n_events; i++) {
+      unsigned int o = offset[i];
+      out_new[i] = select_muons(nMuon[i], &looseId[o], &dxybs[o], &isGlobal[o], &highPurity[o], &mediumId[o], &iso[o], &pt[o], &eta[o], cuts);
+    }
+  });
+
+  unsigned int n_diff = 0, n_two = 0;
+  for(unsigned int i=0; i<n_events; i++) {
+    if(out_ref[i].n!=out_new[i].n || out_ref[i].idx[0]!=out_new[i].idx[0] || out_ref[i].idx[1]!=out_new[i].idx[1]) n_diff++;
+    if(out_new[i].n==2) n_two++;
+  }
+
+  cout << "Branchy loop:  " << rate_ref << " events/s" << endl;
+  cout << "select_muons:  " << rate_new << " events/s" << endl;
+  cout << "Speed-up:      " << rate_new/rate_ref << endl;
+  cout << "Two muons:     " << n_two << " / " << n_events << endl;
+  cout << "Differences:   " << n_diff << " / " << n_events << endl;
+}
+
+void bench_mass(const Binning4D& binning, unsigned int n_events, int seed) {
+
+  cout << "--- Dimuon invariant mass (reco and smear0) ---" << endl;
+
+  // Muon pairs in the acceptance, the smear0 pT differ from the reco ones by a few percent
+  const double mmu = 0.105658;
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<float> pt_dist( binning.pt_edges().front(), binning.pt_edges().back() );
+  std::uniform_real_distribution<float> eta_dist( binning.eta_edges().front(), binning.eta_edges().back() );
+  std::uniform_real_distribution<float> phi_dist( -M_PI, M_PI );
+  std::normal_distribution<float> smear_dist( 1.0, 0.02 );
+  vector<float> ptP(n_events), etaP(n_events), phiP(n_events), ptM(n_events), etaM(n_events), phiM(n_events);
+  vector<double> ptP_smear0(n_events), ptM_smear0(n_events);
+  for(unsigned int i=0; i<n_events; i++) {
+    ptP[i]  = pt_dist(gen);
+    etaP[i] = eta_dist(gen);
+    phiP[i] = phi_dist(gen);
+    ptM[i]  = pt_dist(gen);
+    etaM[i] = eta_dist(gen);
+    phiM[i] = phi_dist(gen);
+    ptP_smear0[i] = ptP[i]*smear_dist(gen);
+    ptM_smear0[i] = ptM[i]*smear_dist(gen);
+  }
+
+  vector<float> m_ref(2*n_events), m_new(2*n_events), m_batch(2*n_events);
+  double rate_ref = events_per_second(n_events, [&]() {
+    for(unsigned int i=0; i<n_events; i++) {
+      m_ref[2*i]   = mass_cartesian(ptP[i], etaP[i], phiP[i], mmu, ptM[i], etaM[i], phiM[i], mmu);
+      m_ref[2*i+1] = mass_cartesian(ptP_smear0[i], etaP[i], phiP[i], mmu, ptM_smear0[i], etaM[i], phiM[i], mmu);
+    }
+  });
+  double rate_new = events_per_second(n_events, [&]() {
+    for(unsigned int i=0; i<n_events; i++) {
+      PairGeometry g = pair_geometry(etaP[i], phiP[i], mmu, etaM[i], phiM[i], mmu);
+      m_new[2*i]   = pair_mass(g, ptP[i], ptM[i]);
+      m_new[2*i+1] = pair_mass(g, ptP_smear0[i], ptM_smear0[i]);
+    }
+  });
+  // Blocks of 1024 events, as in the resident mode of massscales_data.cpp
+  const unsigned int block = 1024;
+  vector<PairGeometry> geometry(block);
+  vector<double> ptP_block(block), ptM_block(block), m_reco(block), m_smear0(block);
+  double rate_batch = events_per_second(n_events, [&]() {
+    for(unsigned int first=0; first<n_events; first += block) {
+      unsigned int n = std::min(block, n_events-first);
+      for(unsigned int j=0; j<n; j++) {
+        geometry[j]  = pair_geometry(etaP[first+j], phiP[first+j], mmu, etaM[first+j], phiM[first+j], mmu);
+        ptP_block[j] = ptP[first+j];
+        ptM_block[j] = ptM[first+j];
+      }
+      pair_masses(n, geometry, ptP_block, ptM_block, m_reco);
+      pair_masses(n, geometry, &ptP_smear0[first], &ptM_smear0[first], m_smear0);
+      for(unsigned int j=0; j<n; j++) {
+        m_batch[2*(first+j)]   = m_reco[j];
+        m_batch[2*(first+j)+1] = m_smear0[j];
+      }
+    }
+  });
+
+  // Agreement to float precision: the masses are filled as floats
+  double max_rel = 0.;
+  unsigned int n_diff = 0;
+  for(unsigned int i=0; i<2*n_events; i++) {
+    for(float m : {m_new[i], m_batch[i]}) {
+      double rel = std::abs(double(m) - m_ref[i])/m_ref[i];
+      max_rel = std::max(max_rel, rel);
+      if(rel>2*std::numeric_limits<float>::epsilon()) n_diff++;
+    }
+  }
+
+  cout << "PtEtaPhiM sum:  " << rate_ref << " events/s" << endl;
+  cout << "pair_mass:      " << rate_new << " events/s" << endl;
+  cout << "pair_masses:    " << rate_batch << " events/s" << endl;
+  cout << "Speed-up:       " << rate_new/rate_ref << " (scalar), " << rate_batch/rate_ref << " (batched)" << endl;
+  cout << "Max rel. diff.: " << max_rel << endl;
+  cout << "Differences:    " << n_diff << " / " << 4*n_events << " beyond 2 float ulps" << endl;
+}
+
+int main(int argc, char* argv[]) {
+
+  variables_map vm;
+  try {
+    options_description desc{"Options"};
+    desc.add_options()
+	  ("help,h", "Help screen")
+	  ("nEvents",  value<unsigned int>()->default_value(10000000), "number of events per benchmark")
+	  ("seed",     value<int>()->default_value(4357), "seed for the random kinematics")
+	  ("ptEdges",  value<std::string>()->default_value("25,30,35,40,45,50,55"), "comma-separated muon pT bin edges")
+	  ("etaEdges", value<std::string>()->default_value("-2.4,-2.2,-2.0,-1.8,-1.6,-1.4,-1.2,-1.0,-0.8,-0.6,-0.4,-0.2,0.0,0.2,0.4,0.6,0.8,1.0,1.2,1.4,1.6,1.8,2.0,2.2,2.4"), "comma-separated muon eta bin edges");
+
+    store(parse_command_line(argc, argv, desc), vm);
+    notify(vm);
+    if (vm.count("help")) {
+	  std::cout << desc << '\n';
+	  return 0;
+    }
+  }
+  catch (const error &ex) {
+    std::cerr << ex.what() << '\n';
+  }
+
+  unsigned int n_events = vm["nEvents"].as<unsigned int>();
+  int seed              = vm["seed"].as<int>();
+
+  const Binning4D binning = [&]() {
+    try {
+      return Binning4D::from_strings(vm["ptEdges"].as<std::string>(), vm["etaEdges"].as<std::string>());
+    }
+    catch (const std::invalid_argument &ex) {
+      std::cerr << "Invalid ptEdges/etaEdges: " << ex.what() << '\n';
+      exit(1);
+    }
+  }();
+  bench_binning(binning, n_events, seed);
+  bench_selection(binning, n_events, seed);
+  bench_mass(binning, n_events, seed);
+
+  return 0;
+}
@@ -0,0 +1,142 @@
+// Muon kinematic binning in 4D bins (muon eta+, pt+, eta-, pt-), shared by massscales_data.cpp, massfit.cpp and resolfit.cpp
+// The 4D bin index runs over eta+ (outermost), pt+, eta-, pt- (innermost)
+
+#ifndef BINNING_H
+#define BINNING_H
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+
+// Ordered bin edges, bin i is [edges[i], edges[i+1])
+// Lookup is O(1) for equally spaced edges and O(log n) otherwise
+// At least 2 strictly increasing edges are required, std::invalid_argument is thrown otherwise
+class EdgeAxis {
+
+public:
+  EdgeAxis() : n_(0), uniform_(false), lo_(0.), inv_width_(0.) {}
+  EdgeAxis(const std::vector<float>& edges)
+    : edges_(checked(edges)), n_(edges.size()-1), uniform_(true), lo_(edges[0]), inv_width_(0.)
+  {
+    double width = (double(edges_[n_]) - double(edges_[0]))/n_;
+    for(unsigned int i=0; i<n_; i++) {
+      if( std::abs( double(edges_[i+1]) - double(edges_[i]) - width ) > 1.0e-04*width ) uniform_ = false;
+    }
+    inv_width_ = 1./width;
+  }
+
+  unsigned int n_bins() const { return n_; }
+  bool is_uniform() const { return uniform_; }
+  const std::vector<float>& edges() const { return edges_; }
+
+  // Bin containing x, n_bins() if x is outside [edges[0], edges[n_bins()])
+  unsigned int find(double x) const {
+    if( !(x>=edges_[0] && x<edges_[n_]) ) return n_;
+    if(!uniform_)
+      return std::upper_bound(edges_.begin(), edges_.end(), x, [](double v, float e){ return v<e; }) - edges_.begin() - 1;
+    unsigned int i = (unsigned int)( (x-lo_)*inv_width_ );
+    if(i>=n_) i = n_-1;
+    // Correct for rounding close to an edge, so that edges[i] <= x < edges[i+1] holds exactly
+    if(x<edges_[i]) i--;
+    else if(x>=edges_[i+1]) i++;
+    return i;
+  }
+
+private:
+  static const std::vector<float>& checked(const std::vector<float>& edges) {
+    if(edges.size()<2) throw std::invalid_argument("at least 2 bin edges are needed, "+std::to_string(edges.size())+" given");
+    for(std::size_t i=0; i+1<edges.size(); i++) {
+      if( !(edges[i]<edges[i+1]) )
+        throw std::invalid_argument("bin edges not strictly increasing: "+std::to_string(edges[i])+" then "+std::to_string(edges[i+1]));
+    }
+    return edges;
+  }
+
+  std::vector<float> edges_;
+  unsigned int n_;
+  bool uniform_;
+  double lo_;
+  double inv_width_;
+};
+
+class Binning4D {
+
+public:
+  Binning4D(const std::vector<float>& pt_edges, const std::vector<float>& eta_edges)
+    : pt_(pt_edges), eta_(eta_edges)
+  {
+    n_bins_ = pt_.n_bins()*pt_.n_bins()*eta_.n_bins()*eta_.n_bins();
+  }
+
+  // Nominal binning of the analysis
+  static Binning4D nominal() {
+    return Binning4D( {25.0, 30.0, 35.0, 40.0, 45.0, 50.0, 55.0},
+                      {-2.4, -2.2, -2.0, -1.8, -1.6, -1.4, -1.2, -1.0, -0.8, -0.6, -0.4, -0.2, 0.0,
+                       0.2, 0.4, 0.6, 0.8, 1.0, 1.2, 1.4, 1.6, 1.8, 2.0, 2.2, 2.4} );
+  }
+
+  // Binning from comma-separated lists of edges, e.g. "25,30,35", std::invalid_argument is thrown for an invalid list
+  static Binning4D from_strings(const std::string& pt_edges, const std::string& eta_edges) {
+    return Binning4D( parse_edges(pt_edges), parse_edges(eta_edges) );
+  }
+
+  // Binning stored in the h_pt_edges/h_eta_edges histograms of massscales_data.cpp
+  template<class H> static Binning4D from_histos(H* h_pt_edges, H* h_eta_edges) {
+    return Binning4D( axis_edges(h_pt_edges), axis_edges(h_eta_edges) );
+  }
+
+  static std::vector<float> parse_edges(const std::string& s) {
+    std::vector<float> out;
+    std::stringstream ss(s);
+    std::string item;
+    while( std::getline(ss, item, ',') ) {
+      if(item.empty()) continue;
+      std::size_t end = 0;
+      float edge = 0.;
+      try { edge = std::stof(item, &end); }
+      catch(const std::exception&) { end = 0; }
+      if(end==0 || end!=item.size()) throw std::invalid_argument("invalid bin edge '"+item+"' in '"+s+"'");
+      out.push_back(edge);
+    }
+    return out;
+  }
+
+  unsigned int n_pt_bins() const { return pt_.n_bins(); }
+  unsigned int n_eta_bins() const { return eta_.n_bins(); }
+  // Number of 4D bins
+  unsigned int n_bins() const { return n_bins_; }
+  const std::vector<float>& pt_edges() const { return pt_.edges(); }
+  const std::vector<float>& eta_edges() const { return eta_.edges(); }
+
+  // n_pt_bins()/n_eta_bins() if outside the binning
+  unsigned int find_pt(double pt) const { return pt_.find(pt); }
+  unsigned int find_eta(double eta) const { return eta_.find(eta); }
+
+  // 4D bin index of a muon pair, n_bins() if any of the two muons is outside the binning
+  unsigned int index(double etaP, double ptP, double etaM, double ptM) const {
+    unsigned int ieta_p = eta_.find(etaP);
+    unsigned int ipt_p  = pt_.find(ptP);
+    unsigned int ieta_m = eta_.find(etaM);
+    unsigned int ipt_m  = pt_.find(ptM);
+    if( ieta_p==eta_.n_bins() || ipt_p==pt_.n_bins() || ieta_m==eta_.n_bins() || ipt_m==pt_.n_bins() ) return n_bins_;
+    return ((ieta_p*pt_.n_bins() + ipt_p)*eta_.n_bins() + ieta_m)*pt_.n_bins() + ipt_m;
+  }
+
+private:
+  template<class H> static std::vector<float> axis_edges(H* h) {
+    std::vector<float> out;
+    for(int i=0; i<h->GetXaxis()->GetNbins(); i++)
+      out.push_back( h->GetXaxis()->GetBinLowEdge(i+1) );
+    out.push_back( h->GetXaxis()->GetBinUpEdge( h->GetXaxis()->GetNbins() ));
+    return out;
+  }
+
+  EdgeAxis pt_;
+  EdgeAxis eta_;
+  unsigned int n_bins_;
+};
+
+#endif
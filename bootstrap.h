@@ -0,0 +1,169 @@
+// Poisson bootstrap replicas of the (4D bin) x (mass) spectra, filled in the data and MC event loops of massscales_data.cpp (nBootstrap)
+// Each selected event enters replica r with the weight w*k_r, k_r ~ Poisson(1) drawn from a counter-based generator seeded by
+// (run, luminosityBlock, event): the replicas do not depend on the threads, the order of the events or the shards, and an event
+// gets the same k_r in every iteration and track fit.
+// The replicas are kept in a TH2F with x: replica, y: 4D bin*x_nbins + mass bin, so that the replicas of a cell are contiguous
+// and accumulated in one vectorizable loop. Only the sums of weights are kept, the mass fits of the replicas use the errors of
+// the nominal spectra.
+
+#ifndef BOOTSTRAP_H
+#define BOOTSTRAP_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "TH2F.h"
+#include "profiler.h"
+#include "ROOT/RDF/RActionImpl.hxx"
+
+// Mixing function of splitmix64
+inline uint64_t bootstrap_mix(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Seed of an event, salt separates the samples (data, MC) whose event numbers may coincide
+inline uint64_t bootstrap_seed(unsigned int run, unsigned int lumi, unsigned long long event, unsigned int salt) {
+  return bootstrap_mix( bootstrap_mix( (uint64_t(run) << 32) ^ lumi ^ (uint64_t(salt) << 62) ) ^ event );
+}
+
+// Poisson(1) for replica r of the event with the given seed: number of thresholds of the cumulative distribution below
+// a 32 bit uniform number (P(k>10) ~ 1e-8 is neglected)
+class Poisson1 {
+
+public:
+  static constexpr unsigned int kMax = 10;
+
+  Poisson1() {
+    double p = std::exp(-1.);
+    double cdf = 0.;
+    for(unsigned int k = 0; k<kMax; k++) {
+      cdf += p;
+      p /= double(k+1);
+      thresholds_[k] = uint32_t( std::min(cdf*4294967296., 4294967295.) );
+    }
+  }
+
+  unsigned int operator()(uint64_t seed, unsigned int r) const {
+    uint32_t u = uint32_t( bootstrap_mix(seed + (uint64_t(r)+1)*0x9e3779b97f4a7c15ULL) >> 32 );
+    unsigned int k = 0;
+    for(unsigned int j = 0; j<kMax; j++) k += u>=thresholds_[j];
+    return k;
+  }
+
+private:
+  uint32_t thresholds_[kMax];
+};
+
+// Sums of weights of replica r in the mass bins of a 4D bin, rebinned by rebin as TH1::Rebin
+inline void replica_spectrum(const TH2F* h, unsigned int x_nbins, unsigned int ibin, unsigned int r, int rebin, std::vector<double>& out) {
+  unsigned int n_replicas = h->GetXaxis()->GetNbins();
+  const float* arr = h->GetArray();
+  out.assign(x_nbins/rebin, 0.);
+  for(unsigned int m = 0; m<out.size()*rebin; m++)
+    out[m/rebin] += arr[(r+1) + (n_replicas+2)*(ibin*x_nbins + m + 1)];
+}
+
+// RDataFrame action filling the replicas of a (4D bin) x (mass) spectrum: each slot buffers its fills (cell, weight, seed),
+// the buffers are sorted by cell and added to the shared TH2F by partitions of cells, each with its own lock
+class BootstrapFillHelper : public ROOT::Detail::RDF::RActionImpl<BootstrapFillHelper> {
+
+public:
+  using Result_t = TH2F;
+
+  BootstrapFillHelper(const std::string& name, unsigned int n_bins, unsigned int x_nbins, double x_low, double x_high, unsigned int n_replicas,
+                      unsigned int n_slots, unsigned int buffer_size = 4096, unsigned int n_partitions = 64)
+    : n_bins_(n_bins), x_nbins_(x_nbins), x_low_(x_low), x_high_(x_high), n_replicas_(n_replicas), buffer_size_(buffer_size),
+      profile_id_(NodeProfiler::instance().node(name, "Action"))
+  {
+    result_ = std::make_shared<TH2F>(name.c_str(), Form("%u Poisson bootstrap replicas; replica; 4D bin*%u + mass bin", n_replicas, x_nbins),
+                                     n_replicas, 0, double(n_replicas), n_bins*x_nbins, 0, double(n_bins*x_nbins));
+    result_->SetDirectory(0);
+    unsigned int n_cells = n_bins*x_nbins;
+    n_partitions_ = n_partitions<n_cells ? n_partitions : n_cells;
+    partition_width_ = (n_cells + n_partitions_-1)/n_partitions_;
+    locks_.reset( new std::mutex[n_partitions_] );
+    buffers_.resize(n_slots);
+    for(auto& b : buffers_) b.reserve(buffer_size_);
+    n_fills_.assign(n_slots, 0);
+  }
+  BootstrapFillHelper(BootstrapFillHelper&&) = default;
+  BootstrapFillHelper(const BootstrapFillHelper&) = delete;
+
+  std::shared_ptr<TH2F> GetResultPtr() const { return result_; }
+  void Initialize() {}
+  void InitTask(TTreeReader*, unsigned int) {}
+
+  // Events outside the 4D bins or the mass range are not kept (the mass fits do not use the under/overflows)
+  template<class X, class W> void Exec(unsigned int slot, unsigned int ibin, X x, W w, ULong64_t seed) {
+    NodeProfiler::Scope scope(profile_id_);
+    if(ibin>=n_bins_ || !(x>=x_low_ && x<x_high_)) return;
+    unsigned int m = (unsigned int)( x_nbins_*(x-x_low_)/(x_high_-x_low_) );
+    if(m>=x_nbins_) m = x_nbins_-1;
+    std::vector<Fill>& b = buffers_[slot];
+    b.push_back( {ibin*x_nbins_ + m, float(w), seed} );
+    n_fills_[slot]++;
+    if(b.size()>=buffer_size_) flush(slot);
+  }
+
+  void Finalize() {
+    unsigned long long n_fills = 0;
+    for(unsigned int slot = 0; slot<buffers_.size(); slot++) {
+      flush(slot);
+      n_fills += n_fills_[slot];
+    }
+    result_->SetEntries(n_fills);
+  }
+
+  std::string GetActionName() { return "BootstrapFill"; }
+
+private:
+  struct Fill {
+    unsigned int cell;
+    float w;
+    uint64_t seed;
+  };
+
+  // The replicas of a cell are contiguous in the array of the TH2F
+  float* record(unsigned int cell) { return result_->GetArray() + (n_replicas_+2)*(cell+1) + 1; }
+
+  void flush(unsigned int slot) {
+    std::vector<Fill>& b = buffers_[slot];
+    std::sort(b.begin(), b.end(), [](const Fill& a, const Fill& c) { return a.cell<c.cell; });
+    std::vector<float> k(n_replicas_);
+    auto it = b.begin();
+    while(it!=b.end()) {
+      unsigned int p = it->cell/partition_width_;
+      std::lock_guard<std::mutex> lock(locks_[p]);
+      for(; it!=b.end() && it->cell/partition_width_==p; ++it) {
+        for(unsigned int r = 0; r<n_replicas_; r++) k[r] = float(poisson_(it->seed, r));
+        float* rec = record(it->cell);
+        const float w = it->w;
+        for(unsigned int r = 0; r<n_replicas_; r++) rec[r] += w*k[r];
+      }
+    }
+    b.clear();
+  }
+
+  std::shared_ptr<TH2F> result_;
+  unsigned int n_bins_;
+  unsigned int x_nbins_;
+  double x_low_;
+  double x_high_;
+  unsigned int n_replicas_;
+  unsigned int buffer_size_;
+  unsigned int n_partitions_;
+  unsigned int partition_width_;
+  unsigned int profile_id_;
+  Poisson1 poisson_;
+  std::unique_ptr<std::mutex[]> locks_;
+  std::vector<std::vector<Fill>> buffers_;
+  std::vector<unsigned long long> n_fills_;
+};
+
+#endif
@@ -0,0 +1,269 @@
+// Dimuon candidate and gen matching, shared by the data and MC event loops of massscales_data.cpp
+// Templated on the array type, so that the same code runs on RVecs in the event loop and on std::vectors in benchmarks.cpp
+
+#ifndef DIMUON_H
+#define DIMUON_H
+
+#include <cmath>
+#include <cstdlib>
+#include <array>
+#include <cstdint>
+
+// Indices of the muons passing the selection, only the first two are kept, n counts all of them
+// Fixed size so that the per-event column does not allocate
+struct SelectedMuons {
+  unsigned int n = 0;
+  unsigned int idx[2] = {0, 0};
+  void add(unsigned int i) {
+    if(n<2) idx[n] = i;
+    n++;
+  }
+};
+
+// Cuts of the muon selection, pt and eta ranges from the 4D binning (eta_high is included)
+struct MuonCuts {
+  float pt_low;
+  float pt_high;
+  float eta_low;
+  float eta_high;
+  float dxybs_max = 0.05;
+  float iso_max = 0.15;
+  bool medium_id = true;
+};
+
+// Muons passing the selection, with the same result as the loop applying the cuts one after the other.
+// The cuts are evaluated without branches on blocks of muons into a mask (vectorized by the compiler),
+// the indices of the first two selected muons are then picked from the mask with conditional moves
+template<class VB, class VF> inline SelectedMuons select_muons(unsigned int nMuon, const VB& Muon_looseId, const VF& Muon_dxybs, const VB& Muon_isGlobal,
+                                                               const VB& Muon_highPurity, const VB& Muon_mediumId, const VF& Muon_pfRelIso04_all,
+                                                               const VF& Muon_pt, const VF& Muon_eta, const MuonCuts& cuts) {
+  constexpr unsigned int block = 16;
+  unsigned char pass[block];
+  // idx[2] is the sink of the selected muons after the first two
+  unsigned int idx[3] = {0, 0, 0};
+  unsigned int n = 0;
+  for(unsigned int first = 0; first < nMuon; first += block) {
+    unsigned int size = nMuon - first < block ? nMuon - first : block;
+    for(unsigned int j = 0; j < size; j++) {
+      unsigned int i = first + j;
+      pass[j] = (unsigned char)( bool(Muon_looseId[i]) & (std::abs(Muon_dxybs[i]) < cuts.dxybs_max) & bool(Muon_isGlobal[i]) & bool(Muon_highPurity[i]) &
+                                 (bool(Muon_mediumId[i]) | !cuts.medium_id) & (Muon_pfRelIso04_all[i] < cuts.iso_max) &
+                                 (Muon_pt[i] >= cuts.pt_low) & (Muon_pt[i] < cuts.pt_high) & (Muon_eta[i] >= cuts.eta_low) & (Muon_eta[i] <= cuts.eta_high) );
+    }
+    for(unsigned int j = 0; j < size; j++) {
+      unsigned int slot = n < 2 ? n : 2;
+      idx[slot] = pass[j] ? first + j : idx[slot];
+      n += pass[j];
+    }
+  }
+  SelectedMuons out;
+  out.n = n;
+  out.idx[0] = idx[0];
+  out.idx[1] = idx[1];
+  return out;
+}
+
+// Muons passing the cuts of the selection which do not depend on the track fit (ID, dxybs, isolation), one bit per muon
+// Computed once per event for the selections of both track fits (dualTrackFit), the events with more than 64 muons are flagged
+// and selected with select_muons
+struct MuonIdMask {
+  uint64_t bits = 0;
+  bool overflow = false;
+};
+
+template<class VB, class VF> inline MuonIdMask muon_id_mask(unsigned int nMuon, const VB& Muon_looseId, const VF& Muon_dxybs, const VB& Muon_isGlobal,
+                                                            const VB& Muon_highPurity, const VB& Muon_mediumId, const VF& Muon_pfRelIso04_all,
+                                                            const MuonCuts& cuts) {
+  MuonIdMask out;
+  out.overflow = nMuon > 64;
+  unsigned int n = out.overflow ? 64 : nMuon;
+  for(unsigned int i = 0; i < n; i++) {
+    bool pass = bool(Muon_looseId[i]) & (std::abs(Muon_dxybs[i]) < cuts.dxybs_max) & bool(Muon_isGlobal[i]) & bool(Muon_highPurity[i]) &
+                (bool(Muon_mediumId[i]) | !cuts.medium_id) & (Muon_pfRelIso04_all[i] < cuts.iso_max);
+    out.bits |= uint64_t(pass) << i;
+  }
+  return out;
+}
+
+// Muons passing the selection from the mask of muon_id_mask (not overflowing) and the pt and eta of a track fit, the same as select_muons
+template<class VF> inline SelectedMuons select_muons(const MuonIdMask& id, unsigned int nMuon, const VF& Muon_pt, const VF& Muon_eta, const MuonCuts& cuts) {
+  unsigned int idx[3] = {0, 0, 0};
+  unsigned int n = 0;
+  for(unsigned int i = 0; i < nMuon; i++) {
+    bool pass = bool((id.bits >> i) & 1) & (Muon_pt[i] >= cuts.pt_low) & (Muon_pt[i] < cuts.pt_high) & (Muon_eta[i] >= cuts.eta_low) & (Muon_eta[i] <= cuts.eta_high);
+    unsigned int slot = n < 2 ? n : 2;
+    idx[slot] = pass ? i : idx[slot];
+    n += pass;
+  }
+  SelectedMuons out;
+  out.n = n;
+  out.idx[0] = idx[0];
+  out.idx[1] = idx[1];
+  return out;
+}
+
+// Selected pair of opposite charge muons, ordered by charge (P: positive, M: negative)
+// Built once per event and read by all the downstream columns
+struct DimuonCandidate {
+  // Indices of the muons in the Muon_ arrays
+  unsigned int idxP = 0;
+  unsigned int idxM = 0;
+  // Reco kinematics, k is the curvature 1/pt
+  float ptP = 0.;
+  float ptM = 0.;
+  float kP = 0.;
+  float kM = 0.;
+  float etaP = 0.;
+  float etaM = 0.;
+  float phiP = 0.;
+  float phiM = 0.;
+  float massP = 0.;
+  float massM = 0.;
+  // Gen kinematics (MC only), gen_ok is true if both muons are matched to a gen muon with pT > 10 GeV
+  bool gen_ok = false;
+  float gkP = 0.;
+  float gkM = 0.;
+  float gen_m = 0.;
+};
+
+// Dimuon masses of a candidate matched to gen: m[0] is gen, m[1] reco, m[2] smear0 (the positions in idx_map of massscales_data.cpp)
+struct DimuonMasses {
+  bool ok = false;
+  std::array<float, 3> m = {{0., 0., 0.}};
+};
+
+// Angular terms of the invariant mass of a pair of particles, which do not depend on their pT:
+// m^2 = m1^2 + m2^2 + 2*(E1*E2 - pt1*pt2*(cos(dphi) + sinh(eta1)*sinh(eta2))), with E = sqrt(pt^2*cosh(eta)^2 + m^2).
+// Computed once per pair and shared by the masses with different pT of the same muons (reco and smear0)
+struct PairGeometry {
+  double cosh2_1 = 0.;
+  double cosh2_2 = 0.;
+  double cos_angle = 0.;
+  double m2_1 = 0.;
+  double m2_2 = 0.;
+};
+
+inline PairGeometry pair_geometry(double eta1, double phi1, double m1, double eta2, double phi2, double m2) {
+  PairGeometry g;
+  double cosh1 = std::cosh(eta1);
+  double cosh2 = std::cosh(eta2);
+  g.cosh2_1 = cosh1*cosh1;
+  g.cosh2_2 = cosh2*cosh2;
+  g.cos_angle = std::cos(phi1 - phi2) + std::sinh(eta1)*std::sinh(eta2);
+  g.m2_1 = m1*m1;
+  g.m2_2 = m2*m2;
+  return g;
+}
+
+// Invariant mass of the pair for the given pT, the same as ROOT::Math::PtEtaPhiMVector (p1 + p2).M() to float precision
+inline double pair_mass(const PairGeometry& g, double pt1, double pt2) {
+  double e1 = std::sqrt(pt1*pt1*g.cosh2_1 + g.m2_1);
+  double e2 = std::sqrt(pt2*pt2*g.cosh2_2 + g.m2_2);
+  double mm = g.m2_1 + g.m2_2 + 2.*(e1*e2 - pt1*pt2*g.cos_angle);
+  return mm>=0. ? std::sqrt(mm) : -std::sqrt(-mm);
+}
+
+inline double pair_mass(double pt1, double eta1, double phi1, double m1, double pt2, double eta2, double phi2, double m2) {
+  return pair_mass(pair_geometry(eta1, phi1, m1, eta2, phi2, m2), pt1, pt2);
+}
+
+// Batched variant over n pairs (structure of arrays), the loop has no branches and is vectorized by the compiler
+template<class VG, class VF, class VD> inline void pair_masses(unsigned int n, const VG& geometry, const VF& pt1, const VF& pt2, VD& out) {
+  for(unsigned int i = 0; i < n; i++) {
+    const PairGeometry& g = geometry[i];
+    double e1 = std::sqrt(pt1[i]*pt1[i]*g.cosh2_1 + g.m2_1);
+    double e2 = std::sqrt(pt2[i]*pt2[i]*g.cosh2_2 + g.m2_2);
+    double mm = g.m2_1 + g.m2_2 + 2.*(e1*e2 - pt1[i]*pt2[i]*g.cos_angle);
+    out[i] = std::copysign(std::sqrt(std::abs(mm)), mm);
+  }
+}
+
+// Final state gen muon from the hard process or from a prompt decay
+template<class VI> inline bool is_good_gen_muon(unsigned int i, const VI& GenPart_status, const VI& GenPart_statusFlags, const VI& GenPart_pdgId) {
+  return GenPart_status[i]==1 && (GenPart_statusFlags[i] & 1 || (GenPart_statusFlags[i] & (1<<5))) && std::abs(GenPart_pdgId[i])==13;
+}
+
+// DeltaR^2 with the same phi wrapping as ROOT::Math::VectorUtil::DeltaR
+inline double delta_r2(double eta1, double phi1, double eta2, double phi2) {
+  double dphi = phi2 - phi1;
+  dphi += (dphi <= -M_PI ? 2*M_PI : 0.) - (dphi > M_PI ? 2*M_PI : 0.);
+  double deta = eta2 - eta1;
+  return dphi*dphi + deta*deta;
+}
+
+// Indices of the gen muons matched to the P and M reco muons by DeltaR, -1 if not matched
+// A gen muon is matched to P if it is within dr_max of P but not of M (and vice versa), the last one wins.
+// The loop has no branches so that it is vectorized over the gen particles
+template<class VI, class VF> inline void match_gen_dr(const DimuonCandidate& cand, unsigned int nGenPart,
+                                                      const VI& GenPart_status, const VI& GenPart_statusFlags, const VI& GenPart_pdgId,
+                                                      const VF& GenPart_eta, const VF& GenPart_phi,
+                                                      int& igenP, int& igenM, double dr_max = 0.1) {
+  double dr2_max = dr_max*dr_max;
+  igenP = -1;
+  igenM = -1;
+  for(unsigned int i = 0; i < nGenPart; i++) {
+    bool good = is_good_gen_muon(i, GenPart_status, GenPart_statusFlags, GenPart_pdgId);
+    double dr2P = delta_r2(cand.etaP, cand.phiP, GenPart_eta[i], GenPart_phi[i]);
+    double dr2M = delta_r2(cand.etaM, cand.phiM, GenPart_eta[i], GenPart_phi[i]);
+    bool isP = good && dr2P < dr2_max && dr2M > dr2_max;
+    bool isM = good && dr2P > dr2_max && dr2M < dr2_max;
+    igenP = isP ? int(i) : igenP;
+    igenM = isM ? int(i) : igenM;
+  }
+}
+
+// Good gen muons of an event (is_good_gen_muon), in the order of the gen particles
+// Computed once per event for the gen matching of both track fits (dualTrackFit), the events with more than kMax are flagged
+// and matched with match_gen_dr over all the gen particles
+struct GenMuons {
+  static constexpr unsigned int kMax = 8;
+  unsigned int n = 0;
+  bool overflow = false;
+  int idx[kMax] = {};
+  float eta[kMax] = {};
+  float phi[kMax] = {};
+};
+
+template<class VI, class VF> inline GenMuons good_gen_muons(unsigned int nGenPart, const VI& GenPart_status, const VI& GenPart_statusFlags, const VI& GenPart_pdgId,
+                                                           const VF& GenPart_eta, const VF& GenPart_phi) {
+  GenMuons out;
+  for(unsigned int i = 0; i < nGenPart; i++) {
+    if( !is_good_gen_muon(i, GenPart_status, GenPart_statusFlags, GenPart_pdgId) ) continue;
+    if(out.n == GenMuons::kMax) {
+      out.overflow = true;
+      break;
+    }
+    out.idx[out.n] = i;
+    out.eta[out.n] = GenPart_eta[i];
+    out.phi[out.n] = GenPart_phi[i];
+    out.n++;
+  }
+  return out;
+}
+
+// The same as match_gen_dr, over the good gen muons of good_gen_muons (not overflowing)
+inline void match_gen_dr(const DimuonCandidate& cand, const GenMuons& gen, int& igenP, int& igenM, double dr_max = 0.1) {
+  double dr2_max = dr_max*dr_max;
+  igenP = -1;
+  igenM = -1;
+  for(unsigned int j = 0; j < gen.n; j++) {
+    double dr2P = delta_r2(cand.etaP, cand.phiP, gen.eta[j], gen.phi[j]);
+    double dr2M = delta_r2(cand.etaM, cand.phiM, gen.eta[j], gen.phi[j]);
+    bool isP = dr2P < dr2_max && dr2M > dr2_max;
+    bool isM = dr2P > dr2_max && dr2M < dr2_max;
+    igenP = isP ? gen.idx[j] : igenP;
+    igenM = isM ? gen.idx[j] : igenM;
+  }
+}
+
+// Indices of the gen muons matched to the P and M reco muons from Muon_genPartIdx, -1 if not matched to a good gen muon
+template<class VI> inline void match_gen_idx(const DimuonCandidate& cand, const VI& Muon_genPartIdx,
+                                             const VI& GenPart_status, const VI& GenPart_statusFlags, const VI& GenPart_pdgId,
+                                             int& igenP, int& igenM) {
+  igenP = Muon_genPartIdx[cand.idxP];
+  igenM = Muon_genPartIdx[cand.idxM];
+  if( igenP>=0 && !is_good_gen_muon(igenP, GenPart_status, GenPart_statusFlags, GenPart_pdgId) ) igenP = -1;
+  if( igenM>=0 && !is_good_gen_muon(igenM, GenPart_status, GenPart_statusFlags, GenPart_pdgId) ) igenM = -1;
+}
+
+#endif
@@ -0,0 +1,214 @@
+// Persisted index of the entries of the NanoAOD input files passing the event selection of massscales_data.cpp (--entryIndex)
+// Written by the first event loop over a set of files, then used by the following ones to iterate only over the selected entries
+// (TEntryList of the chain of the files): the selection nodes still run, and all the branches of the files stay readable.
+// Each input file is recorded with its number of entries, size and UUID, the index is only used if all of them and the
+// selection configuration match, otherwise the event loop runs over all the entries and the index is written again.
+// The event loop gives the selected events as (input file, run, luminosityBlock, event), not as rdfentry_ which does not follow the
+// entries of the chain in multi-threaded event loops: their entries are then found by a single-threaded pass over these three
+// branches of each file, and the index is only written if it gives back as many entries as selected events.
+
+#ifndef ENTRY_INDEX_H
+#define ENTRY_INDEX_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <tuple>
+#include "TFile.h"
+#include "TTree.h"
+#include "TChain.h"
+#include "TNamed.h"
+#include "TEntryList.h"
+#include "TTreeReader.h"
+#include "TTreeReaderValue.h"
+
+class EntryIndex {
+
+public:
+  // Selected event: position of its input file in the index, run, luminosityBlock, event
+  struct Event {
+    unsigned int file;
+    UInt_t run;
+    UInt_t lumi;
+    ULong64_t event;
+    bool operator<(const Event& b) const { return std::tie(file, run, lumi, event)<std::tie(b.file, b.run, b.lumi, b.event); }
+  };
+
+  // path: file of the index, files: input files (patterns already expanded), config: selection configuration
+  EntryIndex(const std::string& path, const std::vector<std::string>& files, const std::string& config)
+    : path_(path), config_(config+"; entries matched by run, luminosityBlock, event"), chain_(new TChain("Events"))
+  {
+    for(const auto& f : files) {
+      std::unique_ptr<TFile> fin(TFile::Open(f.c_str(), "READ"));
+      if(!fin || fin->IsZombie()) {
+        std::cout << "EntryIndex: cannot open " << f << ", not indexed" << std::endl;
+        files_.clear();
+        return;
+      }
+      TTree* t = fin->Get<TTree>("Events");
+      files_.push_back( {f, fin->GetSize(), fin->GetUUID().AsString(), t ? t->GetEntries() : 0} );
+      chain_->Add(f.c_str(), files_.back().entries);
+    }
+    read();
+  }
+
+  // The index matches the input files and the configuration, the chain iterates over the selected entries
+  bool valid() const { return bool(list_); }
+  bool enabled() const { return !files_.empty(); }
+
+  // Chain of the input files, the RDataFrame of the event loop is built on it
+  TChain& chain() { return *chain_; }
+
+  // Number of selected entries in the index
+  long long n_selected() const { return list_ ? list_->GetN() : 0; }
+  long long n_entries() const {
+    long long n = 0;
+    for(const auto& f : files_) n += f.entries;
+    return n;
+  }
+
+  // Position of the input file of a sample of the event loop (ROOT::RDF::RSampleInfo::AsString(): <file>/Events)
+  unsigned int file_id(const std::string& sample) const {
+    for(unsigned int i = 0; i<files_.size(); i++) {
+      if(sample==files_[i].path+"/Events") return i;
+    }
+    std::cerr << "EntryIndex: sample " << sample << " not among the indexed files" << std::endl;
+    exit(1);
+  }
+
+  // Write the index from the selected events (in any order), their entries are those of the files with the same run, luminosityBlock, event
+  void write(std::vector<Event> events) const {
+    if(!enabled()) return;
+    std::sort(events.begin(), events.end());
+    TEntryList all("entries", "selected entries");
+    all.SetDirectory(nullptr);
+    Long64_t n_found = 0;
+    for(unsigned int i = 0; i<files_.size(); i++) {
+      const File& f = files_[i];
+      auto first = std::lower_bound(events.begin(), events.end(), Event{i, 0, 0, 0});
+      auto last  = std::lower_bound(first, events.end(), Event{i+1, 0, 0, 0});
+      TEntryList sub("", "", "Events", f.path.c_str());
+      sub.SetDirectory(nullptr);
+      if(first!=last) {
+        std::unique_ptr<TFile> fin(TFile::Open(f.path.c_str(), "READ"));
+        TTreeReader reader("Events", fin.get());
+        TTreeReaderValue<UInt_t> run(reader, "run");
+        TTreeReaderValue<UInt_t> lumi(reader, "luminosityBlock");
+        TTreeReaderValue<ULong64_t> event(reader, "event");
+        while(reader.Next()) {
+          if(std::binary_search(first, last, Event{i, *run, *lumi, *event})) sub.Enter(reader.GetCurrentEntry());
+        }
+      }
+      n_found += sub.GetN();
+      all.Add(&sub);
+    }
+    // Events not found or duplicated in a file
+    if(n_found!=Long64_t(events.size())) {
+      std::cout << "Entry index " << path_ << " not written: " << n_found << " entries found for " << events.size() << " selected events" << std::endl;
+      return;
+    }
+
+    std::unique_ptr<TFile> fout(TFile::Open(path_.c_str(), "RECREATE"));
+    TNamed("config", config_.c_str()).Write();
+    std::string path;
+    Long64_t size, entries_file;
+    std::string uuid;
+    TTree files("files", "indexed input files");
+    files.Branch("path", &path);
+    files.Branch("size", &size);
+    files.Branch("uuid", &uuid);
+    files.Branch("entries", &entries_file);
+    for(const auto& f : files_) {
+      path = f.path;
+      size = f.size;
+      uuid = f.uuid;
+      entries_file = f.entries;
+      files.Fill();
+    }
+    all.Write();
+    files.Write();
+    fout->Close();
+    std::cout << "Entry index written to " << path_ << ": " << events.size() << " selected entries out of " << n_entries() << std::endl;
+
+    // The index read back has the entries of all the selected events
+    std::unique_ptr<TEntryList> list = load();
+    if(!list || list->GetN()!=Long64_t(events.size())) {
+      std::cerr << "Entry index " << path_ << " read back with " << (list ? list->GetN() : 0) << " entries for " << events.size() << " selected events" << std::endl;
+      exit(1);
+    }
+  }
+
+  // Selected events of an event loop over the index: all the entries of the index pass the selection again
+  void check(ULong64_t n_pass) const {
+    if(!valid()) return;
+    if(Long64_t(n_pass)!=n_selected()) {
+      std::cerr << "Entry index " << path_ << ": " << n_pass << " of the " << n_selected() << " indexed entries pass the selection, remove it to write it again" << std::endl;
+      exit(1);
+    }
+  }
+
+private:
+  struct File {
+    std::string path;
+    Long64_t size;
+    std::string uuid;
+    Long64_t entries;
+  };
+
+  // Read the index, if it exists and matches
+  void read() {
+    list_ = load();
+    if(!list_) return;
+    chain_->SetEntryList(list_.get());
+    std::cout << "Entry index " << path_ << " used: " << n_selected() << " selected entries out of " << n_entries() << std::endl;
+  }
+
+  // List of the entries of the index, nullptr if it does not exist or does not match
+  std::unique_ptr<TEntryList> load() const {
+    std::unique_ptr<TFile> fin(TFile::Open(path_.c_str(), "READ"));
+    if(!fin || fin->IsZombie()) return nullptr;
+    TNamed* config = fin->Get<TNamed>("config");
+    TTree* files = fin->Get<TTree>("files");
+    TEntryList* list = fin->Get<TEntryList>("entries");
+    if(!config || !files || !list) return nullptr;
+    if(config_!=config->GetTitle()) {
+      std::cout << "Entry index " << path_ << " made with another selection, not used" << std::endl;
+      return nullptr;
+    }
+    std::string* path = nullptr;
+    std::string* uuid = nullptr;
+    Long64_t size, entries;
+    files->SetBranchAddress("path", &path);
+    files->SetBranchAddress("uuid", &uuid);
+    files->SetBranchAddress("size", &size);
+    files->SetBranchAddress("entries", &entries);
+    bool match = files->GetEntries()==Long64_t(files_.size());
+    for(Long64_t i = 0; match && i<files->GetEntries(); i++) {
+      files->GetEntry(i);
+      const File& f = files_[i];
+      match = *path==f.path && *uuid==f.uuid && size==f.size && entries==f.entries;
+    }
+    files->ResetBranchAddresses();
+    delete path;
+    delete uuid;
+    if(!match) {
+      std::cout << "Entry index " << path_ << " made with other input files, not used" << std::endl;
+      return nullptr;
+    }
+    std::unique_ptr<TEntryList> out( (TEntryList*)list->Clone() );
+    out->SetDirectory(nullptr);
+    return out;
+  }
+
+  std::string path_;
+  std::string config_;
+  std::vector<File> files_;
+  // The list is used by the chain, declared first to be deleted after it
+  std::unique_ptr<TEntryList> list_;
+  std::unique_ptr<TChain> chain_;
+};
+
+#endif
@@ -0,0 +1,197 @@
+// Partial histograms of blocks of input files of the event loops of iter -1 (data) and 0 (MC) of massscales_data.cpp (--fileCache)
+// The (4D bin) x (mass) histograms filled from a block of input files are written unscaled, in the sparse format of spectra.h, to
+// <dir>/<data|mc>_<hash of the configuration>_<hash of the files>.root, with the path, size, UUID and number of entries of each file
+// of the block and the configuration they depend on (selection, binning, corrections of smear0). The event loops then run over the
+// files without a valid partial only, one block at a time, and the histograms of the iteration are the sum of the partials once every
+// input file is in one: a rerun only reads the files added or changed since (with the other files of the blocks of the changed ones),
+// and a job killed in the middle resumes at the first block not done.
+// Each block costs an event loop (booking, start-up, accumulators): small blocks make a killed job or a changed file cost less to
+// redo, large ones make a run without partials faster, block_size 1 gives one partial per file and 0 one block of all the files.
+// A partial is written to a temporary file and renamed, an interrupted write is never taken for a valid one.
+
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <cstdio>
+#include <cstdint>
+#include <cassert>
+#include <iostream>
+#include <algorithm>
+#include <glob.h>
+#include "TFile.h"
+#include "TTree.h"
+#include "TKey.h"
+#include "TNamed.h"
+#include "TH2D.h"
+#include "spectra.h"
+#include "moments.h"
+
+// 64-bit FNV-1a hash, as hexadecimal string
+inline std::string fnv1a_hex(const std::string& s) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for(unsigned char c : s) {
+    h ^= c;
+    h *= 0x100000001b3ULL;
+  }
+  char out[17];
+  std::snprintf(out, sizeof(out), "%016llx", (unsigned long long)h);
+  return out;
+}
+
+class FileCache {
+
+public:
+  // dir: directory of the partials, files: input files (patterns already expanded), kind: data or mc, config: configuration of the histograms,
+  // block_size: maximum number of files of a block, 0 for all the files without a partial
+  FileCache(const std::string& dir, const std::vector<std::string>& files, const std::string& kind, const std::string& config, unsigned int block_size)
+    : dir_(dir), kind_(kind), config_(config), block_size_(block_size)
+  {
+    std::map<std::string, unsigned int> position;
+    for(const auto& f : files) {
+      std::unique_ptr<TFile> fin(TFile::Open(f.c_str(), "READ"));
+      if(!fin || fin->IsZombie()) std::cout << "FileCache: cannot open " << f << std::endl;
+      assert(fin && !fin->IsZombie());
+      TTree* t = fin->Get<TTree>("Events");
+      File file = {f, Form("%s|%lld|%s|%lld", f.c_str(), fin->GetSize(), fin->GetUUID().AsString(), t ? t->GetEntries() : 0LL), false};
+      position[file.signature] = files_.size();
+      files_.push_back(file);
+    }
+    // Partials of this configuration whose files are all input files unchanged and not in another partial
+    glob_t g;
+    if( glob((dir_+"/"+kind_+"_"+fnv1a_hex(config_)+"_*.root").c_str(), 0, nullptr, &g)==0 ) {
+      std::vector<std::string> names(g.gl_pathv, g.gl_pathv + g.gl_pathc);
+      std::sort(names.begin(), names.end());
+      for(const auto& name : names) {
+        std::vector<std::string> signatures = read_block(name);
+        std::vector<unsigned int> block;
+        for(const auto& s : signatures) {
+          auto it = position.find(s);
+          if(it==position.end() || files_[it->second].cached) break;
+          block.push_back(it->second);
+        }
+        if(signatures.empty() || block.size()!=signatures.size()) {
+          std::cout << "FileCache: " << name << " made from other files, not used" << std::endl;
+          continue;
+        }
+        for(auto i : block) files_[i].cached = true;
+        partials_.push_back(name);
+      }
+    }
+    globfree(&g);
+    std::cout << "FileCache: " << n_cached() << " of " << files_.size() << " " << kind_ << " input files in " << partials_.size() << " partials in " << dir_ << std::endl;
+  }
+
+  bool complete() const { return n_cached()==files_.size(); }
+
+  unsigned int n_cached() const {
+    unsigned int n = 0;
+    for(const auto& f : files_) n += f.cached;
+    return n;
+  }
+
+  // Next block of input files without partial histograms, empty if complete
+  std::vector<std::string> next() const {
+    std::vector<std::string> out;
+    for(const auto& f : files_) {
+      if(block_size_>0 && out.size()==block_size_) break;
+      if(!f.cached) out.push_back(f.path);
+    }
+    return out;
+  }
+
+  // Write the partial histograms (unscaled) filled from a block of input files
+  void write(const std::vector<std::string>& block, const std::vector<TH2D*>& histos2D) {
+    std::string signatures;
+    for(const auto& path : block) {
+      auto it = std::find_if(files_.begin(), files_.end(), [&path](const File& f) { return f.path==path; });
+      assert(it!=files_.end() && !it->cached);
+      signatures += it->signature+"\n";
+    }
+    std::string fname = dir_+"/"+kind_+"_"+fnv1a_hex(config_)+"_"+fnv1a_hex(signatures)+".root";
+    std::string tmp = fname+".tmp";
+    {
+      std::unique_ptr<TFile> fout(TFile::Open(tmp.c_str(), "RECREATE"));
+      assert(fout && !fout->IsZombie());
+      fout->cd();
+      TNamed("config", config_.c_str()).Write();
+      TNamed("files", signatures.c_str()).Write();
+      for(auto h : histos2D) BinSpectra::from_th2(h).write(fout.get());
+      fout->Close();
+    }
+    if(std::rename(tmp.c_str(), fname.c_str())!=0) {
+      std::cout << "FileCache: cannot rename " << tmp << " to " << fname << std::endl;
+      assert(false);
+    }
+    for(auto& f : files_) {
+      if(std::find(block.begin(), block.end(), f.path)!=block.end()) f.cached = true;
+    }
+    partials_.push_back(fname);
+    std::cout << "FileCache: partial histograms of " << block.size() << " files written to " << fname << " (" << n_cached() << "/" << files_.size() << ")" << std::endl;
+  }
+
+  // Sum of the partial histograms of all the input files, the histograms of moments are merged with BinMoments::merge_th2
+  std::vector<TH2D*> merge() const {
+    assert(complete());
+    std::vector<TH2D*> out;
+    for(unsigned int k = 0; k<partials_.size(); k++) {
+      std::unique_ptr<TFile> fin(TFile::Open(partials_[k].c_str(), "READ"));
+      assert(fin && !fin->IsZombie());
+      std::vector<std::string> names;
+      TIter next(fin->GetListOfKeys());
+      while(TKey* key = (TKey*)next()) {
+        if(std::string(key->GetClassName())!="TTree") continue;
+        if(std::find(names.begin(), names.end(), key->GetName())==names.end()) names.push_back(key->GetName());
+      }
+      assert( k==0 || names.size()==out.size() );
+      for(unsigned int j = 0; j<names.size(); j++) {
+        TH2D* h = BinSpectra::read(fin.get(), names[j])->to_th2();
+        if(k==0) out.push_back(h);
+        else {
+          assert( names[j]==out[j]->GetName() );
+          if(is_moments_histo(names[j])) BinMoments::merge_th2(out[j], h);
+          else out[j]->Add(h);
+          delete h;
+        }
+      }
+    }
+    std::cout << "FileCache: merged " << out.size() << " histograms from " << partials_.size() << " partials of " << files_.size() << " " << kind_ << " input files" << std::endl;
+    return out;
+  }
+
+private:
+  struct File {
+    std::string path;
+    std::string signature;
+    bool cached;
+  };
+
+  // Signatures (path, size, UUID, entries) of the files of a partial made with the same configuration, empty otherwise
+  std::vector<std::string> read_block(const std::string& fname) const {
+    std::vector<std::string> out;
+    std::unique_ptr<TFile> fin(TFile::Open(fname.c_str(), "READ"));
+    if(!fin || fin->IsZombie()) return out;
+    TNamed* config = fin->Get<TNamed>("config");
+    TNamed* files = fin->Get<TNamed>("files");
+    if(!config || !files || config_!=config->GetTitle()) return out;
+    std::stringstream ss(files->GetTitle());
+    std::string s;
+    while( std::getline(ss, s) ) {
+      if(!s.empty()) out.push_back(s);
+    }
+    return out;
+  }
+
+  std::string dir_;
+  std::string kind_;
+  std::string config_;
+  unsigned int block_size_;
+  std::vector<File> files_;
+  std::vector<std::string> partials_;
+};
+
+#endif
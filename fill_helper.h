@@ -0,0 +1,214 @@
+// RDataFrame action filling (4D bin) x (mass) TH2Ds with bounded memory per processing slot
+// Histo2D clones the full histogram for each slot and merges the clones at the end of the event loop.
+// Here each slot only keeps a small buffer of (cell, weights) fills, flushed into a single shared store
+// whose 4D bins are split into partitions, each with its own lock. The leftover buffers are merged at the end
+// in parallel over the partitions.
+// Several histograms with the same axes and different weights (channels) can be filled by the same action:
+// the cell is found once per event and the store keeps the sums of weights and of squared weights of all
+// the channels of a cell in one contiguous record.
+
+#ifndef FILL_HELPER_H
+#define FILL_HELPER_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <cassert>
+#include "TH2D.h"
+#include "profiler.h"
+#include "ROOT/RDF/RActionImpl.hxx"
+#include "ROOT/TThreadExecutor.hxx"
+#include "ROOT/TSeq.hxx"
+
+class BinFillHelper : public ROOT::Detail::RDF::RActionImpl<BinFillHelper> {
+
+public:
+  // The result of the action is the histogram of the first channel, the others are returned by channel()
+  using Result_t = TH2D;
+
+  // models: binning, name and title of the output histogram of each channel, all with the same axes
+  // n_slots: number of processing slots of the dataframe
+  BinFillHelper(const std::vector<const TH2D*>& models, unsigned int n_slots, unsigned int buffer_size = 4096, unsigned int n_partitions = 64)
+    : n_channels_(models.size()), n_slots_(n_slots), buffer_size_(buffer_size),
+      profile_id_(NodeProfiler::instance().node(models.at(0)->GetName(), "Action"))
+  {
+    for(const TH2D* model : models) {
+      results_.push_back(std::make_shared<TH2D>(*model));
+      results_.back()->SetDirectory(0);
+      results_.back()->Reset();
+    }
+    const TH2D* h = results_[0].get();
+    nx_ = h->GetXaxis()->GetNbins();
+    ny_ = h->GetYaxis()->GetNbins();
+    x_low_  = h->GetXaxis()->GetXmin();
+    x_high_ = h->GetXaxis()->GetXmax();
+    y_low_  = h->GetYaxis()->GetXmin();
+    y_high_ = h->GetYaxis()->GetXmax();
+    for(const auto& r : results_) {
+      assert( (unsigned int)r->GetXaxis()->GetNbins()==nx_ && r->GetXaxis()->GetXmin()==x_low_ && r->GetXaxis()->GetXmax()==x_high_ );
+      assert( (unsigned int)r->GetYaxis()->GetNbins()==ny_ && r->GetYaxis()->GetXmin()==y_low_ && r->GetYaxis()->GetXmax()==y_high_ );
+    }
+    // Partitions of the x bins (under/overflow included)
+    n_partitions_ = n_partitions<nx_+2 ? n_partitions : nx_+2;
+    partition_width_ = (nx_+2 + n_partitions_-1)/n_partitions_;
+    store_.assign( (nx_+2)*(ny_+2)*2*n_channels_, 0. );
+    locks_.reset( new std::mutex[n_partitions_] );
+    buffers_.resize(n_slots_);
+    sorted_.resize(n_slots_);
+    for(auto& b : buffers_) {
+      b.cells.reserve(buffer_size_);
+      b.weights.reserve(buffer_size_*n_channels_);
+    }
+    n_fills_.assign(n_slots_, 0);
+    weighted_.assign(n_slots_*n_channels_, 0);
+  }
+  BinFillHelper(const TH2D& model, unsigned int n_slots, unsigned int buffer_size = 4096, unsigned int n_partitions = 64)
+    : BinFillHelper(std::vector<const TH2D*>{&model}, n_slots, buffer_size, n_partitions) {}
+  BinFillHelper(BinFillHelper&&) = default;
+  BinFillHelper(const BinFillHelper&) = delete;
+
+  std::shared_ptr<TH2D> GetResultPtr() const { return results_[0]; }
+  // Histogram of channel k, filled at the end of the event loop
+  std::shared_ptr<TH2D> channel(unsigned int k) const { return results_.at(k); }
+  unsigned int n_channels() const { return n_channels_; }
+  void Initialize() {}
+  void InitTask(TTreeReader*, unsigned int) {}
+
+  // One weight per channel
+  template<class X, class Y, class... W> void Exec(unsigned int slot, X x, Y y, W... w) {
+    NodeProfiler::Scope scope(profile_id_);
+    Buffer& b = buffers_[slot];
+    b.cells.push_back( cell(x, y) );
+    const float ws[] = {float(w)...};
+    const bool unit[] = {w==W(1)...};
+    for(unsigned int k = 0; k<n_channels_; k++) {
+      b.weights.push_back(ws[k]);
+      if(!unit[k]) weighted_[slot*n_channels_+k] = 1;
+    }
+    n_fills_[slot]++;
+    if(b.cells.size()>=buffer_size_) flush(slot);
+  }
+
+  void Finalize() {
+    ROOT::TThreadExecutor pool;
+    // Sort the leftover fills of each slot by partition, then add each partition from all the slots
+    pool.Foreach( [this](unsigned int slot) { sort_by_partition(slot); }, ROOT::TSeqU(n_slots_) );
+    pool.Foreach( [this](unsigned int p) {
+      for(unsigned int slot = 0; slot<n_slots_; slot++) add(slot, p);
+    }, ROOT::TSeqU(n_partitions_) );
+
+    unsigned long long n_fills = 0;
+    for(unsigned int slot = 0; slot<n_slots_; slot++) n_fills += n_fills_[slot];
+    unsigned int n_cells = (nx_+2)*(ny_+2);
+    for(unsigned int k = 0; k<n_channels_; k++) {
+      TH2D* h = results_[k].get();
+      bool weighted = false;
+      for(unsigned int slot = 0; slot<n_slots_; slot++) weighted |= weighted_[slot*n_channels_+k];
+      // A weighted fill of a TH2D enables Sumw2, do the same
+      if(weighted) h->Sumw2();
+      double* sumw = h->GetArray();
+      for(unsigned int c = 0; c<n_cells; c++) sumw[c] = store_[(c*n_channels_+k)*2];
+      if(weighted) {
+        double* sumw2 = h->GetSumw2()->GetArray();
+        for(unsigned int c = 0; c<n_cells; c++) sumw2[c] = store_[(c*n_channels_+k)*2+1];
+      }
+      h->ResetStats();
+      h->SetEntries(n_fills);
+    }
+    std::vector<double>().swap(store_);
+  }
+
+  std::string GetActionName() { return "BinFill"; }
+
+private:
+  // Fills of a slot not yet added to the shared store, weights has n_channels_ entries per fill
+  struct Buffer {
+    std::vector<unsigned int> cells;
+    std::vector<float> weights;
+  };
+
+  // Global bin of the TH2D, with the same under/overflow convention as TAxis::FindFixBin
+  template<class X, class Y> unsigned int cell(X x, Y y) const {
+    return find(x, nx_, x_low_, x_high_) + (nx_+2)*find(y, ny_, y_low_, y_high_);
+  }
+  static unsigned int find(double v, unsigned int n, double low, double high) {
+    if(v<low) return 0;
+    if(!(v<high)) return n+1;
+    unsigned int i = 1 + (unsigned int)( n*(v-low)/(high-low) );
+    return i<=n ? i : n;
+  }
+  unsigned int partition(unsigned int cell) const { return (cell%(nx_+2))/partition_width_; }
+
+  // Counting sort of the buffer of a slot by partition, sorted_[slot].offsets[p] is the first fill of partition p
+  void sort_by_partition(unsigned int slot) {
+    Buffer& b = buffers_[slot];
+    Sorted& s = sorted_[slot];
+    s.offsets.assign(n_partitions_+1, 0);
+    for(unsigned int c : b.cells) s.offsets[partition(c)+1]++;
+    for(unsigned int p = 0; p<n_partitions_; p++) s.offsets[p+1] += s.offsets[p];
+    s.fills.cells.resize(b.cells.size());
+    s.fills.weights.resize(b.weights.size());
+    std::vector<unsigned int> pos(s.offsets.begin(), s.offsets.end()-1);
+    for(unsigned int i = 0; i<b.cells.size(); i++) {
+      unsigned int j = pos[partition(b.cells[i])]++;
+      s.fills.cells[j] = b.cells[i];
+      for(unsigned int k = 0; k<n_channels_; k++) s.fills.weights[j*n_channels_+k] = b.weights[i*n_channels_+k];
+    }
+    b.cells.clear();
+    b.weights.clear();
+  }
+
+  // Add the sorted fills of a slot belonging to partition p to the shared store
+  void add(unsigned int slot, unsigned int p) {
+    const Sorted& s = sorted_[slot];
+    if(s.offsets.empty()) return;
+    for(unsigned int i = s.offsets[p]; i<s.offsets[p+1]; i++) {
+      double* record = &store_[s.fills.cells[i]*2*n_channels_];
+      const float* w = &s.fills.weights[i*n_channels_];
+      for(unsigned int k = 0; k<n_channels_; k++) {
+        record[2*k]   += w[k];
+        record[2*k+1] += double(w[k])*w[k];
+      }
+    }
+  }
+
+  void flush(unsigned int slot) {
+    sort_by_partition(slot);
+    for(unsigned int p = 0; p<n_partitions_; p++) {
+      if(sorted_[slot].offsets[p]==sorted_[slot].offsets[p+1]) continue;
+      std::lock_guard<std::mutex> lock(locks_[p]);
+      add(slot, p);
+    }
+    sorted_[slot].offsets.clear();
+  }
+
+  struct Sorted {
+    std::vector<unsigned int> offsets;
+    Buffer fills;
+  };
+
+  std::vector<std::shared_ptr<TH2D>> results_;
+  unsigned int n_channels_;
+  unsigned int n_slots_;
+  unsigned int buffer_size_;
+  unsigned int nx_;
+  unsigned int ny_;
+  double x_low_;
+  double x_high_;
+  double y_low_;
+  double y_high_;
+  unsigned int n_partitions_;
+  unsigned int partition_width_;
+  unsigned int profile_id_;
+  // Shared store, one record per cell of the TH2D arrays: sum of weights and of squared weights of each channel
+  std::vector<double> store_;
+  std::unique_ptr<std::mutex[]> locks_;
+  // Per slot fills not yet added to the shared store
+  std::vector<Buffer> buffers_;
+  std::vector<Sorted> sorted_;
+  std::vector<unsigned long long> n_fills_;
+  std::vector<char> weighted_;
+};
+
+#endif
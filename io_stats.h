@@ -0,0 +1,88 @@
+// Per-branch input counters of the event loops of massscales_data.cpp on NanoAOD (--ioStats)
+// The readers of RDataFrame do not expose their reads, so the counters of a loop are taken from the loop itself and from the baskets of
+// its input trees: the loop counts the entries it processed and the ones passing the trigger filter, after which the muon arrays are read,
+// and the bytes and read calls of the input files are measured around it (TFile counters). For each branch, with a fraction p of the
+// entries of the files read from it, a basket of n entries is counted as loaded with the probability 1-(1-p)^n that one of its entries
+// is read (all of them if p=1), and p of its uncompressed bytes as unpacked. The sum over the branches is compared to the bytes measured.
+// RDataFrame does not time its reads per branch either: the time of the loop per MB read is reported instead.
+
+#ifndef IO_STATS_H
+#define IO_STATS_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <iomanip>
+#include "TFile.h"
+#include "TTree.h"
+#include "TBranch.h"
+
+struct BranchIO {
+  std::string name;
+  double entries = 0.;
+  uint64_t baskets = 0;
+  double baskets_read = 0.;
+  double zip_bytes = 0.;
+  double bytes = 0.;
+};
+
+// Counters of an event loop over the Events trees of files, which read n_read[i] entries of branches[i] out of n_entries
+inline std::vector<BranchIO> loop_branch_io(const std::vector<std::string>& files, const std::vector<std::string>& branches,
+                                            const std::vector<double>& n_read, double n_entries) {
+  std::vector<BranchIO> out(branches.size());
+  for(unsigned int i = 0; i<branches.size(); i++) out[i].name = branches[i];
+  for(const auto& f : files) {
+    std::unique_ptr<TFile> fin(TFile::Open(f.c_str(), "READ"));
+    if(!fin || fin->IsZombie()) continue;
+    TTree* t = fin->Get<TTree>("Events");
+    if(t==nullptr) continue;
+    Long64_t n = t->GetEntries();
+    for(unsigned int i = 0; i<branches.size(); i++) {
+      TBranch* b = t->GetBranch(branches[i].c_str());
+      if(b==nullptr) continue;
+      double p = n_entries>0. ? std::min(1., n_read[i]/n_entries) : 0.;
+      BranchIO& c = out[i];
+      int nb = b->GetWriteBasket();
+      const Long64_t* first = b->GetBasketEntry();
+      const Int_t* zip = b->GetBasketBytes();
+      for(int k = 0; k<nb; k++) {
+        Long64_t n_k = (k+1<nb ? first[k+1] : n) - first[k];
+        double loaded = 1. - std::pow(1.-p, double(n_k));
+        c.baskets_read += loaded;
+        c.zip_bytes += zip[k]*loaded;
+      }
+      c.baskets += nb;
+      c.entries += p*n;
+      c.bytes += p*b->GetTotBytes();
+    }
+  }
+  return out;
+}
+
+// Table of the counters of the branches of a loop, with the entries of the loop and the bytes, read calls and time measured around it
+inline void report_branch_io(std::ostream& os, const std::string& title, double n_entries, double n_trigger, double bytes_read, long long read_calls,
+                             double real_s, const std::vector<BranchIO>& branches) {
+  os << "=== " << title << " ===" << std::endl;
+  os << std::fixed << std::setprecision(3)
+     << "Entries: " << std::setprecision(0) << n_entries << " processed, " << n_trigger << " passing the trigger filter" << std::setprecision(3) << std::endl
+     << "Input files: " << bytes_read*1e-6 << " MB read in " << read_calls << " calls, " << real_s << " s loop ("
+     << (bytes_read>0. ? real_s/(bytes_read*1e-6) : 0.) << " s/MB)" << std::endl;
+  os << std::left << std::setw(24) << "branch" << std::right
+     << std::setw(14) << "entries" << std::setw(10) << "baskets" << std::setw(12) << "loaded" << std::setw(12) << "zip [MB]" << std::setw(12) << "unzip [MB]" << std::endl;
+  BranchIO tot;
+  for(const auto& c : branches) {
+    os << std::left << std::setw(24) << c.name << std::right << std::setprecision(0)
+       << std::setw(14) << c.entries << std::setw(10) << c.baskets << std::setprecision(1) << std::setw(12) << c.baskets_read << std::setprecision(3)
+       << std::setw(12) << c.zip_bytes*1e-6 << std::setw(12) << c.bytes*1e-6 << std::endl;
+    tot.zip_bytes += c.zip_bytes;
+    tot.bytes     += c.bytes;
+  }
+  os << "Total: " << tot.zip_bytes*1e-6 << " MB compressed, " << tot.bytes*1e-6 << " MB unpacked (" << bytes_read*1e-6 << " MB read)" << std::endl;
+  os.unsetf(std::ios::fixed);
+}
+
+#endif
@@ -0,0 +1,232 @@
+// Writes synthetic Z->mumu events with the NanoAOD branches read by massscales_data.cpp, for benchmarks and closure tests without the input files
+// Data and MC are generated from the same model, the data muons get injected pT scale (A,e,M) and resolution (c,d) biases
+// with the conventions of massscales_data.cpp: k_data = (k_gen + (k_reco - k_gen)*sqrt(1 + c + d*k))*(1 + A - e*k + q*M/k), k = 1/pT
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TRandom3.h"
+#include "TMath.h"
+#include "TVector2.h"
+#include <TStopwatch.h>
+#include <Math/Vector4D.h>
+#include <Math/Boost.h>
+#include <iostream>
+#include <string>
+#include <boost/program_options.hpp>
+
+using namespace std;
+using namespace boost::program_options;
+
+constexpr double MZ = 91.1876;
+constexpr double GZ = 2.4952;
+constexpr double MMU = 0.105658;
+constexpr unsigned int kMaxMuons = 16;
+constexpr unsigned int kMaxGenPart = 16;
+
+int main(int argc, char* argv[]) {
+
+  TStopwatch sw;
+  sw.Start();
+
+  variables_map vm;
+  try {
+    options_description desc{"Options"};
+    desc.add_options()
+	  ("help,h", "Help screen")
+	  ("nEvents",    value<unsigned int>()->default_value(1000000), "number of events")
+	  ("seed",       value<int>()->default_value(4357), "seed")
+	  ("isData",     bool_switch()->default_value(false), "data: no gen branches, injected biases applied")
+	  ("output",     value<std::string>()->default_value("fixture.root"), "output file")
+	  ("A",          value<float>()->default_value(0.), "injected A (data only)")
+	  ("e",          value<float>()->default_value(0.), "injected e [GeV] (data only)")
+	  ("M",          value<float>()->default_value(0.), "injected M [1/GeV] (data only)")
+	  ("c",          value<float>()->default_value(0.), "injected c (data only)")
+	  ("d",          value<float>()->default_value(0.), "injected d [GeV] (data only)")
+	  ("resolution", value<float>()->default_value(0.015), "relative curvature resolution of the reco muons")
+	  ("negFrac",    value<float>()->default_value(0.01), "fraction of MC events with negative Generator_weight")
+	  ("fakeMuons",  value<float>()->default_value(1.0), "mean number of additional non-Z muons per event");
+
+    store(parse_command_line(argc, argv, desc), vm);
+    notify(vm);
+    if (vm.count("help")) {
+	  std::cout << desc << '\n';
+	  return 0;
+    }
+  }
+  catch (const error &ex) {
+    std::cerr << ex.what() << '\n';
+  }
+
+  unsigned int nEvents = vm["nEvents"].as<unsigned int>();
+  int seed             = vm["seed"].as<int>();
+  bool isData          = vm["isData"].as<bool>();
+  std::string output   = vm["output"].as<std::string>();
+  float A              = vm["A"].as<float>();
+  float e              = vm["e"].as<float>();
+  float M              = vm["M"].as<float>();
+  float c              = vm["c"].as<float>();
+  float d              = vm["d"].as<float>();
+  float resolution     = vm["resolution"].as<float>();
+  float negFrac        = vm["negFrac"].as<float>();
+  float fakeMuons      = vm["fakeMuons"].as<float>();
+
+  TRandom3 ran(seed);
+
+  TFile* fout = TFile::Open(output.c_str(), "RECREATE");
+  TTree* tree = new TTree("Events", "Events");
+
+  UInt_t run, luminosityBlock;
+  ULong64_t event;
+  UInt_t nMuon;
+  Float_t Muon_pt[kMaxMuons], Muon_eta[kMaxMuons], Muon_phi[kMaxMuons], Muon_mass[kMaxMuons], Muon_dxybs[kMaxMuons], Muon_pfRelIso04_all[kMaxMuons];
+  Int_t Muon_charge[kMaxMuons], Muon_genPartIdx[kMaxMuons];
+  Bool_t Muon_looseId[kMaxMuons], Muon_isGlobal[kMaxMuons], Muon_highPurity[kMaxMuons], Muon_mediumId[kMaxMuons];
+  Bool_t HLT_IsoMu24;
+  Float_t Generator_weight;
+  UInt_t nGenPart;
+  Float_t GenPart_pt[kMaxGenPart], GenPart_eta[kMaxGenPart], GenPart_phi[kMaxGenPart], GenPart_mass[kMaxGenPart];
+  Int_t GenPart_status[kMaxGenPart], GenPart_statusFlags[kMaxGenPart], GenPart_pdgId[kMaxGenPart];
+
+  tree->Branch("run",             &run,             "run/i");
+  tree->Branch("luminosityBlock", &luminosityBlock, "luminosityBlock/i");
+  tree->Branch("event",           &event,           "event/l");
+  tree->Branch("nMuon", &nMuon, "nMuon/i");
+  // The track fits of the input (Muon_, cvh and cvhideal) are the same muons here
+  for(std::string fit : {"", "cvh", "cvhideal"}) {
+    std::string pt  = fit.empty() ? "pt"  : fit+"Pt";
+    std::string eta = fit.empty() ? "eta" : fit+"Eta";
+    std::string phi = fit.empty() ? "phi" : fit+"Phi";
+    tree->Branch(("Muon_"+pt).c_str(),  Muon_pt,  ("Muon_"+pt+"[nMuon]/F").c_str());
+    tree->Branch(("Muon_"+eta).c_str(), Muon_eta, ("Muon_"+eta+"[nMuon]/F").c_str());
+    tree->Branch(("Muon_"+phi).c_str(), Muon_phi, ("Muon_"+phi+"[nMuon]/F").c_str());
+  }
+  tree->Branch("Muon_mass",           Muon_mass,           "Muon_mass[nMuon]/F");
+  tree->Branch("Muon_charge",         Muon_charge,         "Muon_charge[nMuon]/I");
+  tree->Branch("Muon_dxybs",          Muon_dxybs,          "Muon_dxybs[nMuon]/F");
+  tree->Branch("Muon_pfRelIso04_all", Muon_pfRelIso04_all, "Muon_pfRelIso04_all[nMuon]/F");
+  tree->Branch("Muon_looseId",        Muon_looseId,        "Muon_looseId[nMuon]/O");
+  tree->Branch("Muon_isGlobal",       Muon_isGlobal,       "Muon_isGlobal[nMuon]/O");
+  tree->Branch("Muon_highPurity",     Muon_highPurity,     "Muon_highPurity[nMuon]/O");
+  tree->Branch("Muon_mediumId",       Muon_mediumId,       "Muon_mediumId[nMuon]/O");
+  tree->Branch("HLT_IsoMu24",         &HLT_IsoMu24,        "HLT_IsoMu24/O");
+  if(!isData) {
+    tree->Branch("Muon_genPartIdx",     Muon_genPartIdx,     "Muon_genPartIdx[nMuon]/I");
+    tree->Branch("Generator_weight",    &Generator_weight,   "Generator_weight/F");
+    tree->Branch("nGenPart",            &nGenPart,           "nGenPart/i");
+    tree->Branch("GenPart_pt",          GenPart_pt,          "GenPart_pt[nGenPart]/F");
+    tree->Branch("GenPart_eta",         GenPart_eta,         "GenPart_eta[nGenPart]/F");
+    tree->Branch("GenPart_phi",         GenPart_phi,         "GenPart_phi[nGenPart]/F");
+    tree->Branch("GenPart_mass",        GenPart_mass,        "GenPart_mass[nGenPart]/F");
+    tree->Branch("GenPart_status",      GenPart_status,      "GenPart_status[nGenPart]/I");
+    tree->Branch("GenPart_statusFlags", GenPart_statusFlags, "GenPart_statusFlags[nGenPart]/I");
+    tree->Branch("GenPart_pdgId",       GenPart_pdgId,       "GenPart_pdgId[nGenPart]/I");
+  }
+
+  for(unsigned int ievt = 0; ievt<nEvents; ievt++) {
+
+    // Event numbers of the seed, 1000 events per luminosity block
+    run = 1 + seed;
+    luminosityBlock = 1 + ievt/1000;
+    event = ievt;
+
+    // Z boson: Breit-Wigner mass, exponential pT, gaussian rapidity
+    double mZ = 0.;
+    while(mZ<50. || mZ>130.) mZ = ran.BreitWigner(MZ, GZ);
+    double ptZ = ran.Exp(8.0);
+    double yZ  = ran.Gaus(0., 2.0);
+    double phiZ = ran.Uniform(-TMath::Pi(), TMath::Pi());
+    double mtZ = TMath::Sqrt(mZ*mZ + ptZ*ptZ);
+    ROOT::Math::PxPyPzEVector Z(ptZ*TMath::Cos(phiZ), ptZ*TMath::Sin(phiZ), mtZ*TMath::SinH(yZ), mtZ*TMath::CosH(yZ));
+
+    // Isotropic decay in the Z rest frame
+    double cost = ran.Uniform(-1., 1.);
+    double phi  = ran.Uniform(-TMath::Pi(), TMath::Pi());
+    double p    = TMath::Sqrt(0.25*mZ*mZ - MMU*MMU);
+    double sint = TMath::Sqrt(1. - cost*cost);
+    ROOT::Math::PxPyPzEVector muP_rest( p*sint*TMath::Cos(phi), p*sint*TMath::Sin(phi), p*cost, 0.5*mZ);
+    ROOT::Math::PxPyPzEVector muM_rest(-muP_rest.Px(), -muP_rest.Py(), -muP_rest.Pz(), 0.5*mZ);
+    ROOT::Math::Boost boost(Z.BoostToCM());
+    boost.Invert();
+    ROOT::Math::PxPyPzEVector gen[2] = { boost(muP_rest), boost(muM_rest) };
+    int charges[2] = {+1, -1};
+
+    nGenPart = 0;
+    if(!isData) {
+      // Z (not a final state muon) and the two muons from the hard process
+      GenPart_pt[0] = Z.Pt(); GenPart_eta[0] = Z.Eta(); GenPart_phi[0] = Z.Phi(); GenPart_mass[0] = Z.M();
+      GenPart_status[0] = 62; GenPart_statusFlags[0] = 1<<8; GenPart_pdgId[0] = 23;
+      nGenPart = 1;
+      for(unsigned int i = 0; i<2; i++) {
+        GenPart_pt[nGenPart]   = gen[i].Pt();
+        GenPart_eta[nGenPart]  = gen[i].Eta();
+        GenPart_phi[nGenPart]  = gen[i].Phi();
+        GenPart_mass[nGenPart] = MMU;
+        GenPart_status[nGenPart] = 1;
+        GenPart_statusFlags[nGenPart] = 1 | (1<<8);
+        GenPart_pdgId[nGenPart] = -13*charges[i];
+        nGenPart++;
+      }
+      Generator_weight = ran.Uniform()<negFrac ? -1.0 : 1.0;
+    }
+
+    // Reco muons from the Z: gaussian curvature smearing, then the injected biases for data
+    nMuon = 0;
+    for(unsigned int i = 0; i<2; i++) {
+      if(std::abs(gen[i].Eta())>2.5 || gen[i].Pt()<3.) continue;
+      double kgen = 1./gen[i].Pt();
+      double k = kgen*(1. + ran.Gaus(0., resolution));
+      if(isData) {
+        k = kgen + (k - kgen)*TMath::Sqrt( TMath::Max(1. + c + d*k, 0.) );
+        k = k*(1. + A - e*k + charges[i]*M/k);
+      }
+      if(k<=0.) continue;
+      Muon_pt[nMuon]     = 1./k;
+      Muon_eta[nMuon]    = gen[i].Eta() + ran.Gaus(0., 0.001);
+      Muon_phi[nMuon]    = TVector2::Phi_mpi_pi(gen[i].Phi() + ran.Gaus(0., 0.001));
+      Muon_mass[nMuon]   = MMU;
+      Muon_charge[nMuon] = charges[i];
+      Muon_dxybs[nMuon]  = ran.Gaus(0., 0.01);
+      Muon_pfRelIso04_all[nMuon] = ran.Exp(0.03);
+      Muon_looseId[nMuon]    = ran.Uniform()<0.99;
+      Muon_isGlobal[nMuon]   = ran.Uniform()<0.98;
+      Muon_highPurity[nMuon] = ran.Uniform()<0.99;
+      Muon_mediumId[nMuon]   = ran.Uniform()<0.97;
+      Muon_genPartIdx[nMuon] = 1+i;
+      nMuon++;
+    }
+
+    // Additional soft, non-isolated muons not matched to gen
+    unsigned int nFake = ran.Poisson(fakeMuons);
+    for(unsigned int i = 0; i<nFake && nMuon<kMaxMuons; i++) {
+      Muon_pt[nMuon]     = 3. + ran.Exp(5.);
+      Muon_eta[nMuon]    = ran.Uniform(-2.5, 2.5);
+      Muon_phi[nMuon]    = ran.Uniform(-TMath::Pi(), TMath::Pi());
+      Muon_mass[nMuon]   = MMU;
+      Muon_charge[nMuon] = ran.Uniform()<0.5 ? 1 : -1;
+      Muon_dxybs[nMuon]  = ran.Gaus(0., 0.1);
+      Muon_pfRelIso04_all[nMuon] = ran.Exp(0.5);
+      Muon_looseId[nMuon]    = ran.Uniform()<0.8;
+      Muon_isGlobal[nMuon]   = ran.Uniform()<0.7;
+      Muon_highPurity[nMuon] = ran.Uniform()<0.9;
+      Muon_mediumId[nMuon]   = ran.Uniform()<0.6;
+      Muon_genPartIdx[nMuon] = -1;
+      nMuon++;
+    }
+
+    // Trigger on an isolated muon above threshold, with 90% efficiency
+    bool trigger_muon = false;
+    for(unsigned int i = 0; i<nMuon; i++) trigger_muon |= Muon_pt[i]>25. && Muon_pfRelIso04_all[i]<0.15;
+    HLT_IsoMu24 = trigger_muon && ran.Uniform()<0.9;
+
+    tree->Fill();
+  }
+
+  fout->cd();
+  tree->Write();
+  cout << "Written " << tree->GetEntries() << (isData ? " data" : " MC") << " events to " << output << endl;
+  fout->Close();
+
+  sw.Stop();
+  std::cout << "Real time: " << sw.RealTime() << " seconds " << "(CPU time:  " << sw.CpuTime() << " seconds)" << std::endl;
+  return 0;
+}
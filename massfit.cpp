@@ -26,6 +26,7 @@
 #include "Minuit2/FCNGradientBase.h"
 #include <eigen3/Eigen/Core>
 #include <eigen3/Eigen/Dense>
+#include "binning.h"
 
 //#include <Eigen/Core>
 //#include <Eigen/Dense>
@@ -67,24 +68,15 @@ public:
       }
       TH1F* h_pt_edges = (TH1F*)fin->Get("h_pt_edges");
       TH1F* h_eta_edges = (TH1F*)fin->Get("h_eta_edges");
-      unsigned int pt_edges_size  = h_pt_edges->GetXaxis()->GetNbins()+1;
-      unsigned int eta_edges_size = h_eta_edges->GetXaxis()->GetNbins()+1;
-      
-      pt_edges_.reserve( pt_edges_size );
-      for(unsigned int i=0; i<h_pt_edges->GetXaxis()->GetNbins(); i++) 
-        pt_edges_.push_back( h_pt_edges->GetXaxis()->GetBinLowEdge(i+1) );
-      pt_edges_.push_back( h_pt_edges->GetXaxis()->GetBinUpEdge( h_pt_edges->GetXaxis()->GetNbins() ));
-
-      eta_edges_.reserve( eta_edges_size );
-      for(unsigned int i=0; i<h_eta_edges->GetXaxis()->GetNbins(); i++)
-        eta_edges_.push_back( h_eta_edges->GetXaxis()->GetBinLowEdge(i+1) );
-      eta_edges_.push_back( h_eta_edges->GetXaxis()->GetBinUpEdge( h_eta_edges->GetXaxis()->GetNbins() ));
+      Binning4D binning = Binning4D::from_histos(h_pt_edges, h_eta_edges);
+      pt_edges_  = binning.pt_edges();
+      eta_edges_ = binning.eta_edges();
       fin->Close();
     }
     else { // toys mode 
-      pt_edges_  = {25.0, 30.0, 35.0, 40.0, 45.0, 50.0, 55.0}; 
-      eta_edges_ = {-2.4, -2.2, -2.0, -1.8, -1.6, -1.4, -1.2, -1.0, -0.8, -0.6, -0.4, -0.2, 0.0,
-                    0.2, 0.4, 0.6, 0.8, 1.0, 1.2, 1.4, 1.6, 1.8, 2.0, 2.2, 2.4};
+      Binning4D binning = Binning4D::nominal();
+      pt_edges_  = binning.pt_edges();
+      eta_edges_ = binning.eta_edges();
     }
 
     n_pt_bins_  = pt_edges_.size()-1;
@@ -184,6 +176,13 @@ public:
 
       n_dof_ = n_unmasked_bins - n_pars_;
       n_data_ = n_unmasked_bins;
+
+      // Scales of the bootstrap replicas (massscales_data.cpp --nBootstrap), if any
+      TH2D* h_scales_boot = (TH2D*)fin->Get("h_scales_boot");
+      if(h_scales_boot!=0 && h_scales_boot->GetYaxis()->GetNbins()>0) {
+        h_scales_boot_ = (TH2D*)h_scales_boot->Clone();
+        h_scales_boot_->SetDirectory(0);
+      }
 	
       // AeM values used to generate toy in massscales.cpp OR 0 in massscales_data.cpp
       TH1D* h_A_vals = (TH1D*)fin->Get("h_A_vals_nom");
@@ -239,7 +238,18 @@ public:
     
   }
   
-  ~TheoryFcn() { delete ran_;}
+  ~TheoryFcn() { delete ran_; delete h_scales_boot_;}
+
+  // In data mode, number of bootstrap replicas of the scales and function to fit replica r instead of the nominal scales
+  // The errors and masks of the nominal scales are kept
+  unsigned int get_n_replicas(){ return h_scales_boot_ ? h_scales_boot_->GetYaxis()->GetNbins() : 0;}
+  void set_replica(const unsigned int& r) {
+    for(unsigned int ibin=0; ibin<masks_.size(); ibin++) {
+      if( masks_[ibin]<0.5 ) continue;
+      double scale = h_scales_boot_->GetBinContent(ibin+1, r+1);
+      scales2_[ibin] = scale*scale;
+    }
+  }
 
   // In toy mode, function to generate mass scale bias^2 values from given AeM
   void generate_data();
@@ -292,6 +302,7 @@ private:
   vector<double> scales2_;
   vector<double> scales2Err_;
   vector<int> masks_;
+  TH2D* h_scales_boot_ = nullptr;
   vector<float> pt_edges_;
   vector<double> k_edges_;
   vector<double> kmean_vals_;
@@ -502,7 +513,8 @@ int main(int argc, char* argv[]) {
 	    ("run",    value<std::string>()->default_value("closure"), "run of input data")
 	    ("bias",   value<int>()->default_value(0), "bias [-1 for data, >0 for toys: 1 for uniform random bias, 2 for eta dependent bias]")
 	    ("infile", value<std::string>()->default_value("massscales"), "type of input data")
-	    ("seed",   value<int>()->default_value(4357), "seed for random toys with different AeM bias");
+	    ("seed",   value<int>()->default_value(4357), "seed for random toys with different AeM bias")
+	    ("bootstrap", bool_switch()->default_value(false), "data: after the nominal scales, fit the bootstrap replicas of massscales_data.cpp --nBootstrap (one tree entry each), the bootstrap errors are written to h_A_vals_boot, h_e_vals_boot, h_M_vals_boot");
 
     store(parse_command_line(argc, argv, desc), vm);
     notify(vm);
@@ -524,6 +536,7 @@ int main(int argc, char* argv[]) {
   std::string run    = vm["run"].as<std::string>();
   int bias           = vm["bias"].as<int>();
   int seed           = vm["seed"].as<int>();
+  bool bootstrap     = vm["bootstrap"].as<bool>();
 
   TFile* fout = TFile::Open(("./massfit_"+tag+"_"+run+".root").c_str(), "RECREATE");
   
@@ -625,12 +638,22 @@ int main(int argc, char* argv[]) {
   ROOT::Minuit2::MnPrint::SetGlobalLevel(verbosity);
   
   if(bias<0) assert( ntoys == 1); // use ntoys==1 for data
+  // Data: the bootstrap replicas are fitted after the nominal scales, as further toys
+  unsigned int n_replicas = bias<0 && bootstrap ? fFCN->get_n_replicas() : 0;
+  if(bootstrap) cout << "Fitting " << n_replicas << " bootstrap replicas" << endl;
+  ntoys += n_replicas;
+  VectorXd boot_sum  = VectorXd::Zero(n_parameters);
+  VectorXd boot_sum2 = VectorXd::Zero(n_parameters);
   for(unsigned int itoy=0; itoy<ntoys; itoy++) {
 
-    if(itoy%10==0) cout << "Toy " << itoy << " / " << ntoys << endl;
+    if(bias<0 && itoy>0) {
+      if((itoy-1)%10==0) cout << "Replica " << itoy-1 << " / " << n_replicas << endl;
+    }
+    else if(itoy%10==0) cout << "Toy " << itoy << " / " << ntoys-n_replicas << endl;
 
     //fFCN->set_seed(seed);
     if(bias>=0) fFCN->generate_data();
+    else if(itoy>0) fFCN->set_replica(itoy-1);
     
     // Define minimization parameters
     MnUserParameters upar;
@@ -770,6 +793,11 @@ int main(int argc, char* argv[]) {
 
     tree->Fill();
 
+    if(bias<0 && itoy>0) {
+      boot_sum  += x;
+      boot_sum2 += x.cwiseProduct(x);
+    }
+
     // Save covariance and correlation matrices for first toy / data
     if(itoy<1) {   
       TH2D* hcov = new TH2D(Form("hcov_%d", itoy), "", n_parameters, 0, n_parameters, n_parameters, 0, n_parameters);
@@ -887,6 +915,23 @@ int main(int argc, char* argv[]) {
   hpulls->Write();
   hsigma->Write();
 
+  // Bootstrap errors: nominal fit, with the rms of the fits of the replicas as error
+  if(n_replicas>1) {
+    TH1D* h_A_vals_boot = (TH1D*)h_A_vals_fit->Clone("h_A_vals_boot");
+    TH1D* h_e_vals_boot = (TH1D*)h_e_vals_fit->Clone("h_e_vals_boot");
+    TH1D* h_M_vals_boot = (TH1D*)h_M_vals_fit->Clone("h_M_vals_boot");
+    for(unsigned int i = 0 ; i<n_parameters; i++) {
+      double mean = boot_sum(i)/n_replicas;
+      double rms = TMath::Sqrt( TMath::Max(boot_sum2(i)/n_replicas - mean*mean, 0.) * n_replicas/(n_replicas-1) );
+      int ip = i%(n_parameters/3);
+      TH1D* h = i<n_parameters/3 ? h_A_vals_boot : (i<2*n_parameters/3 ? h_e_vals_boot : h_M_vals_boot);
+      h->SetBinError(ip+1, rms);
+    }
+    h_A_vals_boot->Write();
+    h_e_vals_boot->Write();
+    h_M_vals_boot->Write();
+  }
+
   h_A_vals_fit->Write();
   h_e_vals_fit->Write();
   h_M_vals_fit->Write();
@@ -3,11 +3,16 @@
 // Authors: Cristina Alexe, Lorenzo Bianchini
 
 #include <ROOT/RDataFrame.hxx>
+#include <ROOT/RDFHelpers.hxx>
 #include "TFile.h"
+#include "TKey.h"
+#include "TROOT.h"
 #include "TRandom3.h"
 #include "TVector.h"
 #include "TVectorT.h"
 #include "TMath.h"
+#include "TH1D.h"
+#include "TH2D.h"
 #include "TF1.h"
 #include "TF2.h"
 #include "TGraphErrors.h"
@@ -28,7 +33,19 @@
 #include <TStopwatch.h>
 #include <ROOT/RVec.hxx>
 #include <iostream>
-#include <Math/Vector4D.h>
+#include <fstream>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <new>
+#include <cstdlib>
+#include <algorithm>
+#include <array>
+#include <utility>
+#include <functional>
+#include <glob.h>
+#include <sys/stat.h>
+#include <sstream>
 #include <Math/VectorUtil.h>
 #include <boost/program_options.hpp>
 #include "Minuit2/FunctionMinimum.h"
@@ -40,6 +57,16 @@
 #include "Minuit2/FCNGradientBase.h"
 #include <eigen3/Eigen/Core>
 #include <eigen3/Eigen/Dense>
+#include "binning.h"
+#include "dimuon.h"
+#include "spectra.h"
+#include "fill_helper.h"
+#include "profiler.h"
+#include "io_stats.h"
+#include "entry_index.h"
+#include "moments.h"
+#include "bootstrap.h"
+#include "file_cache.h"
 
 //#include <Eigen/Core>
 //#include <Eigen/Dense>
@@ -65,6 +92,508 @@ constexpr double lumiMC2016 = 3.33369e+08/2001.9e+03;
 constexpr double lumiMC2017 = 4.9803e+07/2001.9e+03;
 constexpr double lumiMC2018 = 6.84093e+07/2001.9e+03;
 
+// Heap allocation counter, enabled only around the event loop with --countAllocs
+std::atomic<bool> count_allocs(false);
+std::atomic<unsigned long long> n_allocs(0);
+
+void* operator new(std::size_t size) {
+  if(count_allocs.load(std::memory_order_relaxed)) n_allocs.fetch_add(1, std::memory_order_relaxed);
+  void* p = std::malloc(size>0 ? size : 1);
+  if(!p) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+// Jacobian event weights of a 4D bin (Gaussian and Crystal Ball, scale and width)
+struct JacWeights {
+  float jscale = 0.;
+  float jwidth = 0.;
+  float jscale_cb = 0.;
+  float jwidth_cb = 0.;
+};
+
+// Flat copy of the per 4D bin inputs to the jacobian weights, read by the event loop with integer arithmetic only
+// mean, rms: Gaussian fit of the mass - gen mass distribution, index = 4D bin
+// jscale_cb, jwidth_cb: Crystal Ball jacobians, index = 4D bin * n_dm + mass - gen mass bin
+struct JacTable {
+  unsigned int n_bins;
+  unsigned int n_dm;
+  double dm_low;
+  double dm_high;
+  std::vector<float> mean;
+  std::vector<float> rms;
+  std::vector<float> jscale_cb;
+  std::vector<float> jwidth_cb;
+
+  JacTable(TH1D* h_mean, TH1D* h_rms, TH2D* h_jscale_cb, TH2D* h_jwidth_cb)
+    : n_bins(h_mean->GetXaxis()->GetNbins()), n_dm(h_jscale_cb->GetYaxis()->GetNbins()),
+      dm_low(h_jscale_cb->GetYaxis()->GetXmin()), dm_high(h_jscale_cb->GetYaxis()->GetXmax()),
+      mean(n_bins), rms(n_bins), jscale_cb(n_bins*n_dm), jwidth_cb(n_bins*n_dm)
+  {
+    for(unsigned int i=0; i<n_bins; i++) {
+      mean[i] = h_mean->GetBinContent(i+1);
+      rms[i]  = h_rms->GetBinContent(i+1);
+      for(unsigned int j=0; j<n_dm; j++) {
+        jscale_cb[i*n_dm + j] = h_jscale_cb->GetBinContent(i+1, j+1);
+        jwidth_cb[i*n_dm + j] = h_jwidth_cb->GetBinContent(i+1, j+1);
+      }
+    }
+  }
+
+  // Same as TAxis::FindBin on the equally spaced dm axis, n_dm if under/overflow
+  static unsigned int find_dm(double dm, unsigned int n_dm, double dm_low, double dm_high) {
+    if( !(dm>=dm_low && dm<dm_high) ) return n_dm;
+    unsigned int j = (unsigned int)( n_dm*(dm-dm_low)/(dm_high-dm_low) );
+    return j<n_dm ? j : n_dm-1;
+  }
+  unsigned int find_dm(double dm) const { return find_dm(dm, n_dm, dm_low, dm_high); }
+
+  // Jacobian weights of an event in the 4D bin ibin, zero outside the binning or if the bin has no fit
+  JacWeights weights(unsigned int ibin, float m, float gm) const {
+    JacWeights out;
+    if(ibin>=n_bins) return out;
+    float delta = mean[ibin];
+    float sigma = rms[ibin];
+    if(!(sigma>0.)) return out;
+    out.jscale = +(m - (gm+delta) )*(gm+delta)/sigma/sigma;
+    out.jwidth = +(m - (gm+delta) )*(m - (gm+delta) )/sigma/sigma - 1.0;
+    unsigned int jdm = find_dm(m - gm);
+    if(jdm<n_dm) {
+      out.jscale_cb = jscale_cb[ibin*n_dm + jdm];
+      out.jwidth_cb = jwidth_cb[ibin*n_dm + jdm];
+    }
+    return out;
+  }
+
+  // Sums of the jacobian weights (scale, width, scale_cb, width_cb) of the events of a (4D bin, mass bin) cell, from their moments accumulated in iter 0 (jacFromMoments)
+  // s: sums of w, w*dm, w*dm^2, w*m*dm, w*m over the events, n_cb: sums of w per mass - gen mass bin
+  // With u = dm - delta: jscale = u*(m-u)/sigma^2 = (m*dm - delta*m - u^2)/sigma^2, jwidth = u^2/sigma^2 - 1
+  std::array<double, 4> sums(unsigned int ibin, const std::array<double, 5>& s, const double* n_cb) const {
+    std::array<double, 4> out = {{0., 0., 0., 0.}};
+    if(ibin>=n_bins) return out;
+    double delta = mean[ibin];
+    double sigma = rms[ibin];
+    if(!(sigma>0.)) return out;
+    double u2 = s[2] - 2.*delta*s[1] + delta*delta*s[0];
+    out[0] = (s[3] - delta*s[4] - u2)/sigma/sigma;
+    out[1] = u2/sigma/sigma - s[0];
+    for(unsigned int j=0; j<n_dm; j++) {
+      out[2] += n_cb[j]*jscale_cb[ibin*n_dm + j];
+      out[3] += n_cb[j]*jwidth_cb[ibin*n_dm + j];
+    }
+    return out;
+  }
+};
+
+// Dimuon candidate from the two selected muons, ordered by charge
+DimuonCandidate make_candidate(const SelectedMuons& idxs, const RVecF& Muon_pt, const RVecF& Muon_eta, const RVecF& Muon_phi, const RVecF& Muon_mass, const RVecI& Muon_charge) {
+  DimuonCandidate cand;
+  cand.idxP  = Muon_charge[idxs.idx[0]]>0 ? idxs.idx[0] : idxs.idx[1];
+  cand.idxM  = Muon_charge[idxs.idx[0]]>0 ? idxs.idx[1] : idxs.idx[0];
+  cand.ptP   = Muon_pt[cand.idxP];
+  cand.ptM   = Muon_pt[cand.idxM];
+  cand.kP    = 1./cand.ptP;
+  cand.kM    = 1./cand.ptM;
+  cand.etaP  = Muon_eta[cand.idxP];
+  cand.etaM  = Muon_eta[cand.idxM];
+  cand.phiP  = Muon_phi[cand.idxP];
+  cand.phiM  = Muon_phi[cand.idxM];
+  cand.massP = Muon_mass[cand.idxP];
+  cand.massM = Muon_mass[cand.idxM];
+  return cand;
+}
+
+// Gen kinematics of the candidate from the indices of the matched gen muons (-1 if not matched), with a gen pT cut
+void set_gen(DimuonCandidate& cand, int igenP, int igenM, const RVecF& GenPart_pt, const RVecF& GenPart_eta, const RVecF& GenPart_phi, const RVecF& GenPart_mass) {
+  if(igenP<0 || igenM<0) return;
+  double gptP = GenPart_pt[igenP];
+  double gptM = GenPart_pt[igenM];
+  if( gptP>10. && gptM>10. ) {
+    cand.gen_ok = true;
+    cand.gkP    = 1./gptP;
+    cand.gkM    = 1./gptM;
+    cand.gen_m  = pair_mass( gptP, GenPart_eta[igenP], GenPart_phi[igenP], GenPart_mass[igenP], gptM, GenPart_eta[igenM], GenPart_phi[igenM], GenPart_mass[igenM] );
+  }
+}
+
+// Curvature scale (A,e,M) and resolution (c,d) biases applied to a smear0 variant
+struct SmearParams {
+  VectorXd A, e, M, c, d;
+};
+
+// Curvatures of the smear0 muons: MC curvatures corrected with the curvature scale (A,e,M) and resolution (c,d) biases of the previous iterations
+// Zero if the candidate is not matched to gen or outside the eta binning
+std::array<float, 2> smear_curvatures(const DimuonCandidate& dimuon, const Binning4D& binning,
+                                      const VectorXd& A_vals_fit, const VectorXd& e_vals_fit, const VectorXd& M_vals_fit,
+                                      const VectorXd& c_vals_fit, const VectorXd& d_vals_fit, bool usePrevResolFit) {
+  std::array<float, 2> out = {0.0, 0.0};
+  // gen pT cut
+  if( !dimuon.gen_ok ) return out;
+
+  float kmuP = dimuon.kP;
+  float kmuM = dimuon.kM;
+  float kgmuP = dimuon.gkP;
+  float kgmuM = dimuon.gkM;
+
+  float scale_smear0P = 1.0;
+  float scale_smear0M = 1.0;
+  float resol_smear0P = 0.0;
+  float resol_smear0M = 0.0;
+
+  // AeMcd are eta dependent 
+  unsigned int ietaP = binning.find_eta( dimuon.etaP );
+  unsigned int ietaM = binning.find_eta( dimuon.etaM );
+  if( !(ietaP<binning.n_eta_bins() && ietaM<binning.n_eta_bins()) ) return out;
+
+  // Correct the MC curvature with the curvature scale biases derived in previous iterations (which are respectively equal to (-1)* sum of the pT scale biases from previous iterations)
+  // if usePrevMassFit is false, A,e,M are 0
+  scale_smear0P = (1. + A_vals_fit(ietaP) - e_vals_fit(ietaP)*kmuP + M_vals_fit(ietaP)/kmuP);
+  scale_smear0M = (1. + A_vals_fit(ietaM) - e_vals_fit(ietaM)*kmuM - M_vals_fit(ietaM)/kmuM);
+  if(usePrevResolFit) {
+    // Correct the MC curvature with the resolution biases derived in previous iterations (which are respectively equal to the sum of the resolution biases from previous iterations)  	
+    resol_smear0P = TMath::Sqrt( TMath::Max( 1.0 + c_vals_fit(ietaP) + d_vals_fit(ietaP)*kmuP, 0.0)  ) - 1.0;
+    resol_smear0M = TMath::Sqrt( TMath::Max( 1.0 + c_vals_fit(ietaM) + d_vals_fit(ietaM)*kmuM, 0.0)  ) - 1.0;
+  }
+  out[0] = (kgmuP + (kmuP - kgmuP)*(1.0 + resol_smear0P))*scale_smear0P; // if A,e,M,c,d = 0, kmuPsmear0 = kmuP
+  out[1] = (kgmuM + (kmuM - kgmuM)*(1.0 + resol_smear0M))*scale_smear0M; // if A,e,M,c,d = 0, kmuMsmear0 = kmuM	  
+  return out;
+}
+
+// 4D bin indexes of a candidate, the 1st entry is for reco, the 2nd for smear0
+// Muons without a smeared curvature are put below the pt binning
+std::array<unsigned int, 2> dimuon_indexes(const DimuonCandidate& dimuon, const std::array<float, 2>& ksmear, const Binning4D& binning) {
+  float ksmear0P = ksmear[0]>0. ? ksmear[0] : 1./(binning.pt_edges()[0]-0.01);
+  float ksmear0M = ksmear[1]>0. ? ksmear[1] : 1./(binning.pt_edges()[0]-0.01);
+  return { binning.index(dimuon.etaP, dimuon.ptP, dimuon.etaM, dimuon.ptM), binning.index(dimuon.etaP, 1./ksmear0P, dimuon.etaM, 1./ksmear0M) };
+}
+
+// pT of the smear0 muons, below the pt binning if they have no smeared curvature
+std::array<double, 2> smear0_pts(const std::array<float, 2>& ksmear, const Binning4D& binning) {
+  float ksmear0P = ksmear[0]>0. ? ksmear[0] : 1./(binning.pt_edges()[0]-0.01);
+  float ksmear0M = ksmear[1]>0. ? ksmear[1] : 1./(binning.pt_edges()[0]-0.01);
+  return { 1./ksmear0P, 1./ksmear0M };
+}
+
+// Gen, reco and smear0 masses of a candidate matched to gen
+DimuonMasses dimuon_masses(const DimuonCandidate& dimuon, const std::array<float, 2>& ksmear, const Binning4D& binning) {
+  DimuonMasses out;
+  if( !dimuon.gen_ok ) return out;
+  // reco and smear0 only differ by the pT of the muons
+  PairGeometry geometry = pair_geometry( dimuon.etaP, dimuon.phiP, dimuon.massP, dimuon.etaM, dimuon.phiM, dimuon.massM );
+  std::array<double, 2> pt_smear0 = smear0_pts(ksmear, binning);
+  out.ok = true;
+  out.m[0] = dimuon.gen_m;
+  out.m[1] = pair_mass( geometry, dimuon.ptP, dimuon.ptM );
+  out.m[2] = pair_mass( geometry, pt_smear0[0], pt_smear0[1] );
+  return out;
+}
+
+// Run name of a resident iteration: IterN -> IterN+step, otherwise run_step<step>
+std::string resident_run_name(const std::string& run, int step) {
+  if(run.size()>4 && run.compare(0, 4, "Iter")==0 && run.find_first_not_of("0123456789", 4)==std::string::npos)
+    return "Iter"+std::to_string(std::stoi(run.substr(4))+step);
+  return run+"_step"+std::to_string(step);
+}
+
+// Flat columns of the dimuon skim: reco kinematics of the muons ordered by charge, event weight and, for MC, the gen quantities
+std::vector<std::string> skim_columns(bool isMC) {
+  std::vector<std::string> out = {"ptP", "ptM", "etaP", "etaM", "phiP", "phiM", "massP", "massM", "weight"};
+  if(isMC) {
+    for(auto c : {"gen_ok", "gkP", "gkM", "gen_m"}) out.push_back(c);
+  }
+  return out;
+}
+
+// Columns of the selection which do not depend on the track fit, shared by the graphs of both track fits (dualTrackFit):
+// the ID, dxybs and isolation cuts of the muons (muon_id) and, for the DeltaR gen matching, the good gen muons (gen_muons)
+RNode define_track_fit_independent(RNode d, const MuonCuts& cuts, bool gen_dr) {
+  RNode out = d.Define("muon_id", NodeProfiler::instance().define("muon_id", [cuts](UInt_t nMuon, const RVecB& Muon_looseId, const RVecF& Muon_dxybs, const RVecB& Muon_isGlobal,
+                                    const RVecB& Muon_highPurity, const RVecB& Muon_mediumId, const RVecF& Muon_pfRelIso04_all) -> MuonIdMask
+  {
+    return muon_id_mask(nMuon, Muon_looseId, Muon_dxybs, Muon_isGlobal, Muon_highPurity, Muon_mediumId, Muon_pfRelIso04_all, cuts);
+  }), {"nMuon", "Muon_looseId", "Muon_dxybs", "Muon_isGlobal", "Muon_highPurity", "Muon_mediumId", "Muon_pfRelIso04_all"});
+  if(!gen_dr) return out;
+  return out.Define("gen_muons", NodeProfiler::instance().define("gen_muons", [](UInt_t nGenPart, const RVecI& GenPart_status, const RVecI& GenPart_statusFlags, const RVecI& GenPart_pdgId,
+                                    const RVecF& GenPart_eta, const RVecF& GenPart_phi) -> GenMuons
+  {
+    return good_gen_muons(nGenPart, GenPart_status, GenPart_statusFlags, GenPart_pdgId, GenPart_eta, GenPart_phi);
+  }), {"nGenPart", "GenPart_status", "GenPart_statusFlags", "GenPart_pdgId", "GenPart_eta", "GenPart_phi"});
+}
+
+// Define the indices of the muons passing the selection (select_muons in dimuon.h): the cuts of muon_id and the pt and eta cuts on the given columns
+RNode define_selected_muons(RNode d, const MuonCuts& cuts, const std::string& pt, const std::string& eta) {
+  return d.Define("idxs", NodeProfiler::instance().define("idxs", [cuts](const MuonIdMask& muon_id, UInt_t nMuon, const RVecB& Muon_looseId, const RVecF& Muon_dxybs, const RVecB& Muon_isGlobal,
+                                 const RVecB& Muon_highPurity, const RVecB& Muon_mediumId, const RVecF& Muon_pfRelIso04_all,
+                                 const RVecF& Muon_pt, const RVecF& Muon_eta) -> SelectedMuons
+  {
+    if(muon_id.overflow)
+      return select_muons(nMuon, Muon_looseId, Muon_dxybs, Muon_isGlobal, Muon_highPurity, Muon_mediumId, Muon_pfRelIso04_all, Muon_pt, Muon_eta, cuts);
+    return select_muons(muon_id, nMuon, Muon_pt, Muon_eta, cuts);
+  }), {"muon_id", "nMuon", "Muon_looseId", "Muon_dxybs", "Muon_isGlobal", "Muon_highPurity", "Muon_mediumId", "Muon_pfRelIso04_all", pt, eta});
+}
+
+// Input file and run, luminosityBlock, event of the selected events, from which the entry index is written (entry_index.h)
+RNode define_index_event(RNode d, const EntryIndex* index) {
+  return d.DefinePerSample("index_file", [index](unsigned int, const ROOT::RDF::RSampleInfo& id) -> unsigned int
+  {
+    return index->file_id(id.AsString());
+  }).Define("index_event", NodeProfiler::instance().define("index_event", [](unsigned int file, UInt_t run, UInt_t lumi, ULong64_t event) -> EntryIndex::Event
+  {
+    return {file, run, lumi, event};
+  }), {"index_file", "run", "luminosityBlock", "event"});
+}
+
+// Items of a comma-separated list
+std::vector<std::string> split_list(const std::string& s) {
+  std::vector<std::string> out;
+  std::stringstream ss(s);
+  std::string item;
+  while( std::getline(ss, item, ',') ) {
+    if(!item.empty()) out.push_back(item);
+  }
+  return out;
+}
+
+// Named variation of the muon selection cuts (cutVariations)
+struct CutVariation {
+  std::string name;
+  MuonCuts cuts;
+};
+
+// Variations "name:key=value:key=value,...", each relative to the nominal cuts
+// Keys: dxybs, iso (maximum |dxybs| and relative isolation), mediumId (0/1), ptLow, ptHigh, etaLow, etaHigh
+std::vector<CutVariation> parse_cut_variations(const std::string& s, const MuonCuts& nominal) {
+  std::vector<CutVariation> out;
+  for(const std::string& item : split_list(s)) {
+    std::stringstream ss(item);
+    CutVariation v;
+    v.cuts = nominal;
+    std::getline(ss, v.name, ':');
+    std::string cut;
+    while( std::getline(ss, cut, ':') ) {
+      std::size_t eq = cut.find('=');
+      std::string key = cut.substr(0, eq);
+      std::size_t end = 0;
+      float value = 0.;
+      try { if(eq!=std::string::npos) value = std::stof(cut.substr(eq+1), &end); }
+      catch(const std::exception&) { end = 0; }
+      if(end==0 || end!=cut.size()-eq-1) {
+        std::cerr << "Invalid cut '" << cut << "' in the variation " << v.name << ", expected name:key=value:key=value,... with a number as value" << std::endl;
+        exit(1);
+      }
+      if(key=="dxybs")         v.cuts.dxybs_max = value;
+      else if(key=="iso")      v.cuts.iso_max = value;
+      else if(key=="mediumId") v.cuts.medium_id = value!=0.;
+      else if(key=="ptLow")    v.cuts.pt_low = value;
+      else if(key=="ptHigh")   v.cuts.pt_high = value;
+      else if(key=="etaLow")   v.cuts.eta_low = value;
+      else if(key=="etaHigh")  v.cuts.eta_high = value;
+      else {
+        std::cerr << "Unknown cut " << key << " in the variation " << v.name << ", the keys are dxybs, iso, mediumId, ptLow, ptHigh, etaLow and etaHigh" << std::endl;
+        exit(1);
+      }
+    }
+    out.push_back(v);
+  }
+  return out;
+}
+
+// Vary the selected muons with the cuts of each variation (cutVariations): the columns and results downstream of idxs
+// are varied by RDataFrame, so that the results of all the variations are filled in the same event loop (VariationsFor)
+RNode vary_selected_muons(RNode d, const std::vector<CutVariation>& variations, const std::string& pt, const std::string& eta) {
+  std::vector<std::string> names;
+  std::vector<MuonCuts> cuts;
+  for(const auto& v : variations) {
+    names.push_back(v.name);
+    cuts.push_back(v.cuts);
+  }
+  return d.Vary("idxs", NodeProfiler::instance().define("idxs_varied", [cuts](UInt_t nMuon, const RVecB& Muon_looseId, const RVecF& Muon_dxybs, const RVecB& Muon_isGlobal,
+                                 const RVecB& Muon_highPurity, const RVecB& Muon_mediumId, const RVecF& Muon_pfRelIso04_all,
+                                 const RVecF& Muon_pt, const RVecF& Muon_eta) -> ROOT::RVec<SelectedMuons>
+  {
+    ROOT::RVec<SelectedMuons> out(cuts.size());
+    for(unsigned int i = 0; i<cuts.size(); i++)
+      out[i] = select_muons(nMuon, Muon_looseId, Muon_dxybs, Muon_isGlobal, Muon_highPurity, Muon_mediumId, Muon_pfRelIso04_all, Muon_pt, Muon_eta, cuts[i]);
+    return out;
+  }), {"nMuon", "Muon_looseId", "Muon_dxybs", "Muon_isGlobal", "Muon_highPurity", "Muon_mediumId", "Muon_pfRelIso04_all", pt, eta}, names, "cuts");
+}
+
+// Seed of the bootstrap replicas of an event (bootstrap.h)
+RNode define_bootstrap_seed(RNode d, bool isMC) {
+  return d.Define("boot_seed", NodeProfiler::instance().define("boot_seed", [isMC](UInt_t run, UInt_t lumi, ULong64_t event) -> ULong64_t
+  {
+    return bootstrap_seed(run, lumi, event, isMC);
+  }), {"run", "luminosityBlock", "event"});
+}
+
+// Keep the events passing the trigger with at least 2 muons: only scalar branches are read, the muon arrays of the selection are not read for the other events
+RNode filter_trigger(RNode d) {
+  return d.Filter(NodeProfiler::instance().filter("trigger_filter", [](bool HLT_IsoMu24, UInt_t nMuon) -> bool
+  {
+    return HLT_IsoMu24 && nMuon>=2;
+  }), {"HLT_IsoMu24", "nMuon"});
+}
+
+// Define the skim columns from the dimuon candidate
+RNode define_skim_columns(RNode d, bool isMC) {
+  RNode out = d.Define("ptP",   [](const DimuonCandidate& c) { return c.ptP; },   {"dimuon"})
+               .Define("ptM",   [](const DimuonCandidate& c) { return c.ptM; },   {"dimuon"})
+               .Define("etaP",  [](const DimuonCandidate& c) { return c.etaP; },  {"dimuon"})
+               .Define("etaM",  [](const DimuonCandidate& c) { return c.etaM; },  {"dimuon"})
+               .Define("phiP",  [](const DimuonCandidate& c) { return c.phiP; },  {"dimuon"})
+               .Define("phiM",  [](const DimuonCandidate& c) { return c.phiM; },  {"dimuon"})
+               .Define("massP", [](const DimuonCandidate& c) { return c.massP; }, {"dimuon"})
+               .Define("massM", [](const DimuonCandidate& c) { return c.massM; }, {"dimuon"});
+  if(!isMC) return out;
+  return out.Define("gen_ok", [](const DimuonCandidate& c) { return c.gen_ok; }, {"dimuon"})
+            .Define("gkP",    [](const DimuonCandidate& c) { return c.gkP; },    {"dimuon"})
+            .Define("gkM",    [](const DimuonCandidate& c) { return c.gkM; },    {"dimuon"})
+            .Define("gen_m",  [](const DimuonCandidate& c) { return c.gen_m; },  {"dimuon"});
+}
+
+// Define the dimuon candidate from the skim columns, k is recomputed from pt exactly as in make_candidate
+RNode define_dimuon_from_skim(RNode d, bool isMC) {
+  auto reco = [](float ptP, float ptM, float etaP, float etaM, float phiP, float phiM, float massP, float massM) -> DimuonCandidate
+  {
+    DimuonCandidate cand;
+    cand.ptP   = ptP;
+    cand.ptM   = ptM;
+    cand.kP    = 1./ptP;
+    cand.kM    = 1./ptM;
+    cand.etaP  = etaP;
+    cand.etaM  = etaM;
+    cand.phiP  = phiP;
+    cand.phiM  = phiM;
+    cand.massP = massP;
+    cand.massM = massM;
+    return cand;
+  };
+  if(!isMC) return d.Define("dimuon", reco, {"ptP", "ptM", "etaP", "etaM", "phiP", "phiM", "massP", "massM"});
+  return d.Define("dimuon", [reco](float ptP, float ptM, float etaP, float etaM, float phiP, float phiM, float massP, float massM,
+                                   bool gen_ok, float gkP, float gkM, float gen_m) -> DimuonCandidate
+  {
+    DimuonCandidate cand = reco(ptP, ptM, etaP, etaM, phiP, phiM, massP, massM);
+    cand.gen_ok = gen_ok;
+    cand.gkP    = gkP;
+    cand.gkM    = gkM;
+    cand.gen_m  = gen_m;
+    return cand;
+  }, {"ptP", "ptM", "etaP", "etaM", "phiP", "phiM", "massP", "massM", "gen_ok", "gkP", "gkM", "gen_m"});
+}
+
+// Files matching the patterns, sorted within each pattern
+std::vector<std::string> expand_files(const std::vector<std::string>& patterns) {
+  std::vector<std::string> files;
+  for(const std::string& pattern : patterns) {
+    glob_t g;
+    if( glob(pattern.c_str(), 0, nullptr, &g)==0 ) {
+      std::vector<std::string> matched(g.gl_pathv, g.gl_pathv + g.gl_pathc);
+      std::sort(matched.begin(), matched.end());
+      files.insert(files.end(), matched.begin(), matched.end());
+    }
+    globfree(&g);
+  }
+  return files;
+}
+
+// Files of a shard: the patterns are expanded, sorted, and split in nShards contiguous blocks
+std::vector<std::string> shard_files(const std::vector<std::string>& patterns, int nShards, int shard) {
+  std::vector<std::string> files = expand_files(patterns);
+  std::size_t first = files.size()*shard/nShards;
+  std::size_t last  = files.size()*(shard+1)/nShards;
+  return std::vector<std::string>(files.begin()+first, files.begin()+last);
+}
+
+// A (4D bin) x (mass) histogram booked in an event loop: filled by its own action, or a channel of a BinFillHelper filling several
+struct BookedBinHisto {
+  ROOT::RDF::RResultPtr<TH2D> action;
+  std::shared_ptr<TH2D> channel;
+  // Runs the event loop if it has not run yet
+  TH2D* get() {
+    TH2D* h = action.GetPtr();
+    return channel ? channel.get() : h;
+  }
+};
+
+// Event loop booked but not run yet, with the dataframe it belongs to
+struct BookedLoop {
+  // Index of the selected entries the dataframe may be built on, deleted after it
+  std::unique_ptr<EntryIndex> entry_index;
+  ROOT::RDF::RResultPtr<std::vector<EntryIndex::Event>> selected_events;
+  ROOT::RDF::RResultPtr<ULong64_t> n_indexed_pass;
+  std::unique_ptr<ROOT::RDataFrame> d;
+  // Node after the trigger filter with the columns which do not depend on the track fit (dualTrackFit)
+  std::unique_ptr<RNode> dshared;
+  // Entries processed and passing the trigger filter (ioStats)
+  ROOT::RDF::RResultPtr<ULong64_t> n_io_entries;
+  ROOT::RDF::RResultPtr<ULong64_t> n_io_trigger;
+  std::unique_ptr<RNode> dlast;
+  std::vector< ROOT::RDF::RResultPtr<TH1D> > df_histos1D;
+  std::vector<BookedBinHisto> df_histos2D;
+  std::vector< ROOT::RDF::RResultPtr<TH3D> > df_histos3D;
+  std::vector< ROOT::RDF::Experimental::RResultMap<TH2D> > df_varied;
+  std::vector< ROOT::RDF::RResultPtr<TH2F> > df_boot;
+  ROOT::RDF::RResultPtr<ROOT::RDF::RInterface<ROOT::Detail::RDF::RLoopManager>> skim_snapshot;
+  // NanoAOD input files, empty if the loop reads the skim
+  std::vector<std::string> nano_files;
+};
+
+// Everything depending on the track fit (CVH or KF) in the event loops and fits: the one of the other track fit
+// is kept here in the dual track fit mode and swapped with the current one in the passes done for it
+struct TrackFitState {
+  bool useKf = false;
+  TFile* fout = nullptr;
+  VectorXd A_vals_fit, e_vals_fit, M_vals_fit, c_vals_fit, d_vals_fit;
+  VectorXd A_vals_last, e_vals_last, M_vals_last, c_vals_last, d_vals_last;
+  std::vector<SmearParams> variant_params;
+  TH1F* h_A_vals_prevfit = nullptr;
+  TH1F* h_e_vals_prevfit = nullptr;
+  TH1F* h_M_vals_prevfit = nullptr;
+  TH1F* h_c_vals_prevfit = nullptr;
+  TH1F* h_d_vals_prevfit = nullptr;
+  std::map<std::string, TH1D*> h_map;
+  std::map<std::string, TH2D*> h_jac_map;
+};
+
+// Calls f when going out of scope
+struct OnScopeExit {
+  std::function<void()> f;
+  ~OnScopeExit() { f(); }
+};
+
+template<std::size_t> using WeightColumn = float;
+
+// Book N (4D bin) x (mass) histograms with the same axes, x and y columns and a weight column each
+// With BinFillHelper (bounded memory per slot, one action finding the cell once for the N weights) if fill_buffer>0, with N Histo2D (one clone per slot) otherwise
+// Y is the type of the y column, the x column is the unsigned int 4D bin index and the weight columns are floats
+template<class Y, std::size_t N, std::size_t... I>
+void book_bin_histos(std::vector<BookedBinHisto>& out, RNode& d, const std::array<ROOT::RDF::TH2DModel, N>& models, std::string_view x, std::string_view y,
+                     const std::array<std::string, N>& w, unsigned int n_slots, unsigned int fill_buffer, std::index_sequence<I...>) {
+  if(fill_buffer==0) {
+    for(std::size_t k = 0; k<N; k++) out.push_back( {d.Histo2D(models[k], x, y, w[k]), nullptr} );
+    return;
+  }
+  std::vector<std::shared_ptr<TH2D>> histos;
+  std::vector<const TH2D*> ptrs;
+  for(std::size_t k = 0; k<N; k++) {
+    histos.push_back(models[k].GetHistogram());
+    ptrs.push_back(histos.back().get());
+  }
+  BinFillHelper helper(ptrs, n_slots, fill_buffer);
+  std::vector<std::shared_ptr<TH2D>> channels;
+  for(std::size_t k = 0; k<N; k++) channels.push_back(helper.channel(k));
+  ROOT::RDF::RResultPtr<TH2D> action = d.Book<unsigned int, Y, WeightColumn<I>...>(std::move(helper), {std::string(x), std::string(y), w[I]...});
+  out.push_back( {action, nullptr} );
+  for(std::size_t k = 1; k<N; k++) out.push_back( {action, channels[k]} );
+}
+
+template<class Y, std::size_t N>
+void book_bin_histos(std::vector<BookedBinHisto>& out, RNode& d, const std::array<ROOT::RDF::TH2DModel, N>& models, std::string_view x, std::string_view y,
+                     const std::array<std::string, N>& w, unsigned int n_slots, unsigned int fill_buffer) {
+  book_bin_histos<Y, N>(out, d, models, x, y, w, n_slots, fill_buffer, std::make_index_sequence<N>());
+}
+
 int main(int argc, char* argv[]) {
 
   TStopwatch sw;
@@ -96,10 +625,41 @@ int main(int argc, char* argv[]) {
 	  ("tagPrevMassFit",     value<std::string>()->default_value("closure"), "run type, type of data used")
 	  ("runPrevMassFit",     value<std::string>()->default_value("closure"), "number of iteration")
 	  ("usePrevResolFit",    bool_switch()->default_value(false), "use previous resolution fit")
+	  ("cutVariations",      value<std::string>()->default_value(""), "comma-separated variations of the muon selection name:key=value:... (keys: dxybs, iso, mediumId, ptLow, ptHigh, etaLow, etaHigh), their data and MC spectra are filled in the same event loops and written to the directories cuts_<name>")
+	  ("stepScales",         value<std::string>()->default_value(""), "comma-separated steps s of further smear0 variants filled in the same MC event loops, with A,e,M,c,d = previous iterations + s*(last mass and resolution fits) (nominal smear0: s=1); iter 2 fits the one closest to the data")
 	  ("tagPrevResolFit",    value<std::string>()->default_value("closure"), "run type, type of data used")
 	  ("runPrevResolFit",    value<std::string>()->default_value("closure"), "number of iteration")
 	  ("useKf",              bool_switch()->default_value(false), "use track input from Kalman Filter instead of CVH")
+	  ("dualTrackFit",       bool_switch()->default_value(false), "also build the dimuons of the other track fit (KF, or CVH with useKf) in the same event loops, its histograms and fits are written to massscales_<tag>_<kf|cvh>_<run>.root")
+	  ("useGenPartIdx",      bool_switch()->default_value(false), "match reco to gen muons with Muon_genPartIdx (if present in the input) instead of DeltaR")
 	  ("useCB",              bool_switch()->default_value(false), "under development")
+	  ("writeSkim",          bool_switch()->default_value(false), "write the selected dimuons to a compact skim in skimDir (iter -1 and 0), iter 1 then reads it")
+	  ("readSkim",           bool_switch()->default_value(false), "read the selected dimuons from the skim in skimDir instead of NanoAOD")
+	  ("skimDir",            value<std::string>()->default_value("./"), "directory of the dimuon skim")
+	  ("nResidentIter",      value<int>()->default_value(0), "number of further iterations run in the same process (needs firstIter=-1, lastIter=2): the selected MC dimuons are kept in memory, massfit and resolfit are run in between")
+	  ("massfitArgs",        value<std::string>()->default_value("--ntoys=1 --bias=-1"), "arguments of ./massfit in the resident iterations (tag and run are added)")
+	  ("resolfitArgs",       value<std::string>()->default_value("--ntoys=1 --bias=-1 --maxSigmaErr=0.1"), "arguments of ./resolfit in the resident iterations (tag and run are added)")
+	  ("nBootstrap",         value<int>()->default_value(0), "number of Poisson bootstrap replicas of h_data_bin_m and h_smear0_bin_m filled in the same event loops (bootstrap.h), iter 2 fits each of them (h_scales_boot, h_widths_boot, h_norms_boot)")
+	  ("sparseHistos",       bool_switch()->default_value(false), "write the 4D bin x mass histograms as trees of the populated 4D bins only (spectra.h) instead of TH2D")
+	  ("profile",            bool_switch()->default_value(false), "time the Defines, Filters and fills of the event loops, the report is written to massscales_<tag>_<run>_profile.txt")
+	  ("countAllocs",        bool_switch()->default_value(false), "count the heap allocations in the event loops")
+	  ("entryIndex",         bool_switch()->default_value(false), "iterate only over the NanoAOD entries passing the selection, from an index of each set of input files written in entryIndexDir by the first event loop over them (entry_index.h)")
+	  ("entryIndexDir",      value<std::string>()->default_value("./"), "directory of the entry indexes")
+	  ("ioStats",            bool_switch()->default_value(false), "after each event loop on NanoAOD, write the entries, loaded baskets and bytes of each branch of the selection read by the loop, from its entry counts and the baskets of its input files, with the bytes and read calls measured around it (io_stats.h), to massscales_<tag>_<run>_io.txt")
+	  ("fileCache",          value<std::string>()->default_value(""), "directory of the partial histograms of blocks of input files of iter -1 and 0 (file_cache.h): the event loops only run over the input files without a valid one, then the partials are summed")
+	  ("fileCacheBlock",     value<unsigned int>()->default_value(4), "maximum number of input files per event loop and partial with fileCache, 1 for one partial per file, 0 for all the files without a partial in one event loop")
+	  ("dataFrom",           value<std::string>()->default_value(""), "output file of a previous run whose data histograms of iter -1 are imported instead of filled, if made from the same input files with the same selection and binning (h_data_provenance)")
+	  ("inFilesData",        value<std::string>()->default_value(""), "comma-separated data input files (or patterns) instead of the ones of the year, e.g. from make_fixture")
+	  ("inFilesMC",          value<std::string>()->default_value(""), "comma-separated MC input files (or patterns) instead of the ones of the year")
+	  ("nShards",            value<int>()->default_value(1), "split the input files of iter -1, 0 and 1 in nShards: the histograms of the shard are written to massscales_<tag>_<run>_shard<shard>.root without lumi scaling nor fits")
+	  ("shard",              value<int>()->default_value(0), "shard to run, in [0, nShards)")
+	  ("mergeShards",        value<int>()->default_value(0), "sum the histograms of iter -1, 0 and 1 of this number of shards instead of running the event loops, then scale and fit as usual")
+	  ("concurrentLoops",    bool_switch()->default_value(false), "book the data event loop of iter -1 and run it together with the MC one of iter 0 (needs firstIter=-1, lastIter>=0)")
+	  ("fastMoments",        bool_switch()->default_value(false), "take the Gaussian mean and rms of the mass - gen mass distribution of each 4D bin from its exact moments, filled in the MC event loop of iter 0, instead of fitting them (no Crystal Ball fits)")
+	  ("jacFromMoments",     bool_switch()->default_value(false), "fill the moments of dm and m per 4D bin and mass bin in iter 0 and rebuild the jacobian histograms of iter 1 from them, without the MC event loop of iter 1")
+	  ("fillBuffer",         value<unsigned int>()->default_value(4096), "fills buffered per slot before they are added to the shared 4D bin x mass histograms (fill_helper.h), 0: one Histo2D clone per slot")
+	  ("ptEdges",            value<std::string>()->default_value("25,30,35,40,45,50,55"), "comma-separated muon pT bin edges")
+	  ("etaEdges",           value<std::string>()->default_value("-2.4,-2.2,-2.0,-1.8,-1.6,-1.4,-1.2,-1.0,-0.8,-0.6,-0.4,-0.2,0.0,0.2,0.4,0.6,0.8,1.0,1.2,1.4,1.6,1.8,2.0,2.2,2.4"), "comma-separated muon eta bin edges")
 	  ("scaleToData",        bool_switch()->default_value(false), "scale MC to data in 4D bin")
 	  ("y2016",              bool_switch()->default_value(false), "use 2016 data")
 	  ("y2017",              bool_switch()->default_value(false), "")
@@ -134,8 +694,36 @@ int main(int argc, char* argv[]) {
   bool fitNorm                = vm["fitNorm"].as<bool>();
   bool usePrevMassFit         = vm["usePrevMassFit"].as<bool>();
   bool usePrevResolFit        = vm["usePrevResolFit"].as<bool>();
+  std::string stepScales      = vm["stepScales"].as<std::string>();
+  std::string cutVariations   = vm["cutVariations"].as<std::string>();
   bool useKf                  = vm["useKf"].as<bool>();
+  bool dualTrackFit           = vm["dualTrackFit"].as<bool>();
+  bool useGenPartIdx          = vm["useGenPartIdx"].as<bool>();
   bool useCB                  = vm["useCB"].as<bool>();
+  bool countAllocs            = vm["countAllocs"].as<bool>();
+  bool profile                = vm["profile"].as<bool>();
+  bool ioStats                = vm["ioStats"].as<bool>();
+  bool entryIndex             = vm["entryIndex"].as<bool>();
+  std::string entryIndexDir   = vm["entryIndexDir"].as<std::string>();
+  bool sparseHistos           = vm["sparseHistos"].as<bool>();
+  unsigned int fillBuffer     = vm["fillBuffer"].as<unsigned int>();
+  bool jacFromMoments         = vm["jacFromMoments"].as<bool>();
+  bool fastMoments            = vm["fastMoments"].as<bool>();
+  bool concurrentLoops        = vm["concurrentLoops"].as<bool>();
+  std::string fileCache       = vm["fileCache"].as<std::string>();
+  unsigned int fileCacheBlock = vm["fileCacheBlock"].as<unsigned int>();
+  std::string inFilesData     = vm["inFilesData"].as<std::string>();
+  std::string inFilesMC       = vm["inFilesMC"].as<std::string>();
+  int nShards                 = vm["nShards"].as<int>();
+  int shard                   = vm["shard"].as<int>();
+  int mergeShards             = vm["mergeShards"].as<int>();
+  bool writeSkim              = vm["writeSkim"].as<bool>();
+  bool readSkim               = vm["readSkim"].as<bool>();
+  std::string skimDir         = vm["skimDir"].as<std::string>();
+  int nResidentIter           = vm["nResidentIter"].as<int>();
+  int nBootstrap              = vm["nBootstrap"].as<int>();
+  std::string massfitArgs     = vm["massfitArgs"].as<std::string>();
+  std::string resolfitArgs    = vm["resolfitArgs"].as<std::string>();
   bool y2016                  = vm["y2016"].as<bool>();
   bool y2017                  = vm["y2017"].as<bool>();
   bool y2018                  = vm["y2018"].as<bool>();
@@ -145,21 +733,83 @@ int main(int argc, char* argv[]) {
   std::string runPrevResolFit = vm["runPrevResolFit"].as<std::string>();
   bool scaleToData            = vm["scaleToData"].as<bool>();
   float maxRMS                = vm["maxRMS"].as<float>();
+  std::string ptEdges         = vm["ptEdges"].as<std::string>();
+  std::string etaEdges        = vm["etaEdges"].as<std::string>();
   
-  assert( firstIter>=-1 && lastIter<=2 && firstIter<lastIter );
+  assert( firstIter>=-1 && lastIter<=2 && firstIter<=lastIter );
   assert( y2016 || y2017 || y2018 );
+  assert( !(writeSkim && readSkim) );
+  assert( nResidentIter==0 || (firstIter==-1 && lastIter==2) );
+  assert( nShards>=1 && shard>=0 && shard<nShards && (nShards==1 || (lastIter<2 && mergeShards==0 && nResidentIter==0)) );
+  assert( mergeShards==0 || nResidentIter==0 );
+  assert( !jacFromMoments || nShards==1 || lastIter<1 );
+  assert( !(fastMoments && useCB) );
+  assert( stepScales.empty() || nResidentIter==0 );
+  assert( nBootstrap==0 || (nShards==1 && mergeShards==0 && nResidentIter==0 && !readSkim) );
+  assert( cutVariations.empty() || (nShards==1 && mergeShards==0 && nResidentIter==0 && !readSkim && !entryIndex) );
+  assert( !dualTrackFit || (nShards==1 && mergeShards==0 && nResidentIter==0 && !writeSkim && !readSkim && !concurrentLoops && !entryIndex) );
+  assert( fileCache.empty() || (nShards==1 && mergeShards==0 && nResidentIter==0 && !writeSkim && !readSkim && !concurrentLoops && !entryIndex
+                                && !dualTrackFit && cutVariations.empty() && nBootstrap==0) );
+  assert( dataFrom.empty() || (nShards==1 && mergeShards==0 && !writeSkim && !dualTrackFit && cutVariations.empty() && nBootstrap==0) );
+
+  // Binning schema in muon kinematics, written to the output file and read back by massfit.cpp and resolfit.cpp
+  const Binning4D binning = [&]() {
+    try {
+      return Binning4D::from_strings(ptEdges, etaEdges);
+    }
+    catch (const std::invalid_argument &ex) {
+      std::cerr << "Invalid ptEdges/etaEdges: " << ex.what() << '\n';
+      exit(1);
+    }
+  }();
+  const vector<float>& pt_edges  = binning.pt_edges();
+  const vector<float>& eta_edges = binning.eta_edges();
+  // Profiler of the nodes of the event loops, the wrappers only forward the calls if not enabled
+  NodeProfiler& prof = NodeProfiler::instance();
+  prof.enable(profile);
+  std::string profile_file = "./massscales_"+tag+"_"+run+(nShards>1 ? "_shard"+std::to_string(shard) : "")+"_profile.txt";
+  if(profile) std::ofstream(profile_file.c_str(), std::ios::trunc);
+  std::string io_file = "./massscales_"+tag+"_"+run+(nShards>1 ? "_shard"+std::to_string(shard) : "")+"_io.txt";
+  if(ioStats) std::ofstream(io_file.c_str(), std::ios::trunc);
+  // Per-branch reads of an event loop on NanoAOD: the trigger filter branches for all the entries processed, the muon arrays for the ones passing it
+  auto report_io = [&](const std::vector<std::string>& files, bool isMC, const std::string& title, double n_entries, double n_trigger,
+                       double bytes_read, long long read_calls, double real_s) {
+    const std::string trk = useKf ? "" : (isMC ? "cvhideal" : "cvh");
+    const std::vector<std::string> scalars = {"HLT_IsoMu24", "nMuon"};
+    const std::vector<std::string> arrays = {"Muon_looseId", "Muon_dxybs", "Muon_isGlobal", "Muon_highPurity", "Muon_mediumId", "Muon_pfRelIso04_all",
+                                             useKf ? "Muon_pt" : "Muon_"+trk+"Pt", useKf ? "Muon_eta" : "Muon_"+trk+"Eta", useKf ? "Muon_phi" : "Muon_"+trk+"Phi",
+                                             "Muon_mass", "Muon_charge"};
+    std::vector<std::string> branches(scalars);
+    branches.insert(branches.end(), arrays.begin(), arrays.end());
+    std::vector<double> n_read(scalars.size(), n_entries);
+    n_read.resize(branches.size(), n_trigger);
+    std::vector<std::string> expanded = expand_files(files);
+    double n_files = 0.;
+    for(const auto& f : expanded) {
+      std::unique_ptr<TFile> fin(TFile::Open(f.c_str(), "READ"));
+      TTree* t = fin && !fin->IsZombie() ? fin->Get<TTree>("Events") : nullptr;
+      if(t) n_files += t->GetEntries();
+    }
+    std::ofstream fio(io_file.c_str(), std::ios::app);
+    report_branch_io(fio, title, n_entries, n_trigger, bytes_read, read_calls, real_s, loop_branch_io(expanded, branches, n_read, n_files));
+    cout << "Branch reads written to " << io_file << endl;
+  };
 
-  vector<float> pt_edges  = {25.0, 30.0, 35.0, 40.0, 45.0, 50.0, 55.0}; 
-  vector<float> eta_edges = {-2.4, -2.2, -2.0, -1.8, -1.6, -1.4, -1.2, -1.0, -0.8, -0.6, -0.4, -0.2, 0.0,
-                             0.2, 0.4, 0.6, 0.8, 1.0, 1.2, 1.4, 1.6, 1.8, 2.0, 2.2, 2.4};
+  // Processing slots of the dataframes, as in the RDataFrame implementation
+  const unsigned int n_slots = ROOT::IsImplicitMTEnabled() ? ROOT::GetThreadPoolSize() : 1;
 
   TH1F* h_pt_edges  = new TH1F("h_pt_edges", "",  pt_edges.size()-1, pt_edges.data());
   TH1F* h_eta_edges = new TH1F("h_eta_edges", "", eta_edges.size()-1, eta_edges.data());
   
-  unsigned int n_pt_bins  = pt_edges.size()-1;
-  unsigned int n_eta_bins = eta_edges.size()-1;
+  unsigned int n_pt_bins  = binning.n_pt_bins();
+  unsigned int n_eta_bins = binning.n_eta_bins();
+  const MuonCuts muon_cuts = {pt_edges[0], pt_edges[n_pt_bins], eta_edges[0], eta_edges[n_eta_bins]};
+  const std::vector<CutVariation> cut_variations = parse_cut_variations(cutVariations, muon_cuts);
+  for(const auto& v : cut_variations)
+    cout << "Cut variation " << v.name << ": pt in [" << v.cuts.pt_low << "," << v.cuts.pt_high << "], eta in [" << v.cuts.eta_low << "," << v.cuts.eta_high
+         << "], dxybs<" << v.cuts.dxybs_max << ", iso<" << v.cuts.iso_max << (v.cuts.medium_id ? ", medium ID" : "") << endl;
   // Number of 4D bins in muon kinematics (eta+, pt+, eta-, pt-)
-  int n_bins = n_pt_bins*n_pt_bins*n_eta_bins*n_eta_bins; 
+  int n_bins = binning.n_bins(); 
 
   // Bins in mass
   const int x_nbins   = 40;
@@ -189,6 +839,12 @@ int main(int argc, char* argv[]) {
   VectorXd M_vals_fit( n_eta_bins );
   VectorXd c_vals_fit( n_eta_bins );
   VectorXd d_vals_fit( n_eta_bins );
+  // Curvature biases of the last mass and resolution fits alone, included in the ones above
+  VectorXd A_vals_last = VectorXd::Zero( n_eta_bins );
+  VectorXd e_vals_last = VectorXd::Zero( n_eta_bins );
+  VectorXd M_vals_last = VectorXd::Zero( n_eta_bins );
+  VectorXd c_vals_last = VectorXd::Zero( n_eta_bins );
+  VectorXd d_vals_last = VectorXd::Zero( n_eta_bins );
 
   // Initialize curvature bias parameters A,e,M,c,d = 0, they will remain 0 if usePrevMassFit/usePrevResolFit are false
   for(unsigned int i=0; i<n_eta_bins; i++) {
@@ -211,6 +867,14 @@ int main(int argc, char* argv[]) {
   // If skipUnsmearedReco == false, we will save mass and jacobian histograms for both reco and smear0 in the dataframe
   // In the scale fit, only smear0 jacobians are used
   std::vector<string> recos = {"reco", "smear0"};
+  // Smear0 variants smear0_v<k> (stepScales), with the last mass and resolution fits scaled by step_scales[k-1]
+  std::vector<float> step_scales;
+  for(const std::string& step_scale : split_list(stepScales)) {
+    step_scales.push_back(std::stof(step_scale));
+    recos.push_back("smear0_v"+std::to_string(step_scales.size()));
+  }
+  // Column of the masses of a reco: gen, reco and smear0 in "masses", gen, reco and the variant in "masses_<variant>"
+  auto masses_column = [&](unsigned int r) -> std::string { return r<2 ? "masses" : "masses_"+recos[r]; };
 
   // Map to histograms containing information for each 4D bin
   std::map<string, TH1D*> h_map;
@@ -236,9 +900,11 @@ int main(int argc, char* argv[]) {
   std::map<string, unsigned int> idx_map;
   idx_map.insert( std::make_pair<string, unsigned int >("reco",   1 ) );
   idx_map.insert( std::make_pair<string, unsigned int >("smear0", 2 ) );
+  for(unsigned int r = 2; r<recos.size(); r++) idx_map.insert( std::make_pair(recos[r], 2u) );
 
-  if(usePrevMassFit) {
-    TFile* ffit = TFile::Open(("./massfit_"+tagPrevMassFit+"_"+runPrevMassFit+".root").c_str(), "READ");
+  // Read the A,e,M from a massfit.cpp output file
+  auto read_prev_mass_fit = [&](const std::string& fname) {
+    TFile* ffit = TFile::Open(fname.c_str(), "READ");
     if(ffit!=0) {    
       cout << "Using fit results from " <<  std::string(ffit->GetName()) << " as new nominal for smear0" << endl;
       // Read the sum of the pT scale bias parameters A, e or M from all the previous iterations
@@ -251,7 +917,19 @@ int main(int argc, char* argv[]) {
 	    e_vals_fit(i) = -h_e_vals_prevfit_in->GetBinContent(i+1);
 	    M_vals_fit(i) = -h_M_vals_prevfit_in->GetBinContent(i+1);
       }
+      // Last fit alone, for the smear0 variants
+      TH1D* h_A_vals_fit_in = (TH1D*)ffit->Get("h_A_vals_fit");
+      TH1D* h_e_vals_fit_in = (TH1D*)ffit->Get("h_e_vals_fit");
+      TH1D* h_M_vals_fit_in = (TH1D*)ffit->Get("h_M_vals_fit");
+      for(unsigned int i=0; h_A_vals_fit_in && h_e_vals_fit_in && h_M_vals_fit_in && i<n_eta_bins; i++) {
+	    A_vals_last(i) = -h_A_vals_fit_in->GetBinContent(i+1);
+	    e_vals_last(i) = -h_e_vals_fit_in->GetBinContent(i+1);
+	    M_vals_last(i) = -h_M_vals_fit_in->GetBinContent(i+1);
+      }
       // Save the content of h_ _vals_prevfit_in to be passed to massfit.cpp without further changes
+      h_A_vals_prevfit->Reset();
+      h_e_vals_prevfit->Reset();
+      h_M_vals_prevfit->Reset();
       h_A_vals_prevfit->Add(h_A_vals_prevfit_in, 1.0);
       h_e_vals_prevfit->Add(h_e_vals_prevfit_in, 1.0);
       h_M_vals_prevfit->Add(h_M_vals_prevfit_in, 1.0);
@@ -260,10 +938,12 @@ int main(int argc, char* argv[]) {
     else {
       cout << "No mass fit file!" << endl;
     }
-  }
+  };
+  if(usePrevMassFit) read_prev_mass_fit("./massfit_"+tagPrevMassFit+"_"+runPrevMassFit+".root");
 
-  if(usePrevResolFit) {
-    TFile* ffit = TFile::Open(("./resolfit_"+tagPrevResolFit+"_"+runPrevResolFit+".root").c_str(), "READ");
+  // Read the c,d from a resolfit.cpp output file
+  auto read_prev_resol_fit = [&](const std::string& fname) {
+    TFile* ffit = TFile::Open(fname.c_str(), "READ");
     if(ffit!=0) {    
       cout << "Using fit results from " <<  std::string(ffit->GetName()) << " as MC smear" << endl;
 	  // Read the sum of the resolution biases c or d from all the previous iterations
@@ -272,8 +952,17 @@ int main(int argc, char* argv[]) {
       for(unsigned int i=0; i<n_eta_bins; i++){
 	    c_vals_fit(i) = h_c_vals_prevfit_in->GetBinContent(i+1);
 	    d_vals_fit(i) = h_d_vals_prevfit_in->GetBinContent(i+1);
+      }
+      // Last fit alone, for the smear0 variants
+      TH1D* h_c_vals_fit_in = (TH1D*)ffit->Get("h_c_vals_fit");
+      TH1D* h_d_vals_fit_in = (TH1D*)ffit->Get("h_d_vals_fit");
+      for(unsigned int i=0; h_c_vals_fit_in && h_d_vals_fit_in && i<n_eta_bins; i++) {
+	    c_vals_last(i) = h_c_vals_fit_in->GetBinContent(i+1);
+	    d_vals_last(i) = h_d_vals_fit_in->GetBinContent(i+1);
       }
 	  // Save the content of h_ _vals_prevfit_in to be passed to resolfit.cpp without further changes
+      h_c_vals_prevfit->Reset();
+      h_d_vals_prevfit->Reset();
       h_c_vals_prevfit->Add(h_c_vals_prevfit_in, +1.0);
       h_d_vals_prevfit->Add(h_d_vals_prevfit_in, +1.0);
       ffit->Close();
@@ -281,11 +970,138 @@ int main(int argc, char* argv[]) {
     else {
       cout << "No smear fit file!" << endl;
     }    
-  }  
+  };
+  if(usePrevResolFit) read_prev_resol_fit("./resolfit_"+tagPrevResolFit+"_"+runPrevResolFit+".root");
+
+  // Biases of the smear0 variants: previous iterations + step*(last fit), the nominal smear0 has step 1
+  std::vector<SmearParams> variant_params;
+  auto make_variant_params = [&]() {
+    variant_params.clear();
+    for(float step_scale : step_scales) {
+      double ds = step_scale - 1.;
+      variant_params.push_back( {A_vals_fit + ds*A_vals_last, e_vals_fit + ds*e_vals_last, M_vals_fit + ds*M_vals_last,
+                                 c_vals_fit + ds*c_vals_last, d_vals_fit + ds*d_vals_last} );
+      cout << "Smear0 variant " << recos[variant_params.size()+1] << ": step " << step_scale << " along the last fits" << endl;
+    }
+  };
+  make_variant_params();
 
   // Define a single output file, we will write to and read from it at the different iterations 
   // If firstIter = 2, update an existing output file with iter -1,0 and 1 to (over)write iter 2 (the mass fit results)
-  TFile* fout = TFile::Open(("./massscales_"+tag+"_"+run+".root").c_str(), firstIter<2 ? "RECREATE" : "UPDATE");
+  // The same when merging the shards of iter 1, the file has the merged iter -1 and 0
+  // A shard writes its histograms to its own file
+  std::string fout_name = "./massscales_"+tag+"_"+run+(nShards>1 ? "_shard"+std::to_string(shard) : "")+".root";
+  TFile* fout = TFile::Open(fout_name.c_str(), (firstIter<2 && !(mergeShards>0 && firstIter==1)) ? "RECREATE" : "UPDATE");
+
+  // Read the Gaussian and Crystal Ball fits of iter 0 needed by the jacobian weights of iter 1, when iter 0 was not run in this process
+  auto read_iter0_fits = [&](TFile* f) {
+    for(unsigned int r = 0; r<recos.size(); r++) {
+      if(skipUnsmearedReco && recos[r]=="reco") continue;
+      for(std::string q : {"mean", "rms", "mask"}) {
+        TH1D* h = (TH1D*)f->Get(("h_"+q+"_"+recos[r]+"_bin_dm").c_str());
+        assert(h!=0);
+        h_map[q+"_"+recos[r]] = (TH1D*)h->Clone();
+        h_map[q+"_"+recos[r]]->SetDirectory(0);
+      }
+      for(std::string q : {"jscale", "jwidth"}) {
+        TH2D* h = (TH2D*)f->Get(("h_"+recos[r]+"_bin_"+q+"_cb_per_evt").c_str());
+        assert(h!=0);
+        h_jac_map[q+"_cb_per_evt_"+recos[r]] = (TH2D*)h->Clone();
+        h_jac_map[q+"_cb_per_evt_"+recos[r]]->SetDirectory(0);
+      }
+    }
+  };
+  if(firstIter==1 && mergeShards>0) read_iter0_fits(fout);
+
+  // Dual track fit mode: each iteration is done in three passes, the first one (with the state of the other track fit) books the event loop of the other track fit,
+  // the second one (nominal) runs it together with its own, the third one (other track fit) writes and fits the histograms of the other track fit
+  TrackFitState other_fit;
+  auto swap_track_fit = [&]() {
+    std::swap(useKf, other_fit.useKf);
+    std::swap(fout, other_fit.fout);
+    std::swap(A_vals_fit, other_fit.A_vals_fit);
+    std::swap(e_vals_fit, other_fit.e_vals_fit);
+    std::swap(M_vals_fit, other_fit.M_vals_fit);
+    std::swap(c_vals_fit, other_fit.c_vals_fit);
+    std::swap(d_vals_fit, other_fit.d_vals_fit);
+    std::swap(A_vals_last, other_fit.A_vals_last);
+    std::swap(e_vals_last, other_fit.e_vals_last);
+    std::swap(M_vals_last, other_fit.M_vals_last);
+    std::swap(c_vals_last, other_fit.c_vals_last);
+    std::swap(d_vals_last, other_fit.d_vals_last);
+    std::swap(variant_params, other_fit.variant_params);
+    std::swap(h_A_vals_prevfit, other_fit.h_A_vals_prevfit);
+    std::swap(h_e_vals_prevfit, other_fit.h_e_vals_prevfit);
+    std::swap(h_M_vals_prevfit, other_fit.h_M_vals_prevfit);
+    std::swap(h_c_vals_prevfit, other_fit.h_c_vals_prevfit);
+    std::swap(h_d_vals_prevfit, other_fit.h_d_vals_prevfit);
+    std::swap(h_map, other_fit.h_map);
+    std::swap(h_jac_map, other_fit.h_jac_map);
+    fout->cd();
+  };
+  if(dualTrackFit) {
+    std::string other_trk = useKf ? "cvh" : "kf";
+    other_fit.useKf = !useKf;
+    other_fit.fout = TFile::Open(("./massscales_"+tag+"_"+other_trk+"_"+run+".root").c_str(), firstIter<2 ? "RECREATE" : "UPDATE");
+    for(VectorXd* v : {&other_fit.A_vals_fit, &other_fit.e_vals_fit, &other_fit.M_vals_fit, &other_fit.c_vals_fit, &other_fit.d_vals_fit,
+                       &other_fit.A_vals_last, &other_fit.e_vals_last, &other_fit.M_vals_last, &other_fit.c_vals_last, &other_fit.d_vals_last})
+      *v = VectorXd::Zero(n_eta_bins);
+    for(std::pair<TH1F**, TH1F*> h : { std::make_pair(&other_fit.h_A_vals_prevfit, h_A_vals_prevfit), std::make_pair(&other_fit.h_e_vals_prevfit, h_e_vals_prevfit),
+                                      std::make_pair(&other_fit.h_M_vals_prevfit, h_M_vals_prevfit), std::make_pair(&other_fit.h_c_vals_prevfit, h_c_vals_prevfit),
+                                      std::make_pair(&other_fit.h_d_vals_prevfit, h_d_vals_prevfit) }) {
+      *h.first = (TH1F*)h.second->Clone();
+      (*h.first)->SetDirectory(0);
+      (*h.first)->Reset();
+    }
+    other_fit.h_map = h_map;
+    other_fit.h_jac_map = h_jac_map;
+    // The previous fits of the other track fit are the ones with the tag <tag>_<kf|cvh>
+    swap_track_fit();
+    if(usePrevMassFit) read_prev_mass_fit("./massfit_"+tagPrevMassFit+"_"+other_trk+"_"+runPrevMassFit+".root");
+    if(usePrevResolFit) read_prev_resol_fit("./resolfit_"+tagPrevResolFit+"_"+other_trk+"_"+runPrevResolFit+".root");
+    make_variant_params();
+    swap_track_fit();
+    cout << "Dual track fit: the " << (useKf ? "CVH" : "KF") << " histograms are written to " << other_fit.fout->GetName() << endl;
+  }
+  BookedLoop booked_other;
+  if(firstIter==1 && nShards>1) {
+    TFile* fmerged = TFile::Open(("./massscales_"+tag+"_"+run+".root").c_str(), "READ");
+    read_iter0_fits(fmerged);
+    fmerged->Close();
+  }
+
+  // Sum the 2D histograms written by the shards for an iteration, the binning of the shards must be the same as the one of this process
+  auto merge_shards = [&](int iter) -> std::vector<TH2D*> {
+    std::vector<TH2D*> out;
+    for(int k = 0; k<mergeShards; k++) {
+      std::string fname = "./massscales_"+tag+"_"+run+"_shard"+std::to_string(k)+".root";
+      TFile* fshard = TFile::Open(fname.c_str(), "READ");
+      assert(fshard!=0 && !fshard->IsZombie());
+      Binning4D binning_k = Binning4D::from_histos( (TH1F*)fshard->Get("h_pt_edges"), (TH1F*)fshard->Get("h_eta_edges") );
+      assert( binning_k.pt_edges()==pt_edges && binning_k.eta_edges()==eta_edges );
+      TDirectory* dir = fshard->GetDirectory(Form("iter%d", iter));
+      assert(dir!=0);
+      std::vector<std::string> names;
+      TIter next(dir->GetListOfKeys());
+      while(TKey* key = (TKey*)next()) {
+        if(std::find(names.begin(), names.end(), key->GetName())==names.end()) names.push_back(key->GetName());
+      }
+      assert( k==0 || names.size()==out.size() );
+      for(unsigned int j = 0; j<names.size(); j++) {
+        TH2D* h = BinSpectra::read(dir, names[j])->to_th2();
+        if(k==0) out.push_back(h);
+        else {
+          assert( names[j]==out[j]->GetName() );
+          if(is_moments_histo(names[j])) BinMoments::merge_th2(out[j], h);
+          else out[j]->Add(h);
+          delete h;
+        }
+      }
+      cout << "Merged " << names.size() << " histograms of iter " << iter << " from " << fname << endl;
+      fshard->Close();
+    }
+    return out;
+  };
   
   // iter -1 -> data mass histos
   // iter  0 -> MC mass histos + calculation of jacobian terms per event
@@ -297,562 +1113,1018 @@ int main(int argc, char* argv[]) {
   // - TTree and histograms resulted from the mass fits
   // - OPTIONAL, in the postfit/ folder, pre and postfit mass distribution for the 4D bins
 
-  for(int iter=-1; iter<3; iter++) {
+  // Resident iterations (nResidentIter>0): the selected MC dimuons matched to gen and the data histogram are kept in memory after the first step,
+  // each further step runs massfit and resolfit on the output of the previous one and repeats iter -1..2 without reading the input files
+  std::vector<DimuonCandidate> resident_dimuons;
+  std::vector<float> resident_weights;
+  TH2D* h_data_resident = 0;
+  std::string run_step = run;
+
+  // Run massfit and resolfit on the output of a step, returns false if any of them failed
+  auto run_fits = [&](const std::string& run_fit) -> bool {
+    fout->Close();
+    for(std::string cmd : {"./massfit "+massfitArgs+" --tag="+tag+" --run="+run_fit, "./resolfit "+resolfitArgs+" --tag="+tag+" --run="+run_fit}) {
+      cout << cmd << endl;
+      if( system(cmd.c_str())!=0 ) {
+        cout << "Failed: " << cmd << endl;
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // Fill the MC histograms of iter 0 (mass, mass - gen mass) or iter 1 (jacobians) from the dimuons in memory, the same as the dataframe does
+  auto fill_resident_histos = [&](int iter) -> std::vector<TH2D*> {
+    fout->cd();
+    std::vector<TH2D*> out;
+    std::vector<unsigned int> rs;
+    std::vector<unsigned int> mpos;
+    std::vector<std::shared_ptr<const JacTable>> jac_tables;
+    for(unsigned int r = 0 ; r<recos.size(); r++) {
+      if(skipUnsmearedReco && recos[r]=="reco") continue;
+      rs.push_back(r);
+      mpos.push_back(idx_map.at(recos[r]));
+      TString rname(recos[r].c_str());
+      if(iter==0) {
+        out.push_back(new TH2D("h_"+rname+"_bin_m",  "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high));
+        out.push_back(new TH2D("h_"+rname+"_bin_dm", "nominal", n_bins, 0, double(n_bins), dm_bins, dm_low, dm_high));
+      }
+      else {
+        out.push_back(new TH2D("h_"+rname+"_bin_jac_scale",    "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high));
+        out.push_back(new TH2D("h_"+rname+"_bin_jac_width",    "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high));
+        out.push_back(new TH2D("h_"+rname+"_bin_jac_scale_cb", "cb",      n_bins, 0, double(n_bins), x_nbins, x_low, x_high));
+        out.push_back(new TH2D("h_"+rname+"_bin_jac_width_cb", "cb",      n_bins, 0, double(n_bins), x_nbins, x_low, x_high));
+        jac_tables.push_back( std::make_shared<const JacTable>( h_map.at("mean_"+recos[r]), h_map.at("rms_"+recos[r]),
+                                                                h_jac_map.at("jscale_cb_per_evt_"+recos[r]), h_jac_map.at("jwidth_cb_per_evt_"+recos[r]) ) );
+      }
+    }
+    unsigned int nh = iter==0 ? 2 : 4;
+    // Moments of the mass - gen mass and of the mass in iter 0, as the BinMomentsHelper of the dataframe
+    std::vector<BinMoments> dm_moments, m_moments;
+    if(iter==0) {
+      dm_moments.assign(rs.size(), BinMoments(n_bins, dm_low, dm_high));
+      m_moments.assign(rs.size(), BinMoments(n_bins, x_low, x_high));
+    }
+    // The masses of a block of candidates are computed together by the batched kernel, m_block[mpos] as in DimuonMasses
+    const unsigned int block = 1024;
+    std::vector<PairGeometry> geometry(block);
+    std::vector<std::array<unsigned int, 2>> indexes(block);
+    std::vector<double> ptP(block), ptM(block), ptP_smear0(block), ptM_smear0(block);
+    std::array<std::vector<double>, 3> m_block;
+    for(auto& m : m_block) m.resize(block);
+    bool need_reco = std::find(mpos.begin(), mpos.end(), idx_map.at("reco"))!=mpos.end();
+    for(unsigned int first = 0; first<resident_dimuons.size(); first += block) {
+      unsigned int n = std::min<size_t>(block, resident_dimuons.size()-first);
+      for(unsigned int j = 0; j<n; j++) {
+        const DimuonCandidate& dimuon = resident_dimuons[first+j];
+        std::array<float, 2> ksmear = smear_curvatures(dimuon, binning, A_vals_fit, e_vals_fit, M_vals_fit, c_vals_fit, d_vals_fit, usePrevResolFit);
+        std::array<double, 2> pt_smear0 = smear0_pts(ksmear, binning);
+        indexes[j] = dimuon_indexes(dimuon, ksmear, binning);
+        geometry[j] = pair_geometry( dimuon.etaP, dimuon.phiP, dimuon.massP, dimuon.etaM, dimuon.phiM, dimuon.massM );
+        ptP[j] = dimuon.ptP;
+        ptM[j] = dimuon.ptM;
+        ptP_smear0[j] = pt_smear0[0];
+        ptM_smear0[j] = pt_smear0[1];
+        m_block[0][j] = dimuon.gen_m;
+      }
+      if(need_reco) pair_masses(n, geometry, ptP, ptM, m_block[idx_map.at("reco")]);
+      pair_masses(n, geometry, ptP_smear0, ptM_smear0, m_block[idx_map.at("smear0")]);
+      for(unsigned int j = 0; j<n; j++) {
+        float weight = resident_weights[first+j];
+        float gen_m = m_block[0][j];
+        for(unsigned int ir = 0; ir<rs.size(); ir++) {
+          unsigned int r = rs[ir];
+          float m = m_block[ mpos[ir] ][j];
+          TH2D** h = &out[ir*nh];
+          if(iter==0) {
+            h[0]->Fill(indexes[j][r], m, weight);
+            h[1]->Fill(indexes[j][r], m - gen_m, weight);
+            dm_moments[ir].fill(indexes[j][r], m - gen_m, weight);
+            m_moments[ir].fill(indexes[j][r], m, weight);
+          }
+          else {
+            JacWeights w = jac_tables[ir]->weights(indexes[j][r], m, gen_m);
+            h[0]->Fill(indexes[j][r], m, w.jscale*weight);
+            h[1]->Fill(indexes[j][r], m, w.jwidth*weight);
+            h[2]->Fill(indexes[j][r], m, w.jscale_cb*weight);
+            h[3]->Fill(indexes[j][r], m, w.jwidth_cb*weight);
+          }
+        }
+      }
+    }
+    for(unsigned int ir = 0; ir<dm_moments.size(); ir++) {
+      out.push_back( dm_moments[ir].to_th2("h_"+recos[rs[ir]]+"_bin_dm_moments") );
+      out.push_back( m_moments[ir].to_th2("h_"+recos[rs[ir]]+"_bin_m_moments") );
+    }
+    return out;
+  };
 
-    if( !(iter>=firstIter && iter<=lastIter) ) continue;
-    cout << "Doing iter " << iter << endl;
+  // Write the histograms output by the event loop of an iteration, MC is scaled to the luminosity in data
+  // A shard writes them unscaled to the iter<iter> directory, to be summed by the merge. scaled: built from histograms already scaled
+  // Scale factor of MC to the luminosity in data
+  auto lumi_sf = [&](bool scaled) -> double {
+	  double lumiMC = lumiMC2016;
+	  if(y2017)      lumiMC = lumiMC2017;
+	  else if(y2018) lumiMC = lumiMC2018;
+	  return lumi>0. && nShards==1 && !scaled ? lumi/lumiMC : 1.0; //double(lumi)/double(minNumEvents);
+  };
+
+  auto write_histos = [&](int iter, const std::vector<TH1D*>& histos1D, const std::vector<TH2D*>& histos2D, const std::vector<TH3D*>& histos3D, bool scaled = false,
+                          TDirectory* dir_out = nullptr) {
+	  TDirectory* dir = dir_out ? dir_out : fout;
+	  if(nShards>1 && !dir_out) {
+	    dir = fout->GetDirectory(Form("iter%d", iter));
+	    if(dir==0) dir = fout->mkdir(Form("iter%d", iter));
+	  }
+	  dir->cd();
+	  std::cout << "Writing histos..." << std::endl;
+	  
+	  // Scale MC to luminosity in data
+	  double sf = lumi_sf(scaled);
+	  
+	  for(auto h : histos1D) {
+		if(iter>=0) h->Scale(sf); // scale only for MC
+		h->Write();
+	  }
+	  for(auto h : histos2D) {
+		if(iter>=0 && !is_moments_histo(h->GetName())) h->Scale(sf); // scale only for MC, the moments do not depend on the normalisation
+		string h_name = std::string(h->GetName());
+		std::cout << "Total number of events in 2D histo " << h_name << ": " << h->GetEntries() << std::endl;
+		if(sparseHistos) {
+		  BinSpectra h_sparse = BinSpectra::from_th2(h);
+		  std::cout << "Populated 4D bins in " << h_name << ": " << h_sparse.n_populated() << " / " << n_bins << std::endl;
+		  h_sparse.write(dir);
+		}
+		else h->Write();
+      }
+	  for(auto h : histos3D) {
+       	if(iter>=0) h->Scale(sf); // scale only for MC
+       	string h_name = std::string(h->GetName());
+       	std::cout << "Total number of events in 3D histo " << h_name << ": " << h->GetEntries() << std::endl;
+       	h->Write();
+      }
+  };
+
+  // Write the bootstrap replicas, MC scaled to the luminosity as the nominal spectra
+  auto write_bootstrap = [&](int iter, std::vector< ROOT::RDF::RResultPtr<TH2F> >& boot) {
+    fout->cd();
+    for(auto& h : boot) {
+      // Not with TH1::Scale, which would add the sums of squared weights
+      if(iter>=0) {
+        const float sf = lumi_sf(false);
+        float* arr = h->GetArray();
+        for(int i = 0; i<h->GetNcells(); i++) arr[i] *= sf;
+      }
+      std::cout << "Bootstrap replicas " << h->GetName() << ": " << h->GetXaxis()->GetNbins() << " replicas of " << h->GetEntries() << " events" << std::endl;
+      h->Write(0,TObject::kOverwrite);
+    }
+  };
+
+  // Write the spectra of the cut variations (cutVariations) to the directories cuts_<name>, with the names and normalisation of the nominal ones
+  auto write_cut_variations = [&](int iter, std::vector< ROOT::RDF::Experimental::RResultMap<TH2D> >& varied) {
+    for(const auto& v : cut_variations) {
+      TDirectory* dir = fout->GetDirectory(("cuts_"+v.name).c_str());
+      if(dir==0) dir = fout->mkdir(("cuts_"+v.name).c_str());
+      std::vector<TH2D*> histos2D;
+      for(auto& m : varied) histos2D.push_back( &m["cuts:"+v.name] );
+      write_histos(iter, {}, histos2D, {}, false, dir);
+    }
+    fout->cd();
+  };
+
+  // Jacobian histograms of iter 1 rebuilt from the moments of the events of each (4D bin, mass bin) cell written in iter 0 (jacFromMoments)
+  // Same as the MC event loop of iter 1 up to the rounding, without the sums of squared weights (not used by the mass fit)
+  auto jac_from_moments = [&]() -> std::vector<TH2D*> {
+    std::vector<TH2D*> out;
+    for(unsigned int r = 0 ; r<recos.size(); r++) {
+      if(skipUnsmearedReco && recos[r]=="reco") continue;
+      std::vector<std::unique_ptr<BinSpectra>> moments;
+      for(unsigned int k = 0; k<5; k++) {
+        moments.push_back( BinSpectra::read(fout, "h_"+recos[r]+"_bin_m_mom"+std::to_string(k)) );
+        assert(moments.back()!=nullptr);
+      }
+      std::unique_ptr<BinSpectra> cells = BinSpectra::read(fout, "h_"+recos[r]+"_bin_m_dm_cells");
+      assert(cells!=nullptr);
+      JacTable jac_table( h_map.at("mean_"+recos[r]), h_map.at("rms_"+recos[r]), h_jac_map.at("jscale_cb_per_evt_"+recos[r]), h_jac_map.at("jwidth_cb_per_evt_"+recos[r]) );
+      TString rname(recos[r].c_str());
+      fout->cd();
+      std::array<TH2D*, 4> h = {{
+          new TH2D("h_"+rname+"_bin_jac_scale",    "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high),
+          new TH2D("h_"+rname+"_bin_jac_width",    "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high),
+          new TH2D("h_"+rname+"_bin_jac_scale_cb", "cb",      n_bins, 0, double(n_bins), x_nbins, x_low, x_high),
+          new TH2D("h_"+rname+"_bin_jac_width_cb", "cb",      n_bins, 0, double(n_bins), x_nbins, x_low, x_high) }};
+      std::array<double, 5> s;
+      std::vector<double> n_cb(dm_bins);
+      for(unsigned int ibin = 0; ibin<n_bins; ibin++) {
+        if(!moments[0]->populated(ibin)) continue;
+        for(int iy = 0; iy<x_nbins+2; iy++) {
+          for(unsigned int k = 0; k<5; k++) s[k] = moments[k]->content(ibin+1, iy);
+          for(int j = 0; j<dm_bins; j++) n_cb[j] = cells->content(ibin+1, iy*dm_bins+j+1);
+          std::array<double, 4> sums = jac_table.sums(ibin, s, n_cb.data());
+          for(unsigned int q = 0; q<4; q++) h[q]->SetBinContent(ibin+1, iy, sums[q]);
+        }
+      }
+      for(TH2D* hq : h) {
+        hq->SetEntries(moments[0]->entries());
+        out.push_back(hq);
+      }
+      cout << "Rebuilt the jacobian histograms of " << recos[r] << " from the moments of iter 0" << endl;
+    }
+    return out;
+  };
 
-    // Read the input files relevant to the current iteration
+  // Input files of an iteration (MC for iter>=0, data otherwise), patterns not expanded
+  auto input_files = [&](int iter) -> vector<string> {
     vector<string> in_files = {};
     if(iter>=0) { // MC
       if(y2016) {
         in_files = {
-	      "/scratch/wmass/y2016/DYJetsToMuMu_H2ErratumFix_TuneCP5_13TeV-powhegMiNNLO-pythia8-photos/NanoV9MCPostVFP_TrackFitV722_NanoProdv6/240509_040854/0000/NanoV9MCPostVFP_*.root",
-	      "/scratch/wmass/y2016/DYJetsToMuMu_H2ErratumFix_PDFExt_TuneCP5_13TeV-powhegMiNNLO-pythia8-photos/NanoV9MCPostVFP_TrackFitV722_NanoProdv6/240509_041233/0000/NanoV9MCPostVFP_*.root",
-	      "/scratch/wmass/y2016/DYJetsToMuMu_H2ErratumFix_PDFExt_TuneCP5_13TeV-powhegMiNNLO-pythia8-photos/NanoV9MCPostVFP_TrackFitV722_NanoProdv6/240509_041233/0001/NanoV9MCPostVFP_*.root",
-	      "/scratch/wmass/y2016/DYJetsToMuMu_H2ErratumFix_PDFExt_TuneCP5_13TeV-powhegMiNNLO-pythia8-photos/NanoV9MCPostVFP_TrackFitV722_NanoProdv6/240509_041233/0002/NanoV9MCPostVFP_*.root"
-	    };
+	        "/scratch/wmass/y2016/DYJetsToMuMu_H2ErratumFix_TuneCP5_13TeV-powhegMiNNLO-pythia8-photos/NanoV9MCPostVFP_TrackFitV722_NanoProdv6/240509_040854/0000/NanoV9MCPostVFP_*.root",
+	        "/scratch/wmass/y2016/DYJetsToMuMu_H2ErratumFix_PDFExt_TuneCP5_13TeV-powhegMiNNLO-pythia8-photos/NanoV9MCPostVFP_TrackFitV722_NanoProdv6/240509_041233/0000/NanoV9MCPostVFP_*.root",
+	        "/scratch/wmass/y2016/DYJetsToMuMu_H2ErratumFix_PDFExt_TuneCP5_13TeV-powhegMiNNLO-pythia8-photos/NanoV9MCPostVFP_TrackFitV722_NanoProdv6/240509_041233/0001/NanoV9MCPostVFP_*.root",
+	        "/scratch/wmass/y2016/DYJetsToMuMu_H2ErratumFix_PDFExt_TuneCP5_13TeV-powhegMiNNLO-pythia8-photos/NanoV9MCPostVFP_TrackFitV722_NanoProdv6/240509_041233/0002/NanoV9MCPostVFP_*.root"
+	      };
       }
       else if(y2017) {
-	    in_files = {
-	      "/scratch/wmass/y2017/DYJetsToMuMu_H2ErratumFix_TuneCP5_13TeV-powhegMiNNLO-pythia8-photos/NanoV9MC2017_TrackFitV722_NanoProdv3/NanoV9MC2017_*.root"
-	    };
+	      in_files = {
+	        "/scratch/wmass/y2017/DYJetsToMuMu_H2ErratumFix_TuneCP5_13TeV-powhegMiNNLO-pythia8-photos/NanoV9MC2017_TrackFitV722_NanoProdv3/NanoV9MC2017_*.root"
+	      };
       }
       else if(y2018) {
-	    in_files = {
-	      "/scratch/wmass/y2018/DYJetsToMuMu_H2ErratumFix_TuneCP5_13TeV-powhegMiNNLO-pythia8-photos/NanoV9MC2018_TrackFitV722_NanoProdv3/240124_121800/0000/NanoV9MC2018_*.root",
-	      "/scratch/wmass/y2018/DYJetsToMuMu_H2ErratumFix_TuneCP5_13TeV-powhegMiNNLO-pythia8-photos/NanoV9MC2018_TrackFitV722_NanoProdv3/240124_121800/0001/NanoV9MC2018_*.root"
-	    };
+	      in_files = {
+	        "/scratch/wmass/y2018/DYJetsToMuMu_H2ErratumFix_TuneCP5_13TeV-powhegMiNNLO-pythia8-photos/NanoV9MC2018_TrackFitV722_NanoProdv3/240124_121800/0000/NanoV9MC2018_*.root",
+	        "/scratch/wmass/y2018/DYJetsToMuMu_H2ErratumFix_TuneCP5_13TeV-powhegMiNNLO-pythia8-photos/NanoV9MC2018_TrackFitV722_NanoProdv3/240124_121800/0001/NanoV9MC2018_*.root"
+	      };
       }      
     }
     else { // data
       if(y2016) {
-	    in_files = {
-	      "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016FDataPostVFP_TrackFitV722_NanoProdv6/240509_051502/0000/NanoV9DataPostVFP_*.root",
-	      "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016GDataPostVFP_TrackFitV722_NanoProdv6/240509_051653/0000/NanoV9DataPostVFP_*.root",
-	      "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016GDataPostVFP_TrackFitV722_NanoProdv6/240509_051653/0001/NanoV9DataPostVFP_*.root",
-	      "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016GDataPostVFP_TrackFitV722_NanoProdv6/240509_051653/0002/NanoV9DataPostVFP_*.root",
-	      "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016GDataPostVFP_TrackFitV722_NanoProdv6/240509_051653/0003/NanoV9DataPostVFP_*.root",
-	      "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016GDataPostVFP_TrackFitV722_NanoProdv6/240509_051653/0004/NanoV9DataPostVFP_*.root",
-	      "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016HDataPostVFP_TrackFitV722_NanoProdv6/240509_051807/0000/NanoV9DataPostVFP_*.root",
-	      "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016HDataPostVFP_TrackFitV722_NanoProdv6/240509_051807/0001/NanoV9DataPostVFP_*.root",
-	      "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016HDataPostVFP_TrackFitV722_NanoProdv6/240509_051807/0002/NanoV9DataPostVFP_*.root",
-	      "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016HDataPostVFP_TrackFitV722_NanoProdv6/240509_051807/0003/NanoV9DataPostVFP_*.root",
-	      "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016HDataPostVFP_TrackFitV722_NanoProdv6/240509_051807/0004/NanoV9DataPostVFP_*.root",
-	      "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016HDataPostVFP_TrackFitV722_NanoProdv6/240509_051807/0005/NanoV9DataPostVFP_*.root",
-	      "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016HDataPostVFP_TrackFitV722_NanoProdv6/240509_051807/0006/NanoV9DataPostVFP_*.root"
-	    };
+	      in_files = {
+	        "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016FDataPostVFP_TrackFitV722_NanoProdv6/240509_051502/0000/NanoV9DataPostVFP_*.root",
+	        "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016GDataPostVFP_TrackFitV722_NanoProdv6/240509_051653/0000/NanoV9DataPostVFP_*.root",
+	        "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016GDataPostVFP_TrackFitV722_NanoProdv6/240509_051653/0001/NanoV9DataPostVFP_*.root",
+	        "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016GDataPostVFP_TrackFitV722_NanoProdv6/240509_051653/0002/NanoV9DataPostVFP_*.root",
+	        "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016GDataPostVFP_TrackFitV722_NanoProdv6/240509_051653/0003/NanoV9DataPostVFP_*.root",
+	        "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016GDataPostVFP_TrackFitV722_NanoProdv6/240509_051653/0004/NanoV9DataPostVFP_*.root",
+	        "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016HDataPostVFP_TrackFitV722_NanoProdv6/240509_051807/0000/NanoV9DataPostVFP_*.root",
+	        "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016HDataPostVFP_TrackFitV722_NanoProdv6/240509_051807/0001/NanoV9DataPostVFP_*.root",
+	        "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016HDataPostVFP_TrackFitV722_NanoProdv6/240509_051807/0002/NanoV9DataPostVFP_*.root",
+	        "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016HDataPostVFP_TrackFitV722_NanoProdv6/240509_051807/0003/NanoV9DataPostVFP_*.root",
+	        "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016HDataPostVFP_TrackFitV722_NanoProdv6/240509_051807/0004/NanoV9DataPostVFP_*.root",
+	        "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016HDataPostVFP_TrackFitV722_NanoProdv6/240509_051807/0005/NanoV9DataPostVFP_*.root",
+	        "/scratch/wmass/y2016/SingleMuon/NanoV9Run2016HDataPostVFP_TrackFitV722_NanoProdv6/240509_051807/0006/NanoV9DataPostVFP_*.root"
+	      };
       }
       else if(y2017) {
-	    in_files = {
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017B_TrackFitV722_NanoProdv3/240127_110915/0000/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017B_TrackFitV722_NanoProdv3/240127_110915/0001/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017B_TrackFitV722_NanoProdv3/240127_110915/0002/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017B_TrackFitV722_NanoProdv3/240127_110915/0003/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017C_TrackFitV722_NanoProdv3/240127_115941/0000/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017C_TrackFitV722_NanoProdv3/240127_115941/0001/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017C_TrackFitV722_NanoProdv3/240127_115941/0002/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017C_TrackFitV722_NanoProdv3/240127_115941/0003/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017C_TrackFitV722_NanoProdv3/240127_115941/0004/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017C_TrackFitV722_NanoProdv3/240127_115941/0005/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017D_TrackFitV722_NanoProdv3/240127_120137/0000/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017D_TrackFitV722_NanoProdv3/240127_120137/0001/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017D_TrackFitV722_NanoProdv3/240127_120137/0002/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017E_TrackFitV722_NanoProdv3/240127_121346/0000/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017E_TrackFitV722_NanoProdv3/240127_121346/0001/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017E_TrackFitV722_NanoProdv3/240127_121346/0002/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017E_TrackFitV722_NanoProdv3/240127_121346/0003/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017E_TrackFitV722_NanoProdv3/240127_121346/0004/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017F_TrackFitV722_NanoProdv3/240127_122701/0000/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017F_TrackFitV722_NanoProdv3/240127_122701/0001/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017F_TrackFitV722_NanoProdv3/240127_122701/0002/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017F_TrackFitV722_NanoProdv3/240127_122701/0003/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017F_TrackFitV722_NanoProdv3/240127_122701/0004/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017F_TrackFitV722_NanoProdv3/240127_122701/0005/NanoV9Data2017_*.root",
-	      "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017F_TrackFitV722_NanoProdv3/240127_122701/0006/NanoV9Data2017_*.root"
-	    };
+	      in_files = {
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017B_TrackFitV722_NanoProdv3/240127_110915/0000/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017B_TrackFitV722_NanoProdv3/240127_110915/0001/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017B_TrackFitV722_NanoProdv3/240127_110915/0002/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017B_TrackFitV722_NanoProdv3/240127_110915/0003/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017C_TrackFitV722_NanoProdv3/240127_115941/0000/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017C_TrackFitV722_NanoProdv3/240127_115941/0001/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017C_TrackFitV722_NanoProdv3/240127_115941/0002/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017C_TrackFitV722_NanoProdv3/240127_115941/0003/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017C_TrackFitV722_NanoProdv3/240127_115941/0004/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017C_TrackFitV722_NanoProdv3/240127_115941/0005/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017D_TrackFitV722_NanoProdv3/240127_120137/0000/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017D_TrackFitV722_NanoProdv3/240127_120137/0001/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017D_TrackFitV722_NanoProdv3/240127_120137/0002/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017E_TrackFitV722_NanoProdv3/240127_121346/0000/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017E_TrackFitV722_NanoProdv3/240127_121346/0001/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017E_TrackFitV722_NanoProdv3/240127_121346/0002/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017E_TrackFitV722_NanoProdv3/240127_121346/0003/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017E_TrackFitV722_NanoProdv3/240127_121346/0004/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017F_TrackFitV722_NanoProdv3/240127_122701/0000/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017F_TrackFitV722_NanoProdv3/240127_122701/0001/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017F_TrackFitV722_NanoProdv3/240127_122701/0002/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017F_TrackFitV722_NanoProdv3/240127_122701/0003/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017F_TrackFitV722_NanoProdv3/240127_122701/0004/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017F_TrackFitV722_NanoProdv3/240127_122701/0005/NanoV9Data2017_*.root",
+	        "/scratch/wmass/y2017/SingleMuon/NanoV9Run2017F_TrackFitV722_NanoProdv3/240127_122701/0006/NanoV9Data2017_*.root"
+	      };
       }
       else if(y2018) {
-	    in_files = {
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018A_TrackFitV722_NanoProdv3/231102_185937/0000/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018A_TrackFitV722_NanoProdv3/231102_185937/0001/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018A_TrackFitV722_NanoProdv3/231102_185937/0002/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018A_TrackFitV722_NanoProdv3/231102_185937/0003/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018A_TrackFitV722_NanoProdv3/231102_185937/0004/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018A_TrackFitV722_NanoProdv3/231102_185937/0005/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018A_TrackFitV722_NanoProdv3/231102_185937/0006/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018B_TrackFitV722_NanoProdv3/231103_093816/0000/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018B_TrackFitV722_NanoProdv3/231103_093816/0001/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018B_TrackFitV722_NanoProdv3/231103_093816/0002/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018C_TrackFitV722_NanoProdv3/231103_101410/0000/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018C_TrackFitV722_NanoProdv3/231103_101410/0001/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018C_TrackFitV722_NanoProdv3/231103_101410/0002/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018D_TrackFitV722_NanoProdv3/231107_134901/0000/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018D_TrackFitV722_NanoProdv3/231107_134901/0001/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018D_TrackFitV722_NanoProdv3/231107_134901/0002/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018D_TrackFitV722_NanoProdv3/231107_134901/0003/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018D_TrackFitV722_NanoProdv3/231107_134901/0004/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018D_TrackFitV722_NanoProdv3/231107_134901/0005/NanoV9Data2018_*.root",
-	      "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018D_TrackFitV722_NanoProdv3/231107_134901/0006/NanoV9Data2018_*.root"
-	    }; 
+	      in_files = {
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018A_TrackFitV722_NanoProdv3/231102_185937/0000/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018A_TrackFitV722_NanoProdv3/231102_185937/0001/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018A_TrackFitV722_NanoProdv3/231102_185937/0002/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018A_TrackFitV722_NanoProdv3/231102_185937/0003/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018A_TrackFitV722_NanoProdv3/231102_185937/0004/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018A_TrackFitV722_NanoProdv3/231102_185937/0005/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018A_TrackFitV722_NanoProdv3/231102_185937/0006/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018B_TrackFitV722_NanoProdv3/231103_093816/0000/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018B_TrackFitV722_NanoProdv3/231103_093816/0001/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018B_TrackFitV722_NanoProdv3/231103_093816/0002/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018C_TrackFitV722_NanoProdv3/231103_101410/0000/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018C_TrackFitV722_NanoProdv3/231103_101410/0001/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018C_TrackFitV722_NanoProdv3/231103_101410/0002/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018D_TrackFitV722_NanoProdv3/231107_134901/0000/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018D_TrackFitV722_NanoProdv3/231107_134901/0001/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018D_TrackFitV722_NanoProdv3/231107_134901/0002/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018D_TrackFitV722_NanoProdv3/231107_134901/0003/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018D_TrackFitV722_NanoProdv3/231107_134901/0004/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018D_TrackFitV722_NanoProdv3/231107_134901/0005/NanoV9Data2018_*.root",
+	        "/scratch/wmass/y2018/SingleMuon/NanoV9Run2018D_TrackFitV722_NanoProdv3/231107_134901/0006/NanoV9Data2018_*.root"
+	      }; 
       }
     }
     
-	// Define dataframe for the input files relevant to the current iteration 
-    ROOT::RDataFrame d( "Events", in_files );
-    auto dlast = std::make_unique<RNode>(d);
-        
-    if(iter>=0) { // MC
+    // Input files given on the command line
+    if(iter>=0 && !inFilesMC.empty()) in_files = split_list(inFilesMC);
+    if(iter<0 && !inFilesData.empty()) in_files = split_list(inFilesData);
+    return in_files;
+  };
+
+  // Configuration the dimuon skim of an iteration depends on, hashed in its name: selection, gen matching and input files, not the binning nor the corrections
+  auto skim_config = [&](int iter) -> std::string {
+    std::ostringstream os;
+    os.precision(17);
+    os << (iter>=0 ? "mc" : "data") << " " << (useKf ? "kf" : "cvh")
+       << " cuts " << muon_cuts.pt_low << " " << muon_cuts.pt_high << " " << muon_cuts.eta_low << " " << muon_cuts.eta_high << " "
+       << muon_cuts.dxybs_max << " " << muon_cuts.iso_max << " " << muon_cuts.medium_id;
+    if(iter>=0) os << " useGenPartIdx " << useGenPartIdx;
+    os << " files";
+    for(const auto& f : expand_files(input_files(iter))) os << " " << f;
+    return os.str();
+  };
+
+  // Configuration the histograms of an iteration depend on (fileCache, dataFrom): selection, binning and, for MC, the corrections of smear0 and its variants
+  auto histos_config = [&](int iter) -> std::string {
+    std::ostringstream os;
+    os.precision(17);
+    os << (iter>=0 ? "mc" : "data") << " " << (useKf ? "kf" : "cvh")
+       << " cuts " << muon_cuts.pt_low << " " << muon_cuts.pt_high << " " << muon_cuts.eta_low << " " << muon_cuts.eta_high << " "
+       << muon_cuts.dxybs_max << " " << muon_cuts.iso_max << " " << muon_cuts.medium_id;
+    os << " pt_edges";
+    for(auto e : pt_edges) os << " " << e;
+    os << " eta_edges";
+    for(auto e : eta_edges) os << " " << e;
+    os << " m " << x_nbins << " " << x_low << " " << x_high;
+    if(iter>=0) {
+      os << " dm " << dm_bins << " " << dm_low << " " << dm_high << " recos";
+      for(const auto& r : recos) os << " " << r;
+      os << " skipUnsmearedReco " << skipUnsmearedReco << " jacFromMoments " << jacFromMoments << " useGenPartIdx " << useGenPartIdx
+         << " usePrevResolFit " << usePrevResolFit;
+      auto add = [&](const std::string& name, const VectorXd& v) {
+        os << " " << name;
+        for(int i = 0; i<v.size(); i++) os << " " << v(i);
+      };
+      std::vector<SmearParams> params = { SmearParams{A_vals_fit, e_vals_fit, M_vals_fit, c_vals_fit, d_vals_fit} };
+      params.insert(params.end(), variant_params.begin(), variant_params.end());
+      for(unsigned int v = 0; v<params.size(); v++) {
+        std::string suffix = v==0 ? "" : "_"+recos[v+1];
+        add("A"+suffix, params[v].A);
+        add("e"+suffix, params[v].e);
+        add("M"+suffix, params[v].M);
+        add("c"+suffix, params[v].c);
+        add("d"+suffix, params[v].d);
+      }
+    }
+    return os.str();
+  };
+  // Partial histograms of the iteration running, over several passes with one input file each
+  std::unique_ptr<FileCache> file_cache;
+
+  // Provenance of the data histograms of iter -1: hash of the configuration and of the input files with their size and modification time
+  auto data_provenance = [&]() -> std::string {
+    std::string prov = histos_config(-1);
+    for(const auto& f : expand_files(input_files(-1))) {
+      struct stat st;
+      if(stat(f.c_str(), &st)!=0) st.st_size = st.st_mtime = -1;
+      prov += Form(" %s|%lld|%lld", f.c_str(), (long long)st.st_size, (long long)st.st_mtime);
+    }
+    return fnv1a_hex(prov);
+  };
+  const std::string data_hash = data_provenance();
+  auto write_data_provenance = [&]() {
+    fout->cd();
+    TNamed("h_data_provenance", data_hash.c_str()).Write(0, TObject::kOverwrite);
+  };
+
+  // Data histograms of iter -1 imported from a previous output file (dataFrom) instead of filled, if they have the same provenance
+  bool importData = false;
+  if(!dataFrom.empty()) {
+    std::unique_ptr<TFile> fin(TFile::Open(dataFrom.c_str(), "READ"));
+    TNamed* prov = (fin && !fin->IsZombie()) ? fin->Get<TNamed>("h_data_provenance") : nullptr;
+    importData = prov && data_hash==prov->GetTitle() && BinSpectra::read(fin.get(), "h_data_bin_m");
+    cout << "Data histograms of " << dataFrom << (importData ? " imported" : " not made from the same input files and configuration, filling them") << endl;
+  }
+  auto import_data = [&]() -> std::vector<TH2D*> {
+    std::unique_ptr<TFile> fin(TFile::Open(dataFrom.c_str(), "READ"));
+    return { BinSpectra::read(fin.get(), "h_data_bin_m")->to_th2() };
+  };
 
-      // Define the indices of individual muons passing selection criteria
-      dlast = std::make_unique<RNode>(dlast->Define("idxs", [&](UInt_t nMuon, RVecB Muon_looseId, RVecF Muon_dxybs, RVecB Muon_isGlobal, 
-								       RVecB Muon_highPurity, RVecB Muon_mediumId, RVecF Muon_pfRelIso04_all, RVecF Muon_pt, RVecF Muon_eta) -> RVecUI 
-      {
-	    RVecUI out;
-	    for(unsigned int i = 0; i < nMuon; i++){
-	      if( Muon_looseId[i] && TMath::Abs(Muon_dxybs[i]) < 0.05 && Muon_isGlobal[i] && Muon_highPurity[i] && Muon_mediumId[i] && Muon_pfRelIso04_all[i]<0.15 &&
-	        Muon_pt[i] >= pt_edges[0] && Muon_pt[i] < pt_edges[ n_pt_bins ]  && Muon_eta[i]>=eta_edges[0] && Muon_eta[i]<=eta_edges[ n_eta_bins ] ) out.emplace_back(i);
-		}
-	    return out;
-      }, {"nMuon", "Muon_looseId", "Muon_dxybs", "Muon_isGlobal", "Muon_highPurity","Muon_mediumId", "Muon_pfRelIso04_all",
-		 useKf ? "Muon_pt" : "Muon_cvhidealPt", useKf ? "Muon_eta" : "Muon_cvhidealEta"} ));
-
-      // Filter to keep only events with exactly 2 oppositely charged, selected muons
-      dlast = std::make_unique<RNode>(dlast->Filter( [](RVecUI idxs, RVecI Muon_charge, bool HLT_IsoMu24 )
-	  {
-	    if( idxs.size()!=2 || !HLT_IsoMu24) return false;
-	    if( Muon_charge[idxs[0]]*Muon_charge[idxs[1]] > 0 ) return false;
-	    return true;
-      }, {"idxs", "Muon_charge", "HLT_IsoMu24"} ));
+  // Concurrent event loops (concurrentLoops): the data graph of iter -1 is only booked, it runs together with the MC graph of iter 0
+  bool runConcurrent = concurrentLoops && firstIter==-1 && lastIter>=0 && !importData;
+  BookedLoop booked_data;
+
+  // Iterations -1..2 of each step, in three passes each with dualTrackFit (0: book the other track fit, 1: nominal, 2: write and fit the other track fit)
+  const int n_passes = dualTrackFit ? 3 : 1;
+  for(int ipass=0; ipass<(4+4*nResidentIter)*n_passes; ipass++) {
+
+    int istep = ipass/n_passes - 1;
+    int pass = dualTrackFit ? ipass%n_passes : 1;
+    int step = (istep+1)/4;
+    int iter = (istep+1)%4 - 1;
+
+    if( !(iter>=firstIter && iter<=lastIter) ) continue;
+
+    // State of the other track fit during its passes, swapped back whatever way the pass ends
+    if(pass!=1) swap_track_fit();
+    OnScopeExit swap_back{ [&, pass]() { if(pass!=1) swap_track_fit(); } };
+    if(pass==0) {
+      // The histograms of the previous iteration have been written
+      { BookedLoop done = std::move(booked_other); }
+      if(iter==2 || (iter==1 && jacFromMoments)) continue;
+    }
+
+    if(step>0 && iter==-1) {
+      // Use the A,e,M,c,d fitted on the output of the previous step as new nominal for smear0
+      std::string run_prev = run_step;
+      if( !run_fits(run_prev) ) break;
+      read_prev_mass_fit("./massfit_"+tag+"_"+run_prev+".root");
+      read_prev_resol_fit("./resolfit_"+tag+"_"+run_prev+".root");
+      usePrevResolFit = true;
+      run_step = resident_run_name(run, step);
+      fout = TFile::Open(("./massscales_"+tag+"_"+run_step+".root").c_str(), "RECREATE");
+      cout << "Doing resident step " << step << ": " << run_step << endl;
+    }
+    cout << "Doing iter " << iter << (dualTrackFit ? (useKf ? " (KF)" : " (CVH)") : "") << endl;
+
+    // Partial histograms of the input files of iter -1 and 0, checked once for the passes of the iteration
+    if(step==0 && iter<1 && !fileCache.empty() && !file_cache && !(iter==-1 && importData))
+      file_cache.reset( new FileCache(fileCache, expand_files(input_files(iter)), iter>=0 ? "mc" : "data", histos_config(iter), fileCacheBlock) );
+
+    // Vector of pointers to histograms output by the dataframe
+    std::vector< ROOT::RDF::RResultPtr<TH1D> > df_histos1D;
+    std::vector<BookedBinHisto> df_histos2D;
+    std::vector< ROOT::RDF::RResultPtr<TH3D> > df_histos3D;
+    // Spectra of the cut variations, written to their own directories
+    std::vector< ROOT::RDF::Experimental::RResultMap<TH2D> > df_varied;
+    // Bootstrap replicas
+    std::vector< ROOT::RDF::RResultPtr<TH2F> > df_boot;
+    ROOT::RDF::RResultPtr<std::vector<DimuonCandidate>> df_resident_dimuons;
+    ROOT::RDF::RResultPtr<std::vector<float>> df_resident_weights;
+
+    // Histograms output by the event loop, from the dataframe in the first step and from memory in the resident steps
+    std::vector<TH1D*> histos1D;
+    std::vector<TH2D*> histos2D;
+    std::vector<TH3D*> histos3D;
+
+    if(step==0 && iter==1 && jacFromMoments) {
+      histos2D = jac_from_moments();
+    }
+    else if(step==0 && iter==-1 && importData) {
+      histos2D = import_data();
+      if(nResidentIter>0) {
+        h_data_resident = (TH2D*)histos2D[0]->Clone();
+        h_data_resident->SetDirectory(0);
+      }
+    }
+    else if(step==0 && pass==2) {
+      // Histograms of the other track fit, filled by the event loop of the nominal one
+      if(iter<2) {
+        for(auto h : booked_other.df_histos1D) histos1D.push_back(h.GetPtr());
+        for(auto h : booked_other.df_histos2D) histos2D.push_back(h.get());
+        for(auto h : booked_other.df_histos3D) histos3D.push_back(h.GetPtr());
+        write_cut_variations(iter, booked_other.df_varied);
+        write_bootstrap(iter, booked_other.df_boot);
+      }
+    }
+    else if(step==0 && mergeShards>0) {
+      if(iter<2) histos2D = merge_shards(iter);
+    }
+    else if(step==0 && file_cache && file_cache->complete()) {
+      histos2D = file_cache->merge();
+      file_cache.reset();
+    }
+    else if(step==0) {
+
+      // Read the input files relevant to the current iteration, only the next block of files without partial histograms with fileCache
+      vector<string> in_files = input_files(iter);
+      if(file_cache) in_files = file_cache->next();
+
+      // Skim of the selected dimuons, written in the event loop of iter -1 (data) or 0 (MC) and read back instead of NanoAOD
+      // The name has a hash of the selection and the input files (skim_config): a skim made with other cuts or files is not read
+      std::string skim_file = skimDir+"/skim_"+(iter>=0 ? "mc" : "data")+"_"+(y2016 ? "2016" : (y2017 ? "2017" : "2018"))+"_"+(useKf ? "kf" : "cvh")
+        +"_"+fnv1a_hex(skim_config(iter))+(nShards>1 ? "_shard"+std::to_string(shard) : "")+".root";
+      bool readSkimIter = readSkim || (writeSkim && iter==1);
+      if(readSkimIter) {
+        cout << "Reading skim " << skim_file << endl;
+        struct stat st;
+        if(stat(skim_file.c_str(), &st)!=0) {
+          std::cerr << "No skim " << skim_file << " made with the same selection and input files, run with --writeSkim first" << '\n';
+          return 1;
+        }
+        in_files = { skim_file };
+      }
+      else if(nShards>1) {
+        in_files = shard_files(in_files, nShards, shard);
+        cout << "Shard " << shard << "/" << nShards << ": " << in_files.size() << " input files" << endl;
+      }
+
+      // Index of the entries passing the selection, the same for iter 0 and 1 as it does not depend on the corrections
+      std::unique_ptr<EntryIndex> entry_index;
+      ROOT::RDF::RResultPtr<std::vector<EntryIndex::Event>> selected_events;
+      ROOT::RDF::RResultPtr<ULong64_t> n_indexed_pass;
+      if(entryIndex && !readSkimIter) {
+        std::string pt_col  = useKf ? "Muon_pt" : (iter>=0 ? "Muon_cvhidealPt" : "Muon_cvhPt");
+        std::string eta_col = useKf ? "Muon_eta" : (iter>=0 ? "Muon_cvhidealEta" : "Muon_cvhEta");
+        std::string config = Form("HLT_IsoMu24, 2 muons of opposite charge, pt in [%g,%g] (%s), eta in [%g,%g] (%s), dxybs<%g, iso<%g, medium ID %d",
+                                  muon_cuts.pt_low, muon_cuts.pt_high, pt_col.c_str(), muon_cuts.eta_low, muon_cuts.eta_high, eta_col.c_str(),
+                                  muon_cuts.dxybs_max, muon_cuts.iso_max, int(muon_cuts.medium_id));
+        config += ", pt edges";
+        for(auto e : pt_edges) config += Form(" %g", e);
+        config += ", eta edges";
+        for(auto e : eta_edges) config += Form(" %g", e);
+        entry_index.reset( new EntryIndex(entryIndexDir+"/entries_"+(iter>=0 ? "mc" : "data")+"_"+(y2016 ? "2016" : (y2017 ? "2017" : "2018"))+"_"+(useKf ? "kf" : "cvh")
+                                          +(nShards>1 ? "_shard"+std::to_string(shard) : "")+".root", expand_files(in_files), config) );
+        if(!entry_index->enabled()) entry_index.reset();
+      }
+
+	  // Define dataframe for the input files relevant to the current iteration, the one of the other track fit if its event loop is booked
+      std::unique_ptr<ROOT::RDataFrame> d;
+      if(!booked_other.d) d = entry_index ? std::make_unique<ROOT::RDataFrame>( entry_index->chain() ) : std::make_unique<ROOT::RDataFrame>( "Events", in_files );
+      auto dlast = std::make_unique<RNode>(booked_other.d ? *booked_other.d : *d);
+
+      // Trigger and muon multiplicity first, before the muon arrays are read, then the columns of the selection which do not depend on the track fit:
+      // the node is shared with the graph of the other track fit if its event loop is booked (dualTrackFit)
+      // Muon_genPartIdx is used for the gen matching if requested and present in the input, DeltaR matching otherwise
+      bool gen_idx = iter>=0 && useGenPartIdx && dlast->HasColumn("Muon_genPartIdx");
+      std::unique_ptr<RNode> dshared;
+      if(booked_other.dshared) dshared = std::make_unique<RNode>(*booked_other.dshared);
+      else if(!readSkimIter) dshared = std::make_unique<RNode>(define_track_fit_independent(filter_trigger(*dlast), muon_cuts, iter>=0 && !gen_idx));
+      if(dshared) dlast = std::make_unique<RNode>(*dshared);
+      ROOT::RDF::RResultPtr<ULong64_t> n_io_entries = booked_other.n_io_entries;
+      ROOT::RDF::RResultPtr<ULong64_t> n_io_trigger = booked_other.n_io_trigger;
+      if(ioStats && d && dshared) {
+        n_io_entries = d->Count();
+        n_io_trigger = dshared->Count();
+      }
+        
+      if(iter>=0) { // MC
+
+        if(readSkimIter) {
+          dlast = std::make_unique<RNode>(define_dimuon_from_skim(*dlast, true));
+        }
+        else {
+          // Define the indices of individual muons passing selection criteria
+          dlast = std::make_unique<RNode>(define_selected_muons(*dlast, muon_cuts, useKf ? "Muon_pt" : "Muon_cvhidealPt", useKf ? "Muon_eta" : "Muon_cvhidealEta"));
+          if(!cut_variations.empty() && iter==0)
+            dlast = std::make_unique<RNode>(vary_selected_muons(*dlast, cut_variations, useKf ? "Muon_pt" : "Muon_cvhidealPt", useKf ? "Muon_eta" : "Muon_cvhidealEta"));
+
+          // Filter to keep only events with exactly 2 oppositely charged, selected muons
+          dlast = std::make_unique<RNode>(dlast->Filter( prof.filter("pair_filter", [](const SelectedMuons& idxs, const RVecI& Muon_charge )
+	      {
+	        if( idxs.n!=2 ) return false;
+	        if( Muon_charge[idxs.idx[0]]*Muon_charge[idxs.idx[1]] > 0 ) return false;
+	        return true;
+          }), {"idxs", "Muon_charge"} ));
+          if(entry_index && !entry_index->valid()) selected_events = define_index_event(*dlast, entry_index.get()).Take<EntryIndex::Event>("index_event");
+          if(entry_index && entry_index->valid()) n_indexed_pass = dlast->Count();
+          if(nBootstrap>0) dlast = std::make_unique<RNode>(define_bootstrap_seed(*dlast, true));
       
-      // Define MC weight
-      dlast = std::make_unique<RNode>(dlast->Define("weight", [](float weight) -> float
-	  {
-	    return std::copysign(1.0, weight);
-      }, {"Generator_weight"} ));          
+          // Define MC weight
+          dlast = std::make_unique<RNode>(dlast->Define("weight", prof.define("weight", [](float weight) -> float
+	      {
+	        return std::copysign(1.0, weight);
+          }), {"Generator_weight"} ));          
       
-      // Define pos and neg curvature k smeared according to the curvature biases A,e,M,c,d computed in previous iterations
-      dlast = std::make_unique<RNode>(dlast->Define("Muon_ksmear", [&](RVecUI idxs,
-									   RVecF Muon_pt, RVecF Muon_eta, RVecF Muon_phi, RVecF Muon_mass, RVecI Muon_charge,
-									   UInt_t nGenPart, RVecI GenPart_status, RVecI GenPart_statusFlags, RVecI GenPart_pdgId,
-									   RVecF GenPart_pt, RVecF GenPart_eta, RVecF GenPart_phi, RVecF GenPart_mass) -> RVecF
-	  {
-	    RVecF out;
-	    unsigned int idxP = Muon_charge[idxs[0]]>0 ? idxs[0] : idxs[1];
-	    unsigned int idxM = Muon_charge[idxs[0]]>0 ? idxs[1] : idxs[0];
-	    // reco muon
-	    ROOT::Math::PtEtaPhiMVector muP( Muon_pt[ idxP ], Muon_eta[ idxP ], Muon_phi[ idxP ], Muon_mass[ idxP ] );
-	    ROOT::Math::PtEtaPhiMVector muM( Muon_pt[ idxM ], Muon_eta[ idxM ], Muon_phi[ idxM ], Muon_mass[ idxM ] );
-	    // gen matching
-	    ROOT::Math::PtEtaPhiMVector gmuP( 0., 0., 0., 0. );
-	    ROOT::Math::PtEtaPhiMVector gmuM( 0., 0., 0., 0. );
-	    for(unsigned int i = 0; i < nGenPart; i++) {
-	      bool isGoodGenPart = (GenPart_status[i]==1 && (GenPart_statusFlags[i] & 1 || (GenPart_statusFlags[i] & (1<<5))) && TMath::Abs(GenPart_pdgId[i])==13);
-	      if(!isGoodGenPart) continue;
-	      ROOT::Math::PtEtaPhiMVector gen(GenPart_pt[i], GenPart_eta[i], GenPart_phi[i], GenPart_mass[i]);
-	      if( ROOT::Math::VectorUtil::DeltaR(gen, muP) < 0.1 && ROOT::Math::VectorUtil::DeltaR(gen, muM) > 0.1 ) gmuP = gen;
-	      else if( ROOT::Math::VectorUtil::DeltaR(gen, muP) > 0.1 && ROOT::Math::VectorUtil::DeltaR(gen, muM) < 0.1 ) gmuM = gen;
-	    }
-	
-	    // gen pT cut
-	    if( gmuP.Pt()>10. && gmuM.Pt()>10. ) {
-	  
-	      float kmuP = 1./muP.Pt();
-	      float kmuM = 1./muM.Pt();
-	      float kgmuP = 1./gmuP.Pt();
-	      float kgmuM = 1./gmuM.Pt();
-	  
-	      float scale_smear0P = 1.0;
-	      float scale_smear0M = 1.0;
-	      float resol_smear0P = 0.0;
-	      float resol_smear0M = 0.0;
-	  
-	      // AeMcd are eta dependent 
-	      unsigned int ietaP = n_eta_bins;
-	      for(unsigned int ieta_p = 0; ieta_p<n_eta_bins; ieta_p++) {
-	        float eta_p_low = eta_edges[ieta_p];
-	        float eta_p_up  = eta_edges[ieta_p+1];
-	        if( muP.Eta()>=eta_p_low && muP.Eta()<eta_p_up) ietaP = ieta_p;	  
-	      }
-	      unsigned int ietaM = n_eta_bins;
-	      for(unsigned int ieta_m = 0; ieta_m<n_eta_bins; ieta_m++) {
-	        float eta_m_low = eta_edges[ieta_m];
-	        float eta_m_up  = eta_edges[ieta_m+1];
-	        if( muM.Eta()>=eta_m_low && muM.Eta()<eta_m_up) ietaM = ieta_m;	  
-	      }
-
-	      if(ietaP<n_eta_bins && ietaM<n_eta_bins) {
-            // Correct the MC curvature with the curvature scale biases derived in previous iterations (which are respectively equal to (-1)* sum of the pT scale biases from previous iterations)
-	        // if usePrevMassFit is false, A,e,M are 0
-			scale_smear0P = (1. + A_vals_fit(ietaP) - e_vals_fit(ietaP)*kmuP + M_vals_fit(ietaP)/kmuP);
-	        scale_smear0M = (1. + A_vals_fit(ietaM) - e_vals_fit(ietaM)*kmuM - M_vals_fit(ietaM)/kmuM);
-	        //cout << "smear0:" << scale_smear0P << ": " << 1 << " + " << A_vals_fit(ietaP) << " - " << e_vals_fit(ietaP)*kmuP << " + " << M_vals_fit(ietaP)/kmuP << endl;
-	        if(usePrevResolFit) {
-			  // Correct the MC curvature with the resolution biases derived in previous iterations (which are respectively equal to the sum of the resolution biases from previous iterations)  	
-	          resol_smear0P = TMath::Sqrt( TMath::Max( 1.0 + c_vals_fit(ietaP) + d_vals_fit(ietaP)*kmuP, 0.0)  ) - 1.0;
-	          resol_smear0M = TMath::Sqrt( TMath::Max( 1.0 + c_vals_fit(ietaM) + d_vals_fit(ietaM)*kmuM, 0.0)  ) - 1.0;
-	          //cout << "resol_smear0P: sqrt( max(1.0 + " << c_vals_fit(ietaP)  << " + " << d_vals_fit(ietaP)*kmuP << ")) - 1.0 = " << resol_smear0P << endl;
-	          //cout << "resol_smear0M: sqrt( max(1.0 + " << c_vals_fit(ietaM)  << " + " << d_vals_fit(ietaM)*kmuM << ")) - 1.0 = " << resol_smear0M << endl;  
-	        }
-	        float kmuPsmear0 = (kgmuP + (kmuP - kgmuP)*(1.0 + resol_smear0P))*scale_smear0P; // if A,e,M,c,d = 0, kmuPsmear0 = kmuP
-	        float kmuMsmear0 = (kgmuM + (kmuM - kgmuM)*(1.0 + resol_smear0M))*scale_smear0M; // if A,e,M,c,d = 0, kmuMsmear0 = kmuM	  
-	        out.emplace_back( kmuPsmear0 );
-	        out.emplace_back( kmuMsmear0 );
-		  }	  
-		  else {
-	        out.emplace_back(0.0);
-	        out.emplace_back(0.0);
-	      }	      
-	    }
-	    else {
-	      out.emplace_back(0.0);
-	      out.emplace_back(0.0);
-	    }
-	    return out;
-	  }, {"idxs", useKf ? "Muon_pt" : "Muon_cvhidealPt", useKf ? "Muon_eta" : "Muon_cvhidealEta", useKf ? "Muon_phi" : "Muon_cvhidealPhi", "Muon_mass",
-		 "Muon_charge", "nGenPart", "GenPart_status", "GenPart_statusFlags", "GenPart_pdgId", "GenPart_pt", "GenPart_eta", "GenPart_phi", "GenPart_mass"} ));
+          // Define the dimuon candidate, matched to gen muons from Muon_genPartIdx or by DeltaR to the good gen muons of gen_muons
+          if(gen_idx) {
+            cout << "Gen matching with Muon_genPartIdx" << endl;
+            dlast = std::make_unique<RNode>(dlast->Define("dimuon", prof.define("dimuon", [](const SelectedMuons& idxs, const RVecF& Muon_pt, const RVecF& Muon_eta, const RVecF& Muon_phi, const RVecF& Muon_mass, const RVecI& Muon_charge,
+								       const RVecI& Muon_genPartIdx, const RVecI& GenPart_status, const RVecI& GenPart_statusFlags, const RVecI& GenPart_pdgId,
+								       const RVecF& GenPart_pt, const RVecF& GenPart_eta, const RVecF& GenPart_phi, const RVecF& GenPart_mass) -> DimuonCandidate
+	        {
+	          DimuonCandidate cand = make_candidate(idxs, Muon_pt, Muon_eta, Muon_phi, Muon_mass, Muon_charge);
+	          int igenP, igenM;
+	          match_gen_idx(cand, Muon_genPartIdx, GenPart_status, GenPart_statusFlags, GenPart_pdgId, igenP, igenM);
+	          set_gen(cand, igenP, igenM, GenPart_pt, GenPart_eta, GenPart_phi, GenPart_mass);
+	          return cand;
+	        }), {"idxs", useKf ? "Muon_pt" : "Muon_cvhidealPt", useKf ? "Muon_eta" : "Muon_cvhidealEta", useKf ? "Muon_phi" : "Muon_cvhidealPhi", "Muon_mass", "Muon_charge",
+	            "Muon_genPartIdx", "GenPart_status", "GenPart_statusFlags", "GenPart_pdgId", "GenPart_pt", "GenPart_eta", "GenPart_phi", "GenPart_mass"} ));
+          }
+          else {
+            dlast = std::make_unique<RNode>(dlast->Define("dimuon", prof.define("dimuon", [](const SelectedMuons& idxs, const RVecF& Muon_pt, const RVecF& Muon_eta, const RVecF& Muon_phi, const RVecF& Muon_mass, const RVecI& Muon_charge,
+								       const GenMuons& gen_muons, UInt_t nGenPart, const RVecI& GenPart_status, const RVecI& GenPart_statusFlags, const RVecI& GenPart_pdgId,
+								       const RVecF& GenPart_pt, const RVecF& GenPart_eta, const RVecF& GenPart_phi, const RVecF& GenPart_mass) -> DimuonCandidate
+	        {
+	          DimuonCandidate cand = make_candidate(idxs, Muon_pt, Muon_eta, Muon_phi, Muon_mass, Muon_charge);
+	          int igenP, igenM;
+	          if(gen_muons.overflow) match_gen_dr(cand, nGenPart, GenPart_status, GenPart_statusFlags, GenPart_pdgId, GenPart_eta, GenPart_phi, igenP, igenM);
+	          else match_gen_dr(cand, gen_muons, igenP, igenM);
+	          set_gen(cand, igenP, igenM, GenPart_pt, GenPart_eta, GenPart_phi, GenPart_mass);
+	          return cand;
+	        }), {"idxs", useKf ? "Muon_pt" : "Muon_cvhidealPt", useKf ? "Muon_eta" : "Muon_cvhidealEta", useKf ? "Muon_phi" : "Muon_cvhidealPhi", "Muon_mass", "Muon_charge",
+	            "gen_muons", "nGenPart", "GenPart_status", "GenPart_statusFlags", "GenPart_pdgId", "GenPart_pt", "GenPart_eta", "GenPart_phi", "GenPart_mass"} ));
+          }
+        }
+
+        // Define pos and neg curvature k smeared according to the curvature biases A,e,M,c,d computed in previous iterations
+        // The biases are copied, the event loop may run with the state of the other track fit swapped in (dualTrackFit)
+        std::shared_ptr<const SmearParams> smear_params = std::make_shared<const SmearParams>( SmearParams{A_vals_fit, e_vals_fit, M_vals_fit, c_vals_fit, d_vals_fit} );
+        dlast = std::make_unique<RNode>(dlast->Define("Muon_ksmear", prof.define("Muon_ksmear", [&,smear_params](const DimuonCandidate& dimuon) -> std::array<float, 2>
+	    {
+	      return smear_curvatures(dimuon, binning, smear_params->A, smear_params->e, smear_params->M, smear_params->c, smear_params->d, usePrevResolFit);
+	    }), {"dimuon"} ));
+      
+	    // Define eta+, pt+, eta-, pt- indexes for each muon pair that passed selection. The 1st entry in "indexes" is for reco, the 2nd for smear0
+	    dlast = std::make_unique<RNode>(dlast->Define("indexes", prof.define("indexes", [&](const DimuonCandidate& dimuon, const std::array<float, 2>& Muon_ksmear) -> std::array<unsigned int, 2>
+	    {
+	      return dimuon_indexes(dimuon, Muon_ksmear, binning);
+	    }), {"dimuon", "Muon_ksmear"} ));
       
-	  // Define eta+, pt+, eta-, pt- indexes for each muon pair that passed selection. The 1st entry in "indexes" is for reco, the 2nd for smear0
-	  dlast = std::make_unique<RNode>(dlast->Define("indexes", [&](RVecUI idxs, RVecF Muon_pt, RVecF Muon_eta, RVecI Muon_charge, RVecF Muon_ksmear) -> RVecUI
-	  {
-	    unsigned int idxP = Muon_charge[idxs[0]]>0 ? idxs[0] : idxs[1];
-	    unsigned int idxM = Muon_charge[idxs[0]]>0 ? idxs[1] : idxs[0];
-	    float ptP  = Muon_pt[idxP];
-    	float ptM  = Muon_pt[idxM];
-    	float ksmear0P = Muon_ksmear[0]>0. ? Muon_ksmear[0] : 1./(pt_edges[0]-0.01);
-    	float ksmear0M = Muon_ksmear[1]>0. ? Muon_ksmear[1] : 1./(pt_edges[0]-0.01);
-    	float etaP = Muon_eta[idxP];
-    	float etaM = Muon_eta[idxM];
-    	RVecUI out;
-    	out.emplace_back(n_bins);
-    	out.emplace_back(n_bins);
+	    for(unsigned int r = 0 ; r<2; r++) {
+          dlast = std::make_unique<RNode>(dlast->Define( TString(("index_"+recos[r]).c_str()), prof.define("index_"+recos[r], [r](const std::array<unsigned int, 2>& indexes) 
+		  {
+	  	    return indexes[r];
+		  }), {"indexes"} ));
+        }
+      
+	    // Define gen, reco, smear0 mass per muon pair
+	    dlast = std::make_unique<RNode>(dlast->Define("masses", prof.define("masses", [&](const DimuonCandidate& dimuon, const std::array<float, 2>& Muon_ksmear) -> DimuonMasses
+	    {
+	      return dimuon_masses(dimuon, Muon_ksmear, binning);
+        }), {"dimuon", "Muon_ksmear"} ));
+
+        // Smear0 variants: their own smeared curvatures, 4D bin index and masses (gen, reco, variant)
+        for(unsigned int r = 2 ; r<recos.size(); r++) {
+          const SmearParams* params = &variant_params[r-2];
+          dlast = std::make_unique<RNode>(dlast->Define( TString(("Muon_ksmear_"+recos[r]).c_str()), prof.define("Muon_ksmear_"+recos[r], [&,params](const DimuonCandidate& dimuon) -> std::array<float, 2>
+	      {
+	        return smear_curvatures(dimuon, binning, params->A, params->e, params->M, params->c, params->d, usePrevResolFit);
+	      }), {"dimuon"} ));
+          dlast = std::make_unique<RNode>(dlast->Define( TString(("index_"+recos[r]).c_str()), prof.define("index_"+recos[r], [&](const DimuonCandidate& dimuon, const std::array<float, 2>& ksmear) -> unsigned int
+	      {
+	        return dimuon_indexes(dimuon, ksmear, binning)[1];
+	      }), {"dimuon", "Muon_ksmear_"+recos[r]} ));
+          dlast = std::make_unique<RNode>(dlast->Define( TString(masses_column(r).c_str()), prof.define(masses_column(r), [&](const DimuonCandidate& dimuon, const std::array<float, 2>& ksmear) -> DimuonMasses
+	      {
+	        return dimuon_masses(dimuon, ksmear, binning);
+	      }), {"dimuon", "Muon_ksmear_"+recos[r]} ));
+        }
+
+        for(unsigned int r = 0 ; r<recos.size(); r++) {
+		  if(skipUnsmearedReco && recos[r]=="reco") continue;
+
+	      unsigned int mpos = idx_map.at(recos[r]);
+
+	      dlast = std::make_unique<RNode>(dlast->Define(TString( (recos[r]+"_m").c_str() ), prof.define(recos[r]+"_m", [mpos](const DimuonMasses& masses)
+		  {
+	        return masses.ok ? masses.m[mpos] : -99.;
+	      }), {masses_column(r)} ));
+
+          // Define mass - gen mass
+	      dlast = std::make_unique<RNode>(dlast->Define(TString( (recos[r]+"_dm").c_str() ), prof.define(recos[r]+"_dm", [mpos](const DimuonMasses& masses)
+		  {
+	        return masses.ok ? masses.m[mpos] - masses.m[0] : -99.;
+	      }), {masses_column(r)} ));
+
+	      dlast = std::make_unique<RNode>(dlast->Define(TString( (recos[r]+"_gm").c_str() ), prof.define(recos[r]+"_gm", [](const DimuonMasses& masses) 
+		  {
+            return masses.ok ? masses.m[0] : -99.;
+          }), {masses_column(r)} ));
+        }
+      
+        // Define jacobian weights per event, from the fits of iter 0 (only needed in iter 1)
+        for(unsigned int r = 0 ; r<recos.size(); r++) {
+		  if(iter!=1) break;
+		  if(skipUnsmearedReco && recos[r]=="reco") continue;
+
+	      unsigned int rpos = idx_map.at(recos[r]);
+		  // Gaussian mean and rms of the mass - gen mass distribution in a 4D bin, Crystal Ball jacobian event weight in a 4D bin, in a mass - gen mass bin
+	      std::shared_ptr<const JacTable> jac_table = std::make_shared<const JacTable>( h_map.at("mean_"+recos[r]), h_map.at("rms_"+recos[r]),
+	                                                                                    h_jac_map.at("jscale_cb_per_evt_"+recos[r]), h_jac_map.at("jwidth_cb_per_evt_"+recos[r]) );
+
+          dlast = std::make_unique<RNode>(dlast->Define( TString(("weights_jac_"+recos[r]).c_str()), prof.define("weights_jac_"+recos[r], [rpos,jac_table](const DimuonMasses& masses, unsigned int index) -> JacWeights
+	      {
+	        if(!masses.ok) return JacWeights();
+	        return jac_table->weights(index, masses.m[rpos], masses.m[0]);
+          }), {masses_column(r), "index_"+recos[r]} ));
+
+	      dlast = std::make_unique<RNode>(dlast->Define( TString((recos[r]+"_jscale_weight").c_str()), prof.define(recos[r]+"_jscale_weight", [](const JacWeights& weights_jac, float weight) -> float
+		  {
+	        return weights_jac.jscale*weight;
+	      }), {"weights_jac_"+recos[r], "weight"} ));
+
+	      dlast = std::make_unique<RNode>(dlast->Define( TString((recos[r]+"_jwidth_weight").c_str()), prof.define(recos[r]+"_jwidth_weight", [](const JacWeights& weights_jac, float weight) -> float
+		  {
+	        return weights_jac.jwidth*weight;
+	      }), {"weights_jac_"+recos[r], "weight"} ));
+
+	      dlast = std::make_unique<RNode>(dlast->Define( TString((recos[r]+"_jscale_cb_weight").c_str()), prof.define(recos[r]+"_jscale_cb_weight", [](const JacWeights& weights_jac, float weight) -> float
+		  {
+            return weights_jac.jscale_cb*weight;
+          }), {"weights_jac_"+recos[r], "weight"} ));
 	
-    	unsigned int ibin = 0;
-    	for(unsigned int ieta_p = 0; ieta_p<n_eta_bins; ieta_p++){
-    	  float eta_p_low = eta_edges[ieta_p];
-    	  float eta_p_up  = eta_edges[ieta_p+1];      
-    	  for(unsigned int ipt_p = 0; ipt_p<n_pt_bins; ipt_p++){
-    	    float pt_p_low = pt_edges[ipt_p];
-    	    float pt_p_up  = pt_edges[ipt_p+1];
-    	    for(unsigned int ieta_m = 0; ieta_m<n_eta_bins; ieta_m++){
-    	      float eta_m_low = eta_edges[ieta_m];
-    	      float eta_m_up  = eta_edges[ieta_m+1];      
-    	      for(unsigned int ipt_m = 0; ipt_m<n_pt_bins; ipt_m++){
-    			float pt_m_low = pt_edges[ipt_m];
-    			float pt_m_up  = pt_edges[ipt_m+1];
-    	      	if( etaP>=eta_p_low && etaP<eta_p_up &&
-    		  	etaM>=eta_m_low && etaM<eta_m_up &&
-    		  	ptP>=pt_p_low   && ptP<pt_p_up &&
-    		  	ptM>=pt_m_low   && ptM<pt_m_up 
-    		  	) out[0] = ibin;
-    	      	if( etaP>=eta_p_low && etaP<eta_p_up &&
-    		  	etaM>=eta_m_low && etaM<eta_m_up &&
-    		  	1./ksmear0P>=pt_p_low   && 1./ksmear0P<pt_p_up &&
-    		  	1./ksmear0M>=pt_m_low   && 1./ksmear0M<pt_m_up 
-    		  	) out[1] = ibin;
-    	      	ibin++;
-    	      }
-    	    }
-    	  }
-    	}
-    	return out;
-	  }, {"idxs", useKf ? "Muon_pt" : "Muon_cvhidealPt", useKf ? "Muon_eta" : "Muon_cvhidealEta", "Muon_charge", "Muon_ksmear"} ));
+	      dlast = std::make_unique<RNode>(dlast->Define( TString((recos[r]+"_jwidth_cb_weight").c_str()), prof.define(recos[r]+"_jwidth_cb_weight", [](const JacWeights& weights_jac, float weight) -> float
+		  {
+            return weights_jac.jwidth_cb*weight;
+          }), {"weights_jac_"+recos[r], "weight"} ));
+        }
       
-	  for(unsigned int r = 0 ; r<recos.size(); r++) {
-        dlast = std::make_unique<RNode>(dlast->Define( TString(("index_"+recos[r]).c_str()), [r](RVecUI indexes) 
-		{
-	  	  return indexes.at(r);
-		}, {"indexes"} ));
+
+        // Moments of the events in each (4D bin, mass bin) cell, from which the jacobian histograms of iter 1 are rebuilt (only needed in iter 0 with jacFromMoments)
+        // mom0..4: w, w*dm, w*dm^2, w*m*dm, w*m of the events matched to gen, m_dm_cell: (mass bin)*dm_bins + (mass - gen mass bin), -1 outside the dm range
+        for(unsigned int r = 0 ; r<recos.size(); r++) {
+          if(iter!=0 || !jacFromMoments) break;
+		  if(skipUnsmearedReco && recos[r]=="reco") continue;
+
+	      unsigned int mpos = idx_map.at(recos[r]);
+	      dlast = std::make_unique<RNode>(dlast->Define( TString(("moments_"+recos[r]).c_str()), prof.define("moments_"+recos[r], [mpos](const DimuonMasses& masses, float weight) -> std::array<float, 5>
+	      {
+	        if(!masses.ok) return {{0., 0., 0., 0., 0.}};
+	        float m = masses.m[mpos];
+	        float dm = masses.m[mpos] - masses.m[0];
+	        return {{weight, weight*dm, weight*dm*dm, weight*m*dm, weight*m}};
+	      }), {masses_column(r), "weight"} ));
+	      for(unsigned int k = 0; k<5; k++) {
+	        dlast = std::make_unique<RNode>(dlast->Define( TString((recos[r]+"_mom"+std::to_string(k)).c_str()), prof.define(recos[r]+"_mom"+std::to_string(k), [k](const std::array<float, 5>& moments) -> float
+	        {
+	          return moments[k];
+	        }), {"moments_"+recos[r]} ));
+	      }
+	      TAxis m_axis(x_nbins, x_low, x_high);
+	      dlast = std::make_unique<RNode>(dlast->Define( TString((recos[r]+"_m_dm_cell").c_str()), prof.define(recos[r]+"_m_dm_cell", [mpos,m_axis,dm_bins,dm_low,dm_high](const DimuonMasses& masses) -> double
+	      {
+	        unsigned int jdm = JacTable::find_dm(masses.m[mpos] - masses.m[0], dm_bins, dm_low, dm_high);
+	        if(!masses.ok || jdm>=(unsigned int)dm_bins) return -1.;
+	        return m_axis.FindFixBin(double(masses.m[mpos]))*dm_bins + jdm + 0.5;
+	      }), {masses_column(r)} ));
+        }
       }
+    
+      else { // data
+	    if(readSkimIter) {
+	      dlast = std::make_unique<RNode>(define_dimuon_from_skim(*dlast, false));
+	    }
+	    else {
+	      // Define indices of individual muons that pass the selection
+	      dlast = std::make_unique<RNode>(define_selected_muons(*dlast, muon_cuts, useKf ? "Muon_pt" : "Muon_cvhPt", useKf ? "Muon_eta" : "Muon_cvhEta"));
+	      if(!cut_variations.empty())
+	        dlast = std::make_unique<RNode>(vary_selected_muons(*dlast, cut_variations, useKf ? "Muon_pt" : "Muon_cvhPt", useKf ? "Muon_eta" : "Muon_cvhEta"));
       
-	  // Define gen, reco, smear0 mass per muon pair
-	  dlast = std::make_unique<RNode>(dlast->Define("masses", [&](RVecUI idxs,
-								       RVecF Muon_pt, RVecF Muon_eta, RVecF Muon_phi, RVecF Muon_mass, RVecI Muon_charge,
-								       UInt_t nGenPart, RVecI GenPart_status, RVecI GenPart_statusFlags, RVecI GenPart_pdgId,
-								       RVecF GenPart_pt, RVecF GenPart_eta, RVecF GenPart_phi, RVecF GenPart_mass,
-								       RVecF Muon_ksmear) -> RVecF
-	  {
-	    RVecF out;
-	    unsigned int idxP = Muon_charge[idxs[0]]>0 ? idxs[0] : idxs[1];
-	    unsigned int idxM = Muon_charge[idxs[0]]>0 ? idxs[1] : idxs[0];
-	    ROOT::Math::PtEtaPhiMVector muP( Muon_pt[ idxP ], Muon_eta[ idxP ], Muon_phi[ idxP ], Muon_mass[ idxP ] );
-	    ROOT::Math::PtEtaPhiMVector muM( Muon_pt[ idxM ], Muon_eta[ idxM ], Muon_phi[ idxM ], Muon_mass[ idxM ] );
-	    // gen matching
-		ROOT::Math::PtEtaPhiMVector gmuP( 0., 0., 0., 0. );
-	    ROOT::Math::PtEtaPhiMVector gmuM( 0., 0., 0., 0. );
-	    for(unsigned int i = 0; i < nGenPart; i++) {
-	      bool isGoodGenPart = (GenPart_status[i]==1 && (GenPart_statusFlags[i] & 1 || (GenPart_statusFlags[i] & (1<<5))) && TMath::Abs(GenPart_pdgId[i])==13);
-	      if(!isGoodGenPart) continue;
-	      ROOT::Math::PtEtaPhiMVector gen(GenPart_pt[i], GenPart_eta[i], GenPart_phi[i], GenPart_mass[i]);
-	      if( ROOT::Math::VectorUtil::DeltaR(gen, muP) < 0.1 && ROOT::Math::VectorUtil::DeltaR(gen, muM) > 0.1) gmuP = gen;
-	      else if( ROOT::Math::VectorUtil::DeltaR(gen, muP) > 0.1 && ROOT::Math::VectorUtil::DeltaR(gen, muM) < 0.1) gmuM = gen;
+          // Filter for muon pairs
+          dlast = std::make_unique<RNode>(dlast->Filter( prof.filter("pair_filter", [](const SelectedMuons& idxs, const RVecI& Muon_charge )
+	      {
+	        if( idxs.n!=2 ) return false;
+	        if( Muon_charge[idxs.idx[0]]*Muon_charge[idxs.idx[1]] > 0 ) return false;
+	        return true;
+          }), {"idxs", "Muon_charge"} ));
+          if(entry_index && !entry_index->valid()) selected_events = define_index_event(*dlast, entry_index.get()).Take<EntryIndex::Event>("index_event");
+          if(entry_index && entry_index->valid()) n_indexed_pass = dlast->Count();
+          if(nBootstrap>0) dlast = std::make_unique<RNode>(define_bootstrap_seed(*dlast, false));
+	  
+          // Define data weight = 1.0
+          dlast = std::make_unique<RNode>(dlast->Define("weight", prof.define("weight", []()->float{ return 1.0; }), {} ));          
+
+	      // Define the dimuon candidate
+	      dlast = std::make_unique<RNode>(dlast->Define("dimuon", prof.define("dimuon", [](const SelectedMuons& idxs, const RVecF& Muon_pt, const RVecF& Muon_eta, const RVecF& Muon_phi, const RVecF& Muon_mass, const RVecI& Muon_charge) -> DimuonCandidate
+	      {
+	        return make_candidate(idxs, Muon_pt, Muon_eta, Muon_phi, Muon_mass, Muon_charge);
+	      }), {"idxs", useKf ? "Muon_pt" : "Muon_cvhPt", useKf ? "Muon_eta" : "Muon_cvhEta", useKf ? "Muon_phi" : "Muon_cvhPhi", "Muon_mass", "Muon_charge"} ));
 	    }
-	
-	    if( gmuP.Pt()>10. && gmuM.Pt()>10.) {
-	      out.emplace_back( (gmuP + gmuM).M() );
-	      out.emplace_back( (muP + muM).M() );
-    	  float ksmear0P = Muon_ksmear[0]>0. ? Muon_ksmear[0] : 1./(pt_edges[0]-0.01);
-	      float ksmear0M = Muon_ksmear[1]>0. ? Muon_ksmear[1] : 1./(pt_edges[0]-0.01);	  
-    	  ROOT::Math::PtEtaPhiMVector muP_smear0( 1./ksmear0P, Muon_eta[ idxP ], Muon_phi[ idxP ], Muon_mass[ idxP ] );
-	      ROOT::Math::PtEtaPhiMVector muM_smear0( 1./ksmear0M, Muon_eta[ idxM ], Muon_phi[ idxM ], Muon_mass[ idxM ] );      
-	      out.emplace_back( (muP_smear0 + muM_smear0).M() );	
-	    } 
-	
-	    return out;
-      }, {"idxs", useKf ? "Muon_pt" : "Muon_cvhidealPt", useKf ? "Muon_eta" : "Muon_cvhidealEta", useKf ? "Muon_phi" : "Muon_cvhidealPhi",
-	   "Muon_mass", "Muon_charge", "nGenPart", "GenPart_status", "GenPart_statusFlags", "GenPart_pdgId", "GenPart_pt", "GenPart_eta",
-	   "GenPart_phi", "GenPart_mass", "Muon_ksmear"} ));
 
-      for(unsigned int r = 0 ; r<recos.size(); r++) {
-		if(skipUnsmearedReco && recos[r]=="reco") continue;
+	    // Define eta+, pt+, eta-, pt- indexes for each muon pair that passed selection   
+	    dlast = std::make_unique<RNode>(dlast->Define("index_data", prof.define("index_data", [&](const DimuonCandidate& dimuon) -> unsigned int
+	    {
+	      return binning.index(dimuon.etaP, dimuon.ptP, dimuon.etaM, dimuon.ptM);
+	    }), {"dimuon"} ));
+
+	    // Define mass in data    
+	    dlast = std::make_unique<RNode>(dlast->Define("data_m", prof.define("data_m", [](const DimuonCandidate& dimuon) -> float
+	    {
+	      return pair_mass( dimuon.ptP, dimuon.etaP, dimuon.phiP, dimuon.massP, dimuon.ptM, dimuon.etaM, dimuon.phiM, dimuon.massM );
+	    }), {"dimuon"} ));           
+      }
+    
+      // Book the skim, written in the same event loop as the histograms
+      ROOT::RDF::RResultPtr<ROOT::RDF::RInterface<ROOT::Detail::RDF::RLoopManager>> skim_snapshot;
+      if(writeSkim && iter<1) {
+        cout << "Writing skim " << skim_file << endl;
+        ROOT::RDF::RSnapshotOptions opts;
+        opts.fLazy = true;
+        skim_snapshot = define_skim_columns(*dlast, iter>=0).Snapshot("Events", skim_file, skim_columns(iter>=0), opts);
+      }
 
-	    unsigned int mpos = idx_map.at(recos[r]);
+      if(iter==-1) { // Book data histogram
+	    // x-axis: 4D bin index, y-axis: data mass, weight = 1
+        book_bin_histos<float, 1>(df_histos2D, *dlast, {{ {"h_data_bin_m", "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high} }}, "index_data", "data_m", {{"weight"}}, n_slots, fillBuffer);
+        // The same for each cut variation
+        if(!cut_variations.empty())
+          df_varied.push_back( ROOT::RDF::Experimental::VariationsFor( dlast->Histo2D<unsigned int, float, float>({"h_data_bin_m", "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high}, "index_data", "data_m", "weight") ) );
+        // Bootstrap replicas
+        if(nBootstrap>0)
+          df_boot.push_back( dlast->Book<unsigned int, float, float, ULong64_t>(BootstrapFillHelper("h_data_bin_m_boot", n_bins, x_nbins, x_low, x_high, nBootstrap, n_slots),
+                                                                                 {"index_data", "data_m", "weight", "boot_seed"}) );
+      }
+      else if(iter==0) { // Book MC histograms
+        //df_histos1D.emplace_back(dlast->Histo1D({"h_gen_m", "nominal", x_nbins, x_low, x_high}, "gen_m", "weight"));
+        //df_histos1D.emplace_back(dlast->Histo1D({"h_reco_m", "nominal", x_nbins, x_low, x_high}, "reco_m", "weight"));
+        //df_histos1D.emplace_back(dlast->Histo1D({"h_smear_m", "nominal", x_nbins, x_low, x_high}, "smear0_m", "weight"));
+        for(unsigned int r = 0 ; r<recos.size(); r++) {
+		  if(skipUnsmearedReco && recos[r]=="reco") continue;
+		  TString rname(recos[r].c_str());
+		  ROOT::RDF::TH2DModel m_model = {"h_"+rname+"_bin_m", "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high};
+		  // x-axis: 4D bin index, y-axis: MC mass, weight = MC weight
+		  // With jacFromMoments, in the same action: weight = moments 0..4 of the jacobians of iter 1
+		  if(jacFromMoments) {
+		    std::array<ROOT::RDF::TH2DModel, 6> models = {{ m_model }};
+		    std::array<std::string, 6> weights = {{ "weight" }};
+		    for(unsigned int k = 0; k<5; k++) {
+		      models[k+1]  = {"h_"+rname+"_bin_m_mom"+TString(std::to_string(k).c_str()), "moments", n_bins, 0, double(n_bins), x_nbins, x_low, x_high};
+		      weights[k+1] = recos[r]+"_mom"+std::to_string(k);
+		    }
+		    book_bin_histos<double, 6>(df_histos2D, *dlast, models, "index_"+recos[r], recos[r]+"_m", weights, n_slots, fillBuffer);
+		  }
+		  else book_bin_histos<double, 1>(df_histos2D, *dlast, {{ m_model }}, "index_"+recos[r], recos[r]+"_m", {{"weight"}}, n_slots, fillBuffer);
+		  // The same for each cut variation
+		  if(!cut_variations.empty())
+		    df_varied.push_back( ROOT::RDF::Experimental::VariationsFor( dlast->Histo2D<unsigned int, double, float>(m_model, "index_"+recos[r], recos[r]+"_m", "weight") ) );
+		  // Bootstrap replicas of smear0
+		  if(nBootstrap>0 && recos[r]=="smear0")
+		    df_boot.push_back( dlast->Book<unsigned int, double, float, ULong64_t>(BootstrapFillHelper("h_smear0_bin_m_boot", n_bins, x_nbins, x_low, x_high, nBootstrap, n_slots),
+		                                                                            {"index_smear0", "smear0_m", "weight", "boot_seed"}) );
+    	  // x-axis: 4D bin index, y-axis: MC mass - gen mass, weight = MC weight
+		  book_bin_histos<double, 1>(df_histos2D, *dlast, {{ {"h_"+rname+"_bin_dm", "nominal", n_bins, 0, double(n_bins), dm_bins, dm_low, dm_high} }}, "index_"+recos[r], recos[r]+"_dm", {{"weight"}}, n_slots, fillBuffer);
+		  // x-axis: 4D bin index, y-axis: moments of the MC mass - gen mass and of the MC mass (moments.h), to seed the Gaussian fits or replace them (fastMoments)
+		  df_histos2D.push_back( {dlast->Book<unsigned int, double, float>(BinMomentsHelper("h_"+recos[r]+"_bin_dm_moments", n_bins, dm_low, dm_high, n_slots), {"index_"+recos[r], recos[r]+"_dm", "weight"}), nullptr} );
+		  df_histos2D.push_back( {dlast->Book<unsigned int, double, float>(BinMomentsHelper("h_"+recos[r]+"_bin_m_moments",  n_bins, x_low, x_high, n_slots),   {"index_"+recos[r], recos[r]+"_m",  "weight"}), nullptr} );
+		  // x-axis: 4D bin index, y-axis: (MC mass bin, MC mass - gen mass bin), weight = MC weight
+		  if(jacFromMoments)
+		    book_bin_histos<double, 1>(df_histos2D, *dlast, {{ {"h_"+rname+"_bin_m_dm_cells", "moments", n_bins, 0, double(n_bins), (x_nbins+2)*dm_bins, 0, double((x_nbins+2)*dm_bins)} }}, "index_"+recos[r], recos[r]+"_m_dm_cell", {{"weight"}}, n_slots, fillBuffer);
+    	  //df_histos3D.emplace_back(dlast->Histo3D({ "h_"+TString(recos[r].c_str())+"_bin_gm_dm", "nominal", n_bins, 0, double(n_bins),  x_nbins, x_low, x_high, dm_bins, dm_low, dm_high}, "index_"+TString(recos[r].c_str()), TString(recos[r].c_str())+"_gm", TString(recos[r].c_str())+"_dm", "weight"));
+    	  //df_histos3D.emplace_back(dlast->Histo3D({ "h_"+TString(recos[r].c_str())+"_bin_gm_m", "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high, x_nbins, x_low, x_high},     "index_"+TString(recos[r].c_str()), TString(recos[r].c_str())+"_gm", TString(recos[r].c_str())+"_m", "weight"));
+        }
+      }
+      else if(iter==1) { // Book jac histograms only for smear0
+        for(unsigned int r = 0 ; r<recos.size(); r++){
+	      if(skipUnsmearedReco && recos[r]=="reco") continue;
+		  TString rname(recos[r].c_str());
+		  // x-axis: 4D bin index, y-axis: MC mass, weight = gaussian scale, gaussian width, Crystal Ball scale, Crystal Ball width jacobian event weight, in one action
+		  std::array<ROOT::RDF::TH2DModel, 4> models = {{
+		      {"h_"+rname+"_bin_jac_scale",    "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high},
+		      {"h_"+rname+"_bin_jac_width",    "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high},
+		      {"h_"+rname+"_bin_jac_scale_cb", "cb",      n_bins, 0, double(n_bins), x_nbins, x_low, x_high},
+		      {"h_"+rname+"_bin_jac_width_cb", "cb",      n_bins, 0, double(n_bins), x_nbins, x_low, x_high} }};
+		  book_bin_histos<double, 4>(df_histos2D, *dlast, models, "index_"+recos[r], recos[r]+"_m",
+		                             {{recos[r]+"_jscale_weight", recos[r]+"_jwidth_weight", recos[r]+"_jscale_cb_weight", recos[r]+"_jwidth_cb_weight"}}, n_slots, fillBuffer);
+        }
+      }
 
-	    dlast = std::make_unique<RNode>(dlast->Define(TString( (recos[r]+"_m").c_str() ), [mpos](RVecF masses)
-		{
-	      return masses.size()>0 ? masses.at( mpos ) : -99.;
-	    }, {"masses"} ));
+      // Keep the MC dimuons matched to gen for the resident steps (the others only fill the underflow of the mass histograms)
+      if(iter==0 && nResidentIter>0) {
+        auto dresident = dlast->Filter([](const DimuonCandidate& dimuon) { return dimuon.gen_ok; }, {"dimuon"});
+        df_resident_dimuons = dresident.Take<DimuonCandidate>("dimuon");
+        df_resident_weights = dresident.Take<float>("weight");
+      }
 
-        // Define mass - gen mass
-	    dlast = std::make_unique<RNode>(dlast->Define(TString( (recos[r]+"_dm").c_str() ), [mpos](RVecF masses)
-		{
-	      return masses.size()>0 ? masses.at( mpos ) - masses.at(0) : -99.;
-	    }, {"masses"} ));
+      // Keep the graph of the other track fit booked, it runs in the event loop of the nominal one
+      if(pass==0) {
+        cout << "Event loop of the " << (useKf ? "KF" : "CVH") << " track fit booked, running it with the " << (useKf ? "CVH" : "KF") << " one" << endl;
+        booked_other.d           = std::move(d);
+        booked_other.dshared     = std::move(dshared);
+        booked_other.n_io_entries = n_io_entries;
+        booked_other.n_io_trigger = n_io_trigger;
+        booked_other.dlast       = std::move(dlast);
+        booked_other.df_histos1D = std::move(df_histos1D);
+        booked_other.df_histos2D = std::move(df_histos2D);
+        booked_other.df_histos3D = std::move(df_histos3D);
+        booked_other.df_varied   = std::move(df_varied);
+        booked_other.df_boot     = std::move(df_boot);
+        continue;
+      }
 
-	    dlast = std::make_unique<RNode>(dlast->Define(TString( (recos[r]+"_gm").c_str() ), [mpos](RVecF masses) 
-		{
-          return masses.size()>0 ? masses.at(0) : -99.;
-        }, {"masses"} ));
+      // Keep the data graph booked, it runs with the MC one in iter 0
+      if(runConcurrent && iter==-1) {
+        cout << "Data event loop booked, running it with the MC one" << endl;
+        booked_data.d           = std::move(d);
+        booked_data.dlast       = std::move(dlast);
+        booked_data.df_histos1D = std::move(df_histos1D);
+        booked_data.df_histos2D = std::move(df_histos2D);
+        booked_data.df_histos3D = std::move(df_histos3D);
+        booked_data.df_varied   = std::move(df_varied);
+        booked_data.df_boot     = std::move(df_boot);
+        booked_data.skim_snapshot = skim_snapshot;
+        if(!readSkimIter) booked_data.nano_files = in_files;
+        booked_data.entry_index = std::move(entry_index);
+        booked_data.selected_events = selected_events;
+        booked_data.n_indexed_pass = n_indexed_pass;
+        booked_data.n_io_entries = n_io_entries;
+        booked_data.n_io_trigger = n_io_trigger;
+        continue;
       }
-      
-      // Define jacobian weights per event
-      dlast = std::make_unique<RNode>(dlast->Define("weights_jac", [n_bins,recos,h_map,h_jac_map,idx_map](RVecF masses, RVecUI indexes) -> RVecF
-	  {
-	    RVecF out;
-	    if(masses.size()==0) {
-	      for(unsigned int r = 0 ; r<recos.size(); r++) {
-	        out.emplace_back(0.0);
-	        out.emplace_back(0.0);
-	        out.emplace_back(0.0);
-	        out.emplace_back(0.0);
-	      }
-	      return out;
-	    }
-	
-	    float gm  = masses.at(0);
-	    for(unsigned int r = 0 ; r<recos.size(); r++) {
-			if(skipUnsmearedReco && recos[r]=="reco") {
-				out.emplace_back(0.0);
-	            out.emplace_back(0.0);
-	            out.emplace_back(0.0);
-	            out.emplace_back(0.0);
-				continue;
-			}
-	      unsigned int rpos = idx_map.at(recos[r]);
-		  // Gaussian mean and rms of the mass - gen mass distribution in a 4D bin
-	      TH1D* h_mean = h_map.at("mean_"+recos[r]);
-	      TH1D* h_rms  = h_map.at("rms_"+recos[r]);
-		  // Crystal Ball jacobian event weight in a 4D bin, in a mass - gen mass bin
-	      TH2D* h_jac_scale = h_jac_map.at("jscale_cb_per_evt_"+recos[r]);
-	      TH2D* h_jac_width = h_jac_map.at("jwidth_cb_per_evt_"+recos[r]);
-
-	      float m = masses.at( rpos );
-	      float dm = m - gm;
-	      int ijac_dm = (h_jac_scale->GetYaxis()->FindBin(dm)>0 && h_jac_scale->GetYaxis()->FindBin(dm) < h_jac_scale->GetYaxis()->GetNbins()+1) ? h_jac_scale->GetYaxis()->FindBin(dm) : -99;
-	  
-	      float delta = 0.;
-          float sigma = 0.;
-	      if(indexes[r]<n_bins) {
-	        delta = h_mean->GetBinContent(indexes[r]+1);
-	        sigma = h_rms->GetBinContent(indexes[r]+1);
-	      }
-	      float jscale = sigma>0. ? +(m - (gm+delta) )*(gm+delta)/sigma/sigma : 0.0;
-	      float jwidth = sigma>0. ? +(m - (gm+delta) )*(m - (gm+delta) )/sigma/sigma - 1.0 : 0.0;
-	      float jscale_cb = (sigma>0. && ijac_dm>0) ? h_jac_scale->GetBinContent(indexes[r]+1, ijac_dm) : 0.0;
-	      float jwidth_cb = (sigma>0. && ijac_dm>0) ? h_jac_width->GetBinContent(indexes[r]+1, ijac_dm) : 0.0;
-	      out.emplace_back(jscale);
-	      out.emplace_back(jwidth);
-	      out.emplace_back(jscale_cb);
-	      out.emplace_back(jwidth_cb);
-	    }
-	    return out;
-      }, {"masses", "indexes"} ));
 
-      for(unsigned int r = 0 ; r<recos.size(); r++) {
-		if(skipUnsmearedReco && recos[r]=="reco") continue;
+      // Run the event loop, together with the booked data one if any
+      if(iter<2) {
+        auto colNames = dlast->GetColumnNames();
+        auto count = dlast->Count();
+        ROOT::RDF::RResultPtr<ULong64_t> count_data;
+        n_allocs = 0;
+        count_allocs = countAllocs;
+        prof.reset();
+        Long64_t bytes_read = TFile::GetFileBytesRead();
+        Int_t read_calls = TFile::GetFileReadCalls();
+        TStopwatch sw_loop;
+        sw_loop.Start();
+        if(booked_data.d) {
+          count_data = booked_data.dlast->Count();
+          ROOT::RDF::RunGraphs({count_data, count});
+        }
+        double total = *count;
+        sw_loop.Stop();
+        count_allocs = false;
+        if(profile) {
+          std::ofstream fprof(profile_file.c_str(), std::ios::app);
+          prof.report(fprof, "iter "+std::to_string(iter)+(count_data ? " and -1" : "")+", step "+std::to_string(step)+": event loop "
+                      +std::to_string(sw_loop.RealTime())+" s real, "+std::to_string(sw_loop.CpuTime())+" s CPU");
+          cout << "Profile written to " << profile_file << endl;
+        }
+        if(count_data) std::cout << booked_data.dlast->GetColumnNames().size() << " columns created. Total event count in data is " << *count_data << std::endl;
+        std::cout << colNames.size() << " columns created. Total event count is " << total  << std::endl;
+        if(count_data) total += *count_data;
+        if(countAllocs) std::cout << "Heap allocations in the event loop: " << n_allocs << " (" << (total>0. ? n_allocs/total : 0.) << " per selected event)" << std::endl;
+        std::cout << "Bytes read from the input files in the event loop: " << (TFile::GetFileBytesRead()-bytes_read)*1e-6 << " MB" << std::endl;
+        if(booked_data.selected_events) booked_data.entry_index->write(*booked_data.selected_events);
+        if(selected_events) entry_index->write(*selected_events);
+        if(booked_data.n_indexed_pass) booked_data.entry_index->check(*booked_data.n_indexed_pass);
+        if(n_indexed_pass) entry_index->check(*n_indexed_pass);
+        if(ioStats) {
+          // The bytes and read calls are those of all the loops run together
+          std::string together = booked_data.n_io_entries ? " (run with the data one)" : "";
+          double loop_bytes = TFile::GetFileBytesRead()-bytes_read;
+          long long loop_calls = TFile::GetFileReadCalls()-read_calls;
+          if(booked_data.n_io_entries)
+            report_io(booked_data.nano_files, false, "iter -1, step "+std::to_string(step)+" (run with the MC one)", *booked_data.n_io_entries, *booked_data.n_io_trigger,
+                      loop_bytes, loop_calls, sw_loop.RealTime());
+          if(n_io_entries)
+            report_io(in_files, iter>=0, "iter "+std::to_string(iter)+", step "+std::to_string(step)+together, *n_io_entries, *n_io_trigger,
+                      loop_bytes, loop_calls, sw_loop.RealTime());
+        }
+      }
 
-        unsigned int jpos = (idx_map.at(recos[r])-1)*4;
+      // Write the histograms of the data event loop run with this one, as iter -1 does
+      if(booked_data.d) {
+        std::vector<TH1D*> histos1D_data;
+        std::vector<TH2D*> histos2D_data;
+        std::vector<TH3D*> histos3D_data;
+        for(auto h : booked_data.df_histos1D) histos1D_data.push_back(h.GetPtr());
+        for(auto h : booked_data.df_histos2D) histos2D_data.push_back(h.get());
+        for(auto h : booked_data.df_histos3D) histos3D_data.push_back(h.GetPtr());
+        if(nResidentIter>0) {
+          h_data_resident = (TH2D*)histos2D_data[0]->Clone();
+          h_data_resident->SetDirectory(0);
+        }
+        write_histos(-1, histos1D_data, histos2D_data, histos3D_data);
+        write_data_provenance();
+        write_cut_variations(-1, booked_data.df_varied);
+        write_bootstrap(-1, booked_data.df_boot);
+        // Destroyed in the reverse order of its members: the results and the dataframe before the entry index it is built on
+        { BookedLoop done = std::move(booked_data); }
+      }
 
-	    dlast = std::make_unique<RNode>(dlast->Define( TString((recos[r]+"_jscale_weight").c_str()), [jpos](RVecF weights_jac, float weight) -> float
-		{
-	      return weights_jac.at( jpos )*weight;
-	    }, {"weights_jac", "weight"} ));
+      for(auto h : df_histos1D) histos1D.push_back(h.GetPtr());
+      for(auto h : df_histos2D) histos2D.push_back(h.get());
+      for(auto h : df_histos3D) histos3D.push_back(h.GetPtr());
 
-	    dlast = std::make_unique<RNode>(dlast->Define( TString((recos[r]+"_jwidth_weight").c_str()), [jpos](RVecF weights_jac, float weight) -> float
-		{
-	      return weights_jac.at( jpos+1 )*weight;
-	    }, {"weights_jac", "weight"} ));
+      // Partial histograms of the block of input files, the pass is repeated until all the input files have them
+      if(file_cache) {
+        file_cache->write(in_files, histos2D);
+        ipass--;
+        continue;
+      }
+      write_cut_variations(iter, df_varied);
+      write_bootstrap(iter, df_boot);
 
-	    dlast = std::make_unique<RNode>(dlast->Define( TString((recos[r]+"_jscale_cb_weight").c_str()), [jpos](RVecF weights_jac, float weight) -> float
-		{
-          return weights_jac.at( jpos+2 )*weight;
-        }, {"weights_jac", "weight"} ));
-	
-	    dlast = std::make_unique<RNode>(dlast->Define( TString((recos[r]+"_jwidth_cb_weight").c_str()), [jpos](RVecF weights_jac, float weight) -> float
-		{
-          return weights_jac.at( jpos+3 )*weight;
-        }, {"weights_jac", "weight"} ));
+      if(iter==-1 && nResidentIter>0) {
+        h_data_resident = (TH2D*)histos2D[0]->Clone();
+        h_data_resident->SetDirectory(0);
       }
-      
-    }
-    
-    else { // data
-	  // Define indices of individual muons that pass the selection
-	  dlast = std::make_unique<RNode>(dlast->Define("idxs", [&](UInt_t nMuon, RVecB Muon_looseId, RVecF Muon_dxybs, RVecB Muon_isGlobal,
-								RVecB Muon_highPurity, RVecB Muon_mediumId, RVecF Muon_pfRelIso04_all,
-								RVecF Muon_pt, RVecF Muon_eta) -> RVecUI
-	  {
-	    RVecUI out;
-	    for(unsigned int i = 0; i < nMuon; i++) {
-	      if( Muon_looseId[i] && TMath::Abs(Muon_dxybs[i]) < 0.05 && Muon_isGlobal[i] && Muon_highPurity[i] && Muon_mediumId[i] && Muon_pfRelIso04_all[i]<0.15 &&
-	      Muon_pt[i] >= pt_edges[0] && Muon_pt[i] < pt_edges[ n_pt_bins ]  && Muon_eta[i]>=eta_edges[0] && Muon_eta[i]<=eta_edges[ n_eta_bins ] ) out.emplace_back(i);
-	    }
-	    return out;
-	  }, {"nMuon", "Muon_looseId", "Muon_dxybs", "Muon_isGlobal", "Muon_highPurity", "Muon_mediumId", "Muon_pfRelIso04_all",
-	  useKf ? "Muon_pt" : "Muon_cvhPt", useKf ? "Muon_eta" : "Muon_cvhEta"} ));
-      
-      // Filter for muon pairs
-      dlast = std::make_unique<RNode>(dlast->Filter( [](RVecUI idxs, RVecI Muon_charge, bool HLT_IsoMu24 )
-	  {
-	    if( idxs.size()!=2 || !HLT_IsoMu24) return false;
-	    if( Muon_charge[idxs[0]]*Muon_charge[idxs[1]] > 0 ) return false;
-	    return true;
-      }, {"idxs", "Muon_charge", "HLT_IsoMu24"} ));      
-	  
-      // Define data weight = 1.0
-      dlast = std::make_unique<RNode>(dlast->Define("weight", []()->float{ return 1.0; }, {} ));          
-
-	  // Define eta+, pt+, eta-, pt- indexes for each muon pair that passed selection   
-	  dlast = std::make_unique<RNode>(dlast->Define("index_data", [&](RVecUI idxs, RVecF Muon_pt, RVecF Muon_eta, RVecI Muon_charge) -> unsigned int
-	  {
-	    unsigned int idxP = Muon_charge[idxs[0]]>0 ? idxs[0] : idxs[1];
-	    unsigned int idxM = Muon_charge[idxs[0]]>0 ? idxs[1] : idxs[0];
-	    float ptP  = Muon_pt[idxP];
-	    float ptM  = Muon_pt[idxM];
-	    float etaP = Muon_eta[idxP];
-	    float etaM = Muon_eta[idxM];
-	    unsigned int out = n_bins;	
-	    unsigned int ibin = 0;
-	    for(unsigned int ieta_p = 0; ieta_p<n_eta_bins; ieta_p++){
-	      float eta_p_low = eta_edges[ieta_p];
-	      float eta_p_up  = eta_edges[ieta_p+1];      
-	      for(unsigned int ipt_p = 0; ipt_p<n_pt_bins; ipt_p++){
-	        float pt_p_low = pt_edges[ipt_p];
-	        float pt_p_up  = pt_edges[ipt_p+1];
-	        for(unsigned int ieta_m = 0; ieta_m<n_eta_bins; ieta_m++){
-	          float eta_m_low = eta_edges[ieta_m];
-	          float eta_m_up  = eta_edges[ieta_m+1];      
-	          for(unsigned int ipt_m = 0; ipt_m<n_pt_bins; ipt_m++){
-		        float pt_m_low = pt_edges[ipt_m];
-		        float pt_m_up  = pt_edges[ipt_m+1];
-	            if( etaP>=eta_p_low && etaP<eta_p_up &&
-		        etaM>=eta_m_low && etaM<eta_m_up &&
-		        ptP>=pt_p_low   && ptP<pt_p_up &&
-		        ptM>=pt_m_low   && ptM<pt_m_up 
-		        ) out = ibin;
-	            ibin++;
-	          }
-	        }  
-	      }
-	    }
-	    return out;
-	  }, {"idxs", useKf ? "Muon_pt" : "Muon_cvhPt", useKf ? "Muon_eta" : "Muon_cvhEta", "Muon_charge"} ));
-
-	  // Define mass in data    
-	  dlast = std::make_unique<RNode>(dlast->Define("data_m", [&](RVecUI idxs,
-								       RVecF Muon_pt, RVecF Muon_eta, RVecF Muon_phi, RVecF Muon_mass, RVecI Muon_charge) -> float
-	  {
-	    float out = 0.0;
-	    unsigned int idxP = Muon_charge[idxs[0]]>0 ? idxs[0] : idxs[1];
-	    unsigned int idxM = Muon_charge[idxs[0]]>0 ? idxs[1] : idxs[0];
-	    ROOT::Math::PtEtaPhiMVector muP( Muon_pt[ idxP ], Muon_eta[ idxP ], Muon_phi[ idxP ], Muon_mass[ idxP ] );
-	    ROOT::Math::PtEtaPhiMVector muM( Muon_pt[ idxM ], Muon_eta[ idxM ], Muon_phi[ idxM ], Muon_mass[ idxM ] );
-    	out = (muP + muM).M();	  
-    	return out;
-	  }, {"idxs", useKf ? "Muon_pt" : "Muon_cvhPt", useKf ? "Muon_eta" : "Muon_cvhEta", useKf ? "Muon_phi" : "Muon_cvhPhi", "Muon_mass", "Muon_charge"} ));           
-    }
-    
-    // Vector of pointers to histograms output by the dataframe
-    std::vector< ROOT::RDF::RResultPtr<TH1D> > df_histos1D;
-    std::vector< ROOT::RDF::RResultPtr<TH2D> > df_histos2D;
-    std::vector< ROOT::RDF::RResultPtr<TH3D> > df_histos3D;
-  
-    if(iter==-1) { // Book data histogram
-	  // x-axis: 4D bin index, y-axis: data mass, weight = 1
-      df_histos2D.emplace_back(dlast->Histo2D({ "h_data_bin_m", "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high}, "index_data", "data_m", "weight" ));
-      auto colNames = dlast->GetColumnNames();
-      double total = *(dlast->Count());  
-      std::cout << colNames.size() << " columns created. Total event count is " << total  << std::endl;
-    }
-    else if(iter==0) { // Book MC histograms
-      //df_histos1D.emplace_back(dlast->Histo1D({"h_gen_m", "nominal", x_nbins, x_low, x_high}, "gen_m", "weight"));
-      //df_histos1D.emplace_back(dlast->Histo1D({"h_reco_m", "nominal", x_nbins, x_low, x_high}, "reco_m", "weight"));
-      //df_histos1D.emplace_back(dlast->Histo1D({"h_smear_m", "nominal", x_nbins, x_low, x_high}, "smear0_m", "weight"));
-      for(unsigned int r = 0 ; r<recos.size(); r++) {
-		if(skipUnsmearedReco && recos[r]=="reco") continue;
-		// x-axis: 4D bin index, y-axis: MC mass, weight = MC weight
-        df_histos2D.emplace_back(dlast->Histo2D({ "h_"+TString(recos[r].c_str())+"_bin_m",    "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high},   "index_"+TString(recos[r].c_str()), TString(recos[r].c_str())+"_m", "weight" ));
-    	// x-axis: 4D bin index, y-axis: MC mass - gen mass, weight = MC weight
-		df_histos2D.emplace_back(dlast->Histo2D({ "h_"+TString(recos[r].c_str())+"_bin_dm",   "nominal", n_bins, 0, double(n_bins), dm_bins, dm_low, dm_high}, "index_"+TString(recos[r].c_str()), TString(recos[r].c_str())+"_dm", "weight"));
-    	//df_histos3D.emplace_back(dlast->Histo3D({ "h_"+TString(recos[r].c_str())+"_bin_gm_dm", "nominal", n_bins, 0, double(n_bins),  x_nbins, x_low, x_high, dm_bins, dm_low, dm_high}, "index_"+TString(recos[r].c_str()), TString(recos[r].c_str())+"_gm", TString(recos[r].c_str())+"_dm", "weight"));
-    	//df_histos3D.emplace_back(dlast->Histo3D({ "h_"+TString(recos[r].c_str())+"_bin_gm_m", "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high, x_nbins, x_low, x_high},     "index_"+TString(recos[r].c_str()), TString(recos[r].c_str())+"_gm", TString(recos[r].c_str())+"_m", "weight"));
+      if(df_resident_dimuons) {
+        resident_dimuons = std::move(*df_resident_dimuons);
+        resident_weights = std::move(*df_resident_weights);
+        cout << "Keeping " << resident_dimuons.size() << " MC dimuons in memory (" << resident_dimuons.size()*(sizeof(DimuonCandidate)+sizeof(float))/1.0e+06 << " MB)" << endl;
       }
-      auto colNames = dlast->GetColumnNames();
-      double total = *(dlast->Count());  
-      std::cout << colNames.size() << " columns created. Total event count is " << total  << std::endl;
     }
-    else if(iter==1) { // Book jac histograms only for smear0
-      for(unsigned int r = 0 ; r<recos.size(); r++){
-	    if(skipUnsmearedReco && recos[r]=="reco") continue;
-		// x-axis: 4D bin index, y-axis: MC mass, weight = gaussian scale jacobian event weight
-    	df_histos2D.emplace_back(dlast->Histo2D({"h_"+TString(recos[r].c_str())+"_bin_jac_scale", "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high}, "index_"+TString(recos[r].c_str()), TString(recos[r].c_str())+"_m", TString(recos[r].c_str())+"_jscale_weight"));
-    	// x-axis: 4D bin index, y-axis: MC mass, weight = gaussian width jacobian event weight
-		df_histos2D.emplace_back(dlast->Histo2D({"h_"+TString(recos[r].c_str())+"_bin_jac_width", "nominal", n_bins, 0, double(n_bins), x_nbins, x_low, x_high}, "index_"+TString(recos[r].c_str()), TString(recos[r].c_str())+"_m", TString(recos[r].c_str())+"_jwidth_weight"));
-    	// x-axis: 4D bin index, y-axis: MC mass, weight = Crystal Ball scale jacobian event weight
-		df_histos2D.emplace_back(dlast->Histo2D({"h_"+TString(recos[r].c_str())+"_bin_jac_scale_cb", "cb", n_bins, 0, double(n_bins), x_nbins, x_low, x_high}, "index_"+TString(recos[r].c_str()), TString(recos[r].c_str())+"_m", TString(recos[r].c_str())+"_jscale_cb_weight"));
-    	// x-axis: 4D bin index, y-axis: MC mass, weight = Crystal Ball width jacobian event weight
-		df_histos2D.emplace_back(dlast->Histo2D({"h_"+TString(recos[r].c_str())+"_bin_jac_width_cb", "cb", n_bins, 0, double(n_bins), x_nbins, x_low, x_high}, "index_"+TString(recos[r].c_str()), TString(recos[r].c_str())+"_m", TString(recos[r].c_str())+"_jwidth_cb_weight"));
-      }
+    else if(iter==-1) {
+      histos2D.push_back(h_data_resident);
+    }
+    else if(iter<2) {
+      histos2D = fill_resident_histos(iter);
     }
 
     // Write dataframe histograms
-    if(iter<2) {
-	  fout->cd();
-	  std::cout << "Writing histos..." << std::endl;
-	  
-	  // Scale MC to luminosity in data
-	  double lumiMC = lumiMC2016;
-	  if(y2017)      lumiMC = lumiMC2017;
-	  else if(y2018) lumiMC = lumiMC2018;
-	  
-	  double sf = lumi>0. ? lumi/lumiMC : 1.0; //double(lumi)/double(minNumEvents);
-	  
-	  for(auto h : df_histos1D) {
-		if(iter>=0) h->Scale(sf); // scale only for MC
-		h->Write();
-	  }
-	  for(auto h : df_histos2D) {
-		if(iter>=0) h->Scale(sf); // scale only for MC
-		string h_name = std::string(h->GetName());
-		std::cout << "Total number of events in 2D histo " << h_name << ": " << h->GetEntries() << std::endl;
-		h->Write();
-      }
-	  for(auto h : df_histos3D) {
-       	if(iter>=0) h->Scale(sf); // scale only for MC
-       	string h_name = std::string(h->GetName());
-       	std::cout << "Total number of events in 3D histo " << h_name << ": " << h->GetEntries() << std::endl;
-       	h->Write();
-      }
+    if(iter<2) write_histos(iter, histos1D, histos2D, histos3D, step==0 && iter==1 && jacFromMoments);
+    if(iter==-1 && nShards==1) write_data_provenance();
+
+    // The fits are done on the merged shards
+    if(nShards>1) {
+      fout->cd();
+      h_pt_edges->Write(0, TObject::kOverwrite);
+      h_eta_edges->Write(0, TObject::kOverwrite);
+      continue;
     }
     
     if(iter==0) { 
@@ -878,28 +2150,39 @@ int main(int argc, char* argv[]) {
 
 		if(skipUnsmearedReco && recos[r]=="reco") continue;
 	
-	    TH2D* h_reco_dm = (TH2D*)fout->Get(TString( ("h_"+recos[r]+"_bin_dm").c_str()) );
-	    TH2D* h_reco_m  = (TH2D*)fout->Get(TString( ("h_"+recos[r]+"_bin_m").c_str()) );
+	    std::unique_ptr<BinSpectra> h_reco_dm = BinSpectra::read(fout, "h_"+recos[r]+"_bin_dm");
+	    std::unique_ptr<BinSpectra> h_reco_m  = BinSpectra::read(fout, "h_"+recos[r]+"_bin_m");
 	    if( h_reco_dm==0 || h_reco_m==0 ) {
 	      cout << "h_reco_dm/h_reco_m NOT FOUND" << endl;
 	      continue;
 	    }
+	    // Exact moments of the mass - gen mass and of the mass, if filled by the event loop
+	    std::unique_ptr<BinSpectra> h_dm_moments = BinSpectra::read(fout, "h_"+recos[r]+"_bin_dm_moments");
+	    std::unique_ptr<BinMoments> dm_moments;
+	    if(h_dm_moments) {
+	      std::unique_ptr<TH2D> h( h_dm_moments->to_th2() );
+	      dm_moments = std::make_unique<BinMoments>( BinMoments::from_th2(h.get(), dm_low, dm_high) );
+	    }
+	    assert( dm_moments || !fastMoments );
 		// Gaussian mean and rms of the mass - gen mass distribution in a 4D bin
 	    h_map["mean_"+recos[r]] = new TH1D( TString( ("h_mean_"+recos[r]+"_bin_dm").c_str() ),"", n_bins, 0, double(n_bins));
 	    h_map["rms_"+recos[r]]  = new TH1D( TString( ("h_rms_"+recos[r]+"_bin_dm").c_str() ),"", n_bins, 0, double(n_bins));
 	    // 1/0 if keeping(ignoring) a 4D bin in the fit
 		h_map["mask_"+recos[r]] = new TH1D( TString( ("h_mask_"+recos[r]+"_bin_dm").c_str() ),"", n_bins, 0, double(n_bins));
+	    // Skewness and excess kurtosis of the mass - gen mass distribution in a 4D bin, from the exact moments
+		h_map["skew_"+recos[r]] = new TH1D( TString( ("h_skew_"+recos[r]+"_bin_dm").c_str() ),"", n_bins, 0, double(n_bins));
+		h_map["kurt_"+recos[r]] = new TH1D( TString( ("h_kurt_"+recos[r]+"_bin_dm").c_str() ),"", n_bins, 0, double(n_bins));
 	
 	    // Crystal Ball jacobian event weights in a 4D bin, in a mass - gen mass bin
 	    h_jac_map["jscale_cb_per_evt_"+recos[r]] = new TH2D("h_"+TString(recos[r].c_str())+"_bin_jscale_cb_per_evt", "cb", n_bins, 0, double(n_bins), dm_bins, dm_low, dm_high); 
 	    h_jac_map["jwidth_cb_per_evt_"+recos[r]] = new TH2D("h_"+TString(recos[r].c_str())+"_bin_jwidth_cb_per_evt", "cb", n_bins, 0, double(n_bins), dm_bins, dm_low, dm_high);
 	
 	    for(unsigned int i = 0; i<n_bins; i++ ) {
-	      if(i%1000==0) cout << "Doing gaus fit for 4D bin " << i << " / " << n_bins << endl;
+	      if(i%1000==0) cout << (fastMoments ? "Doing moments for 4D bin " : "Doing gaus fit for 4D bin ") << i << " / " << n_bins << endl;
 	      TString projname(Form("bin_%d_", i));
 	      projname += TString( recos[r].c_str() );
-	      TH1D* hi   = (TH1D*)h_reco_dm->ProjectionY( projname+"_dm", i+1, i+1 );
-	      TH1D* hi_m = (TH1D*)h_reco_m->ProjectionY( projname+"_m", i+1, i+1 );
+	      std::unique_ptr<TH1D> hi( h_reco_dm->projection( i, projname+"_dm" ) );
+	      std::unique_ptr<TH1D> hi_m( h_reco_m->projection( i, projname+"_m" ) );
 	      double mean_i = 0.0;
 	      double meanerr_i = 0.0;
 	      double rms_i = 0.0;
@@ -910,59 +2193,80 @@ int main(int argc, char* argv[]) {
 	      if( hi_m->Integral() > minNumEvents && hi->Integral() > minNumEvents  &&  hi_m->GetMean()>( x_low + 5.0 ) && hi_m->GetMean()<( x_high - 5.0 ) ) { //TODO make this 5.0 an input parameter
 	        h_map.at("mask_"+recos[r])->SetBinContent(i+1, 1);
 
-            // Gaus fit
-	        TF1* gf = new TF1("gf","[0]/TMath::Sqrt(2*TMath::Pi())/[2]*TMath::Exp( -0.5*(x-[1])*(x-[1])/[2]/[2] )",
-			      hi->GetXaxis()->GetBinLowEdge(1), hi->GetXaxis()->GetBinUpEdge( hi->GetXaxis()->GetNbins() ));      
-	        gf->SetParameter(0, hi->Integral());
-	        gf->SetParameter(1, hi->GetMean());
-	        gf->SetParameter(2, hi->GetRMS() );
-	        float m_min = nRMSforGausFit>0. ? TMath::Max(-nRMSforGausFit*hi->GetRMS(), dm_low) : dm_low;
-	        float m_max = nRMSforGausFit>0. ? TMath::Min(+nRMSforGausFit*hi->GetRMS(), dm_high) : dm_high;
-	        hi->Fit("gf", "QR", "", m_min, m_max );
-	        mean_i    = gf->GetParameter(1);
-	        meanerr_i = gf->GetParError(1);
-	        rms_i     = TMath::Abs(gf->GetParameter(2));
-	        rmserr_i  = gf->GetParError(2);
-			if(maxRMS>0. && rms_i>maxRMS) h_map.at("mask_"+recos[r])->SetBinContent(i+1, 0);
-	        //cout << "Fit " << mean_i << endl;
-	        delete gf;
+	        Welford dm_i;
+	        if(dm_moments) {
+	          dm_i = dm_moments->moments(i);
+	          h_map.at("skew_"+recos[r])->SetBinContent(i+1, dm_i.skewness());
+	          h_map.at("kurt_"+recos[r])->SetBinContent(i+1, dm_i.kurtosis());
+	        }
+
+	        // Gaussian mean and rms from the moments, with the errors of a Gaussian of n_eff entries
+	        if(fastMoments) {
+	          double n_eff = dm_moments->n_eff(i);
+	          mean_i    = dm_i.mean;
+	          rms_i     = dm_i.rms();
+	          meanerr_i = n_eff>0. ? rms_i/TMath::Sqrt(n_eff) : 0.;
+	          rmserr_i  = n_eff>0. ? rms_i/TMath::Sqrt(2.*n_eff) : 0.;
+	          if(maxRMS>0. && rms_i>maxRMS) h_map.at("mask_"+recos[r])->SetBinContent(i+1, 0);
+	          if(!(rms_i>0.)) h_map.at("mask_"+recos[r])->SetBinContent(i+1, 0);
+	        }
+	        else {
+
+              // Gaus fit
+  	        TF1* gf = new TF1("gf","[0]/TMath::Sqrt(2*TMath::Pi())/[2]*TMath::Exp( -0.5*(x-[1])*(x-[1])/[2]/[2] )",
+  			      hi->GetXaxis()->GetBinLowEdge(1), hi->GetXaxis()->GetBinUpEdge( hi->GetXaxis()->GetNbins() ));      
+  	        gf->SetParameter(0, hi->Integral());
+  	        // Seeded with the exact moments if available
+  	        gf->SetParameter(1, dm_moments ? dm_i.mean : hi->GetMean());
+  	        gf->SetParameter(2, dm_moments ? dm_i.rms() : hi->GetRMS() );
+  	        float m_min = nRMSforGausFit>0. ? TMath::Max(-nRMSforGausFit*hi->GetRMS(), dm_low) : dm_low;
+  	        float m_max = nRMSforGausFit>0. ? TMath::Min(+nRMSforGausFit*hi->GetRMS(), dm_high) : dm_high;
+  	        hi->Fit("gf", "QR", "", m_min, m_max );
+  	        mean_i    = gf->GetParameter(1);
+  	        meanerr_i = gf->GetParError(1);
+  	        rms_i     = TMath::Abs(gf->GetParameter(2));
+  	        rmserr_i  = gf->GetParError(2);
+  			if(maxRMS>0. && rms_i>maxRMS) h_map.at("mask_"+recos[r])->SetBinContent(i+1, 0);
+  	        //cout << "Fit " << mean_i << endl;
+  	        delete gf;
             
-	        // Crystal Ball fit
-	        RooRealVar x0("x0", "", mean_i, dm_low, dm_high); 
-			RooRealVar mass("mass", "", dm_low, dm_high); 
-	        mass.setRange("r1", dm_low, dm_high); 
-	        RooRealVar alphaL("alphaL", "", 1.0, 0.2, +10 );
-	        RooRealVar alphaR("alphaR", "", 1.0, 0.2, +10 );
-	        RooRealVar nL("nL", "", 2, 1, 100 );
-	        RooRealVar nR("nR", "", 2, 1, 100 );
-	        RooRealVar sigmaL("sigmaL", "", rms_i, rms_i*0.5, rms_i*2 );
-	        RooRealVar sigmaR("sigmaR", "", rms_i, rms_i*0.5, rms_i*2 );
+  	        // Crystal Ball fit
+  	        RooRealVar x0("x0", "", mean_i, dm_low, dm_high); 
+  			RooRealVar mass("mass", "", dm_low, dm_high); 
+  	        mass.setRange("r1", dm_low, dm_high); 
+  	        RooRealVar alphaL("alphaL", "", 1.0, 0.2, +10 );
+  	        RooRealVar alphaR("alphaR", "", 1.0, 0.2, +10 );
+  	        RooRealVar nL("nL", "", 2, 1, 100 );
+  	        RooRealVar nR("nR", "", 2, 1, 100 );
+  	        RooRealVar sigmaL("sigmaL", "", rms_i, rms_i*0.5, rms_i*2 );
+  	        RooRealVar sigmaR("sigmaR", "", rms_i, rms_i*0.5, rms_i*2 );
 	    				 
-	        RooDataHist data("data", "", RooArgList(mass), hi );
-	        RooCrystalBall pdf("pdf", "", mass, x0, sigmaL, sigmaR, alphaL, nL, alphaR, nR);
+  	        RooDataHist data("data", "", RooArgList(mass), hi.get() );
+  	        RooCrystalBall pdf("pdf", "", mass, x0, sigmaL, sigmaR, alphaL, nL, alphaR, nR);
 	    
-	        std::unique_ptr<RooFitResult> res{pdf.fitTo(data,
-					      InitialHesse(true),
-					      Minimizer("Minuit2"),
-					      Range("r1"),
-					      Save(), SumW2Error(true),
-						  PrintLevel(-1),
-						  Verbose(false) )};
+  	        std::unique_ptr<RooFitResult> res{pdf.fitTo(data,
+  					      InitialHesse(true),
+  					      Minimizer("Minuit2"),
+  					      Range("r1"),
+  					      Save(), SumW2Error(true),
+  						  PrintLevel(-1),
+  						  Verbose(false) )};
 	    
-	        TH1D* h_der = new TH1D("h_der", "", hi->GetXaxis()->GetNbins()*2, dm_low, dm_high);
-	        h_der->Reset();
-	        RooDerivative* der = pdf.derivative( mass, 1, 0.001 );
+  	        TH1D* h_der = new TH1D("h_der", "", hi->GetXaxis()->GetNbins()*2, dm_low, dm_high);
+  	        h_der->Reset();
+  	        RooDerivative* der = pdf.derivative( mass, 1, 0.001 );
 	    
-		    // Crystal Ball jacobian event weights in a 4D bin, in a mass - gen mass bin
-	        for(int ib=1; ib<=h_der->GetXaxis()->GetNbins();ib++) {
-	          double x = h_der->GetXaxis()->GetBinCenter(ib);
-	          mass.setVal( x );
-	          double fprime = der->getVal();
-	          double f = pdf.getVal();
-	          h_jac_map.at("jscale_cb_per_evt_"+recos[r])->SetBinContent(i+1, ib, -fprime/f * hi_m->GetMean());
-	          h_jac_map.at("jwidth_cb_per_evt_"+recos[r])->SetBinContent(i+1, ib, -(1+x*fprime/f));
+  		    // Crystal Ball jacobian event weights in a 4D bin, in a mass - gen mass bin
+  	        for(int ib=1; ib<=h_der->GetXaxis()->GetNbins();ib++) {
+  	          double x = h_der->GetXaxis()->GetBinCenter(ib);
+  	          mass.setVal( x );
+  	          double fprime = der->getVal();
+  	          double f = pdf.getVal();
+  	          h_jac_map.at("jscale_cb_per_evt_"+recos[r])->SetBinContent(i+1, ib, -fprime/f * hi_m->GetMean());
+  	          h_jac_map.at("jwidth_cb_per_evt_"+recos[r])->SetBinContent(i+1, ib, -(1+x*fprime/f));
+  	        }
+
 	        }
-            
 	      }
 	      else {
 	        h_map.at("mask_"+recos[r])->SetBinContent(i+1, 0);
@@ -982,6 +2286,11 @@ int main(int argc, char* argv[]) {
 	    h_map["mean_"+recos[r]]->Write();
 	    h_map["rms_"+recos[r]]->Write();
 	    h_map["mask_"+recos[r]]->Write();
+	    h_map["skew_"+recos[r]]->Write();
+	    h_map["kurt_"+recos[r]]->Write();
+	    // Needed by iter 1 when run in a separate process (shards)
+	    h_jac_map["jscale_cb_per_evt_"+recos[r]]->Write();
+	    h_jac_map["jwidth_cb_per_evt_"+recos[r]]->Write();
       }
     
 	}
@@ -1015,11 +2324,90 @@ int main(int argc, char* argv[]) {
       TH1D* h_masks   = new TH1D("h_masks", "", n_bins, 0, double(n_bins));
 
       // Get histograms needed for the mass fit
-      TH2D* h_data_2D   = (TH2D*)fout->Get("h_data_bin_m");
-      TH2D* h_nom_2D    = (TH2D*)fout->Get("h_smear0_bin_m");
+      std::unique_ptr<BinSpectra> h_data_2D   = BinSpectra::read(fout, "h_data_bin_m");
       TH1D* h_nom_mask  = (TH1D*)fout->Get("h_mask_smear0_bin_dm");
-      TH2D* h_jscale_2D = useCB ? (TH2D*)fout->Get("h_smear0_bin_jac_scale_cb") : (TH2D*)fout->Get("h_smear0_bin_jac_scale");
-      TH2D* h_jwidth_2D = useCB ? (TH2D*)fout->Get("h_smear0_bin_jac_width_cb") : (TH2D*)fout->Get("h_smear0_bin_jac_width");
+
+      // Line search over the smear0 variants: prefit chi2 between data and each of them, in the 4D bins and mass bins the nominal fit uses
+      // The mass fit is done with the closest one, whose A,e,M,c,d are passed on to massfit.cpp and resolfit.cpp
+      std::string smear_fit = "smear0";
+      if(recos.size()>2) {
+        TH1D* h_line_search = new TH1D("h_line_search", "prefit #chi^{2}/mass bins vs step along the last fits", recos.size()-1, 0, double(recos.size()-1));
+        double best_chi2 = -1.;
+        for(unsigned int r = 1; r<recos.size(); r++) {
+          std::unique_ptr<BinSpectra> h_mc_2D = BinSpectra::read(fout, "h_"+recos[r]+"_bin_m");
+          double chi2 = 0.;
+          unsigned int n_chi2 = 0;
+          for(unsigned int ibin=0; ibin<n_bins; ibin++) {
+            if( h_nom_mask->GetBinContent(ibin+1)<0.5 ) continue;
+            std::unique_ptr<TH1D> h_data_i( h_data_2D->projection( ibin, Form("h_data_ls_%d", ibin) ) );
+            std::unique_ptr<TH1D> h_mc_i  ( h_mc_2D->projection( ibin, Form("h_mc_ls_%d", ibin) ) );
+            if(scaleToData && h_data_i->Integral()>0. && h_mc_i->Integral()>0.) h_mc_i->Scale( h_data_i->Integral()/h_mc_i->Integral() );
+            if(rebin>1) {
+              h_data_i->Rebin(rebin);
+              h_mc_i->Rebin(rebin);
+            }
+            unsigned int n_mass_bins = 0;
+            for(int im = 1 ; im<=h_data_i->GetXaxis()->GetNbins(); im++) {
+              if( h_data_i->GetBinContent(im)>minNumEventsPerBin ) n_mass_bins++;
+            }
+            if( n_mass_bins < (unsigned int)minNumMassBins ) continue;
+            for(int im = 1 ; im<=h_data_i->GetXaxis()->GetNbins(); im++) {
+              double y = h_data_i->GetBinContent(im);
+              if( y<=minNumEventsPerBin ) continue;
+              double y0 = h_mc_i->GetBinContent(im);
+              double mcErr = h_mc_i->GetBinError(im);
+              double var = lumi>0. ? y + mcErr*mcErr : 2*mcErr*mcErr;
+              if(var<=0.) continue;
+              chi2 += (y-y0)*(y-y0)/var;
+              n_chi2++;
+            }
+          }
+          double chi2norm = n_chi2>0 ? chi2/n_chi2 : 0.;
+          float step_scale = r==1 ? 1. : step_scales[r-2];
+          h_line_search->SetBinContent(r, chi2norm);
+          h_line_search->GetXaxis()->SetBinLabel(r, Form("%g", step_scale));
+          cout << "Line search: " << recos[r] << " (step " << step_scale << "): prefit chi2/mass bins = " << chi2norm << " over " << n_chi2 << " mass bins" << endl;
+          if(n_chi2>0 && (best_chi2<0. || chi2norm<best_chi2)) {
+            best_chi2 = chi2norm;
+            smear_fit = recos[r];
+          }
+        }
+        fout->cd();
+        h_line_search->Write(0,TObject::kOverwrite);
+        cout << "Mass fit done with " << smear_fit << endl;
+        // A,e,M,c,d of the chosen variant as the sum of the previous iterations, to which massfit.cpp and resolfit.cpp add their fits
+        if(smear_fit!="smear0") {
+          const SmearParams& params = variant_params[std::find(recos.begin(), recos.end(), smear_fit) - recos.begin() - 2];
+          for(unsigned int i=0; i<n_eta_bins; i++) {
+            h_A_vals_prevfit->SetBinContent(i+1, -params.A(i));
+            h_e_vals_prevfit->SetBinContent(i+1, -params.e(i));
+            h_M_vals_prevfit->SetBinContent(i+1, -params.M(i));
+            h_c_vals_prevfit->SetBinContent(i+1, params.c(i));
+            h_d_vals_prevfit->SetBinContent(i+1, params.d(i));
+          }
+          h_A_vals_prevfit->Write(0,TObject::kOverwrite);
+          h_e_vals_prevfit->Write(0,TObject::kOverwrite);
+          h_M_vals_prevfit->Write(0,TObject::kOverwrite);
+          h_c_vals_prevfit->Write(0,TObject::kOverwrite);
+          h_d_vals_prevfit->Write(0,TObject::kOverwrite);
+        }
+      }
+
+      h_nom_mask = (TH1D*)fout->Get(("h_mask_"+smear_fit+"_bin_dm").c_str());
+      std::unique_ptr<BinSpectra> h_nom_2D    = BinSpectra::read(fout, "h_"+smear_fit+"_bin_m");
+      std::unique_ptr<BinSpectra> h_jscale_2D = BinSpectra::read(fout, "h_"+smear_fit+(useCB ? "_bin_jac_scale_cb" : "_bin_jac_scale"));
+      std::unique_ptr<BinSpectra> h_jwidth_2D = BinSpectra::read(fout, "h_"+smear_fit+(useCB ? "_bin_jac_width_cb" : "_bin_jac_width"));
+
+      // Bootstrap replicas: each one is fitted in the mass bins of the nominal fit, with its errors and jacobians (linearized fit)
+      // The MC replicas are only filled for smear0, the nominal MC spectrum is used with the other variants
+      TH2F* h_data_boot = nBootstrap>0 ? (TH2F*)fout->Get("h_data_bin_m_boot") : 0;
+      TH2F* h_mc_boot   = nBootstrap>0 && smear_fit=="smear0" ? (TH2F*)fout->Get("h_smear0_bin_m_boot") : 0;
+      unsigned int n_boot = h_data_boot ? h_data_boot->GetXaxis()->GetNbins() : 0;
+      if(nBootstrap>0) cout << "Fitting " << n_boot << " bootstrap replicas of the data" << (h_mc_boot ? " and MC" : "") << endl;
+      TH2D* h_scales_boot = new TH2D("h_scales_boot", "bootstrap replicas; 4D bin; replica", n_bins, 0, double(n_bins), n_boot, 0, double(n_boot));
+      TH2D* h_widths_boot = new TH2D("h_widths_boot", "bootstrap replicas; 4D bin; replica", n_bins, 0, double(n_bins), n_boot, 0, double(n_boot));
+      TH2D* h_norms_boot  = new TH2D("h_norms_boot",  "bootstrap replicas; 4D bin; replica", n_bins, 0, double(n_bins), n_boot, 0, double(n_boot));
+      std::vector<double> data_r, mc_r;
       
       for(unsigned int ibin=0; ibin<n_bins; ibin++) { // Loop over 4D bins
 
@@ -1028,10 +2416,10 @@ int main(int argc, char* argv[]) {
 
 	    ibinIdx = ibin;
 	
-	    TH1D* h_data_i    = (TH1D*)h_data_2D->ProjectionY( Form("h_data_i_%d",ibin ),     ibin+1, ibin+1 );
-	    TH1D* h_nom_i     = (TH1D*)h_nom_2D->ProjectionY( Form("h_nom_i_%d", ibin),       ibin+1, ibin+1 );
-	    TH1D* h_jscale_i  = (TH1D*)h_jscale_2D->ProjectionY( Form("h_jscale_i_%d", ibin), ibin+1, ibin+1 );
-	    TH1D* h_jwidth_i  = (TH1D*)h_jwidth_2D->ProjectionY( Form("h_jwidth_i_%d", ibin), ibin+1, ibin+1 );	
+	    std::unique_ptr<TH1D> h_data_i   ( h_data_2D->projection( ibin, Form("h_data_i_%d",ibin ) ) );
+	    std::unique_ptr<TH1D> h_nom_i    ( h_nom_2D->projection( ibin, Form("h_nom_i_%d", ibin) ) );
+	    std::unique_ptr<TH1D> h_jscale_i ( h_jscale_2D->projection( ibin, Form("h_jscale_i_%d", ibin) ) );
+	    std::unique_ptr<TH1D> h_jwidth_i ( h_jwidth_2D->projection( ibin, Form("h_jwidth_i_%d", ibin) ) );
 
 	    if(scaleToData) {
 	      double data_norm_i = h_data_i->Integral();
@@ -1082,9 +2470,11 @@ int main(int argc, char* argv[]) {
 	    VectorXd y0(n_mass_bins);
 	    VectorXd jscale(n_mass_bins);
 	    VectorXd jwidth(n_mass_bins);
+	    std::vector<unsigned int> fit_mass_bins;
 	    unsigned int bin_counter = 0;
 	    for(int im = 0 ; im<h_data_i->GetXaxis()->GetNbins(); im++) {
 	      if( h_data_i->GetBinContent(im+1)>minNumEventsPerBin ) {
+	        fit_mass_bins.push_back(im);
 	        y(bin_counter)  = h_data_i->GetBinContent(im+1);
 	        y0(bin_counter) = h_nom_i->GetBinContent(im+1);	    
 	        jscale(bin_counter) = h_jscale_i->GetBinContent(im+1);
@@ -1151,6 +2541,37 @@ int main(int argc, char* argv[]) {
 	    h_probs->SetBinError(ibin+1, 0.);
 	    h_masks->SetBinContent(ibin+1, 1.0);
 
+	    // Bootstrap replicas, with the same solution operator as the nominal fit
+	    if(n_boot>0) {
+	      MatrixXd P = A.bdcSvd(Eigen::ComputeThinU | Eigen::ComputeThinV).solve( MatrixXd::Identity(n_mass_bins, n_mass_bins) );
+	      double data_norm_i = h_data_i->Integral();
+	      for(unsigned int ir = 0; ir<n_boot; ir++) {
+	        replica_spectrum(h_data_boot, x_nbins, ibin, ir, rebin>1 ? rebin : 1, data_r);
+	        double data_norm_r = 0.;
+	        for(double v : data_r) data_norm_r += v;
+	        VectorXd y_r(n_mass_bins);
+	        VectorXd y0_r(n_mass_bins);
+	        for(unsigned int ib = 0; ib<n_mass_bins; ib++) y_r(ib) = data_r[fit_mass_bins[ib]];
+	        // MC normalized to the data replica as the nominal MC to the data
+	        if(h_mc_boot) {
+	          replica_spectrum(h_mc_boot, x_nbins, ibin, ir, rebin>1 ? rebin : 1, mc_r);
+	          double mc_norm_r = 0.;
+	          for(double v : mc_r) mc_norm_r += v;
+	          for(unsigned int ib = 0; ib<n_mass_bins; ib++) y0_r(ib) = mc_r[fit_mass_bins[ib]];
+	          if(scaleToData && mc_norm_r>0.) y0_r *= data_norm_r/mc_norm_r;
+	        }
+	        else {
+	          y0_r = y0;
+	          if(scaleToData && data_norm_i>0.) y0_r *= data_norm_r/data_norm_i;
+	        }
+	        VectorXd x_r = P*(inv_sqrtV*(y_r - y0_r));
+	        h_scales_boot->SetBinContent(ibin+1, ir+1, x_r(0)+1.0);
+	        h_scales_boot->SetBinError(ibin+1, ir+1, ibetaErr);
+	        if(fitWidth) h_widths_boot->SetBinContent(ibin+1, ir+1, x_r(1)+1.0);
+	        if(fitNorm)  h_norms_boot->SetBinContent(ibin+1, ir+1, x_r(2)+1.0);
+	      }
+	    }
+
         // Optional: save pre and postfit mass distribution in 4D bin
 	    if(saveMassFitHistos) {
 	      TH1D* h_pre_i   = (TH1D*)h_nom_i->Clone(Form("h_prefit_%d", ibin));
@@ -1176,17 +2597,25 @@ int main(int argc, char* argv[]) {
       h_probs->Write(0,TObject::kOverwrite);
       h_masks->Write(0,TObject::kOverwrite);
       treescales->Write(0,TObject::kOverwrite);
+      if(n_boot>0) {
+        h_scales_boot->Write(0,TObject::kOverwrite);
+        h_widths_boot->Write(0,TObject::kOverwrite);
+        h_norms_boot->Write(0,TObject::kOverwrite);
+      }
 	
       cout << h_masks->Integral() << " scales have been computed" << endl;
     }
 
   }
   
+  if(nResidentIter>0) run_fits(run_step);
+
   sw.Stop();
 
   std::cout << "Real time: " << sw.RealTime()/60. << " mins " << "(CPU time:  " << sw.CpuTime() << " seconds)" << std::endl;
 
   fout->Close(); 
+  if(dualTrackFit) other_fit.fout->Close();
   
   return 0;
 }
@@ -0,0 +1,207 @@
+// Exact (unbinned) weighted moments of the mass - gen mass and mass distributions in each 4D bin, filled in the MC event loop of iter 0
+// Used to seed the Gaussian fits of iter 0, and instead of them with --fastMoments.
+// The moments are accumulated one event at a time (Welford) and the accumulators of the slots, shards and resident steps are merged
+// with the pairwise update of Chan et al. / Pebay. Positive and negative MC weights are accumulated separately, so that the sum of
+// weights of an accumulator never crosses zero, and combined at the end.
+// Stored as a TH2D (x: 4D bin, y: state of the accumulators), which is neither summed nor scaled as the other histograms.
+
+#ifndef MOMENTS_H
+#define MOMENTS_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cmath>
+#include "TH2D.h"
+#include "profiler.h"
+#include "ROOT/RDF/RActionImpl.hxx"
+
+// Sum of weights, mean and central moments M_k = sum w*(x-mean)^k, k = 2,3,4
+struct Welford {
+  double w = 0.;
+  double mean = 0.;
+  double m2 = 0.;
+  double m3 = 0.;
+  double m4 = 0.;
+
+  void merge(const Welford& b) {
+    if(b.w==0.) return;
+    if(w==0.) {
+      *this = b;
+      return;
+    }
+    double n = w + b.w;
+    if(n==0.) {
+      *this = Welford();
+      return;
+    }
+    double d = b.mean - mean;
+    double d_n = d/n;
+    double ab = w*b.w;
+    double m4_new = m4 + b.m4 + d*d_n*d_n*d_n*ab*(w*w - ab + b.w*b.w) + 6.*d_n*d_n*(w*w*b.m2 + b.w*b.w*m2) + 4.*d_n*(w*b.m3 - b.w*m3);
+    double m3_new = m3 + b.m3 + d*d_n*d_n*ab*(w - b.w) + 3.*d_n*(w*b.m2 - b.w*m2);
+    m2 += b.m2 + d*d_n*ab;
+    m3 = m3_new;
+    m4 = m4_new;
+    mean += d_n*b.w;
+    w = n;
+  }
+
+  void add(double x, double wx) {
+    Welford b;
+    b.w = wx;
+    b.mean = x;
+    merge(b);
+  }
+
+  // All the sums change sign with the weights
+  Welford negated() const {
+    Welford out = *this;
+    out.w = -w;
+    out.m2 = -m2;
+    out.m3 = -m3;
+    out.m4 = -m4;
+    return out;
+  }
+
+  double rms() const { return w>0. && m2>0. ? std::sqrt(m2/w) : 0.; }
+  double skewness() const { return w>0. && m2>0. ? std::sqrt(w)*m3/std::pow(m2, 1.5) : 0.; }
+  double kurtosis() const { return w>0. && m2>0. ? w*m4/(m2*m2) - 3. : 0.; }
+};
+
+// Moments of the values in [low, high) in each 4D bin, as TH1::GetMean/GetRMS of the projections but without the binning
+class BinMoments {
+
+public:
+  BinMoments(unsigned int n_bins, double low, double high)
+    : n_bins_(n_bins), low_(low), high_(high), pos_(n_bins), neg_(n_bins), sumw2_(n_bins, 0.) {}
+
+  void fill(unsigned int ibin, double x, double w) {
+    if(ibin>=n_bins_ || !(x>=low_ && x<high_) || w==0.) return;
+    if(w>0.) pos_[ibin].add(x, w);
+    else     neg_[ibin].add(x, -w);
+    sumw2_[ibin] += w*w;
+  }
+
+  void merge(const BinMoments& b) {
+    for(unsigned int i = 0; i<n_bins_; i++) {
+      pos_[i].merge(b.pos_[i]);
+      neg_[i].merge(b.neg_[i]);
+      sumw2_[i] += b.sumw2_[i];
+    }
+  }
+
+  // Moments of all the weights of a 4D bin
+  Welford moments(unsigned int ibin) const {
+    Welford out = pos_[ibin];
+    out.merge(neg_[ibin].negated());
+    return out;
+  }
+
+  // Effective number of entries (sum w)^2/(sum w^2), as TH1::GetEffectiveEntries
+  double n_eff(unsigned int ibin) const {
+    double w = pos_[ibin].w - neg_[ibin].w;
+    return sumw2_[ibin]>0. ? w*w/sumw2_[ibin] : 0.;
+  }
+
+  // y bins: w, mean, M2, M3, M4 of the positive weights, of the negative ones, sum of w^2. Not attached to any directory
+  TH2D* to_th2(const std::string& name) const {
+    TH2D* h = new TH2D(name.c_str(), Form("moments in [%g,%g)", low_, high_), n_bins_, 0, double(n_bins_), kNy, 0, double(kNy));
+    h->SetDirectory(0);
+    write_th2(h);
+    return h;
+  }
+
+  void write_th2(TH2D* h) const {
+    for(unsigned int i = 0; i<n_bins_; i++) {
+      const Welford* acc[2] = {&pos_[i], &neg_[i]};
+      for(unsigned int s = 0; s<2; s++) {
+        h->SetBinContent(i+1, 5*s+1, acc[s]->w);
+        h->SetBinContent(i+1, 5*s+2, acc[s]->mean);
+        h->SetBinContent(i+1, 5*s+3, acc[s]->m2);
+        h->SetBinContent(i+1, 5*s+4, acc[s]->m3);
+        h->SetBinContent(i+1, 5*s+5, acc[s]->m4);
+      }
+      h->SetBinContent(i+1, kNy, sumw2_[i]);
+    }
+    h->SetEntries(n_bins_);
+  }
+
+  static BinMoments from_th2(const TH2D* h, double low = 0., double high = 0.) {
+    BinMoments out(h->GetXaxis()->GetNbins(), low, high);
+    for(unsigned int i = 0; i<out.n_bins_; i++) {
+      Welford* acc[2] = {&out.pos_[i], &out.neg_[i]};
+      for(unsigned int s = 0; s<2; s++) {
+        acc[s]->w    = h->GetBinContent(i+1, 5*s+1);
+        acc[s]->mean = h->GetBinContent(i+1, 5*s+2);
+        acc[s]->m2   = h->GetBinContent(i+1, 5*s+3);
+        acc[s]->m3   = h->GetBinContent(i+1, 5*s+4);
+        acc[s]->m4   = h->GetBinContent(i+1, 5*s+5);
+      }
+      out.sumw2_[i] = h->GetBinContent(i+1, kNy);
+    }
+    return out;
+  }
+
+  // Merge the moments stored in b into the ones stored in a
+  static void merge_th2(TH2D* a, const TH2D* b) {
+    BinMoments m = from_th2(a);
+    m.merge(from_th2(b));
+    m.write_th2(a);
+  }
+
+private:
+  static constexpr unsigned int kNy = 11;
+
+  unsigned int n_bins_;
+  double low_;
+  double high_;
+  std::vector<Welford> pos_;
+  std::vector<Welford> neg_;
+  std::vector<double> sumw2_;
+};
+
+// Histograms of moments (named h_<reco>_bin_<var>_moments) are merged with BinMoments::merge_th2 and not scaled to the luminosity
+inline bool is_moments_histo(const std::string& name) {
+  const std::string suffix = "_moments";
+  return name.size()>suffix.size() && name.compare(name.size()-suffix.size(), suffix.size(), suffix)==0;
+}
+
+// RDataFrame action filling a BinMoments per slot, merged at the end of the event loop
+class BinMomentsHelper : public ROOT::Detail::RDF::RActionImpl<BinMomentsHelper> {
+
+public:
+  using Result_t = TH2D;
+
+  BinMomentsHelper(const std::string& name, unsigned int n_bins, double low, double high, unsigned int n_slots)
+    : slots_(n_slots, BinMoments(n_bins, low, high)), profile_id_(NodeProfiler::instance().node(name, "Action"))
+  {
+    result_.reset( slots_[0].to_th2(name) );
+  }
+  BinMomentsHelper(BinMomentsHelper&&) = default;
+  BinMomentsHelper(const BinMomentsHelper&) = delete;
+
+  std::shared_ptr<TH2D> GetResultPtr() const { return result_; }
+  void Initialize() {}
+  void InitTask(TTreeReader*, unsigned int) {}
+
+  template<class X, class W> void Exec(unsigned int slot, unsigned int ibin, X x, W w) {
+    NodeProfiler::Scope scope(profile_id_);
+    slots_[slot].fill(ibin, x, w);
+  }
+
+  void Finalize() {
+    for(unsigned int slot = 1; slot<slots_.size(); slot++) slots_[0].merge(slots_[slot]);
+    slots_[0].write_th2(result_.get());
+    slots_.clear();
+  }
+
+  std::string GetActionName() { return "BinMoments"; }
+
+private:
+  std::shared_ptr<TH2D> result_;
+  std::vector<BinMoments> slots_;
+  unsigned int profile_id_;
+};
+
+#endif
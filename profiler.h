@@ -0,0 +1,173 @@
+// Opt-in cost profiler of the nodes of the RDataFrame computation graphs of massscales_data.cpp
+// The callables of the Defines and Filters are wrapped by NodeProfiler::define/filter, the actions time themselves with NodeProfiler::Scope.
+// Each thread has its own counters: time spent in the node itself (the columns it triggers are subtracted), time including them, calls, passed events for the filters.
+// The wrappers do nothing but forward the call when the profiler is not enabled.
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+#include <type_traits>
+
+class NodeProfiler {
+
+public:
+  // The one profiler of the process, its counters are thread_local
+  static NodeProfiler& instance() {
+    static NodeProfiler p;
+    return p;
+  }
+
+  void enable(bool on) { enabled_ = on; }
+  bool enabled() const { return enabled_; }
+
+  // Id of a node, registered on the first call
+  unsigned int node(const std::string& name, const std::string& kind) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for(unsigned int i = 0; i<names_.size(); i++) {
+      if(names_[i]==name && kinds_[i]==kind) return i;
+    }
+    names_.push_back(name);
+    kinds_.push_back(kind);
+    return names_.size()-1;
+  }
+
+  // Times a node for the lifetime of the object
+  class Scope {
+  public:
+    Scope(unsigned int id) : id_(id), active_(instance().enabled_) {
+      if(!active_) return;
+      Thread& t = instance().local();
+      saved_child_ns_ = t.child_ns;
+      t.child_ns = 0;
+      start_ = std::chrono::steady_clock::now();
+    }
+    void passed(bool pass) { pass_ = pass; }
+    ~Scope() {
+      if(!active_) return;
+      int64_t dt = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+      Thread& t = instance().local();
+      if(id_>=t.nodes.size()) t.nodes.resize(id_+1);
+      Counters& c = t.nodes[id_];
+      c.calls++;
+      c.passed += pass_;
+      c.incl_ns += dt;
+      c.excl_ns += dt - t.child_ns;
+      t.child_ns = saved_child_ns_ + dt;
+    }
+  private:
+    unsigned int id_;
+    bool active_;
+    bool pass_ = true;
+    int64_t saved_child_ns_ = 0;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  // Callable with the same signature as f (so that RDataFrame deduces the column types), timing each call of f
+  template<class F, class Sig = decltype(&F::operator())> struct Timed;
+  template<class F, class R, class C, class... Args> struct Timed<F, R (C::*)(Args...) const> {
+    F f;
+    unsigned int id;
+    R operator()(Args... args) const {
+      Scope scope(id);
+      R out = f(args...);
+      scope.passed(passes(out));
+      return out;
+    }
+  };
+
+  template<class F> Timed<F> define(const std::string& name, F f) { return Timed<F>{f, node(name, "Define")}; }
+  template<class F> Timed<F> filter(const std::string& name, F f) { return Timed<F>{f, node(name, "Filter")}; }
+
+  // Zero all the counters, between event loops
+  void reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for(auto& t : threads_) t->nodes.assign(t->nodes.size(), Counters());
+  }
+
+  // Table of the nodes: totals over the threads and the spread of the self time among the threads which ran the node
+  void report(std::ostream& os, const std::string& title) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    os << "=== " << title << " (" << threads_.size() << " threads) ===" << std::endl;
+    os << std::left << std::setw(28) << "node" << std::setw(8) << "kind" << std::right
+       << std::setw(14) << "calls" << std::setw(10) << "pass [%]"
+       << std::setw(12) << "self [s]" << std::setw(12) << "total [s]" << std::setw(12) << "self [ns]"
+       << std::setw(22) << "self/thread [s]" << std::endl;
+    double self_sum = 0.;
+    for(unsigned int i = 0; i<names_.size(); i++) {
+      Counters tot;
+      double tmin = -1., tmax = 0.;
+      for(const auto& t : threads_) {
+        if(i>=t->nodes.size() || t->nodes[i].calls==0) continue;
+        const Counters& c = t->nodes[i];
+        tot.calls   += c.calls;
+        tot.passed  += c.passed;
+        tot.incl_ns += c.incl_ns;
+        tot.excl_ns += c.excl_ns;
+        double s = c.excl_ns*1e-9;
+        tmin = tmin<0. ? s : std::min(tmin, s);
+        tmax = std::max(tmax, s);
+      }
+      if(tot.calls==0) continue;
+      self_sum += tot.excl_ns*1e-9;
+      os << std::left << std::setw(28) << names_[i] << std::setw(8) << kinds_[i] << std::right
+         << std::setw(14) << tot.calls;
+      if(kinds_[i]=="Filter") os << std::setw(10) << std::fixed << std::setprecision(2) << 100.*tot.passed/tot.calls;
+      else os << std::setw(10) << "-";
+      os << std::setw(12) << std::fixed << std::setprecision(3) << tot.excl_ns*1e-9
+         << std::setw(12) << tot.incl_ns*1e-9
+         << std::setw(12) << std::setprecision(1) << double(tot.excl_ns)/tot.calls
+         << std::setw(10) << std::setprecision(3) << tmin << " - " << std::setw(9) << tmax << std::endl;
+    }
+    os << "Total self time of the profiled nodes: " << std::fixed << std::setprecision(3) << self_sum << " s" << std::endl;
+    os.unsetf(std::ios::fixed);
+  }
+
+private:
+  struct Counters {
+    uint64_t calls = 0;
+    uint64_t passed = 0;
+    int64_t incl_ns = 0;
+    int64_t excl_ns = 0;
+  };
+  struct Thread {
+    std::vector<Counters> nodes;
+    // Time of the nodes called from the running one
+    int64_t child_ns = 0;
+  };
+
+  NodeProfiler() = default;
+
+  // Counters of the calling thread, registered on its first use
+  Thread& local() {
+    thread_local Thread* t = nullptr;
+    if(t==nullptr) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      threads_.emplace_back(new Thread());
+      t = threads_.back().get();
+    }
+    return *t;
+  }
+
+  // Only the boolean outputs (filters) count as passed or not
+  template<class R> static bool passes(const R& out) {
+    if constexpr (std::is_same<R, bool>::value) return out;
+    else return true;
+  }
+
+  bool enabled_ = false;
+  mutable std::mutex mutex_;
+  std::vector<std::string> names_;
+  std::vector<std::string> kinds_;
+  std::vector<std::unique_ptr<Thread>> threads_;
+};
+
+#endif
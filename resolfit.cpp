@@ -26,6 +26,7 @@
 #include "Minuit2/FCNGradientBase.h"
 #include <eigen3/Eigen/Core>
 #include <eigen3/Eigen/Dense>
+#include "binning.h"
 
 //#include <Eigen/Core>
 //#include <Eigen/Dense>
@@ -64,24 +65,15 @@ public:
       }
       TH1F* h_pt_edges = (TH1F*)fin->Get("h_pt_edges");
       TH1F* h_eta_edges = (TH1F*)fin->Get("h_eta_edges");
-      unsigned int pt_edges_size  = h_pt_edges->GetXaxis()->GetNbins()+1;
-      unsigned int eta_edges_size = h_eta_edges->GetXaxis()->GetNbins()+1;
-      
-      pt_edges_.reserve( pt_edges_size );
-      for(unsigned int i=0; i<h_pt_edges->GetXaxis()->GetNbins(); i++)
-	      pt_edges_.push_back( h_pt_edges->GetXaxis()->GetBinLowEdge(i+1) );
-      pt_edges_.push_back( h_pt_edges->GetXaxis()->GetBinUpEdge( h_pt_edges->GetXaxis()->GetNbins() ));
-
-      eta_edges_.reserve( eta_edges_size );
-      for(unsigned int i=0; i<h_eta_edges->GetXaxis()->GetNbins(); i++)
-	      eta_edges_.push_back( h_eta_edges->GetXaxis()->GetBinLowEdge(i+1) );
-      eta_edges_.push_back( h_eta_edges->GetXaxis()->GetBinUpEdge( h_eta_edges->GetXaxis()->GetNbins() ));
+      Binning4D binning = Binning4D::from_histos(h_pt_edges, h_eta_edges);
+      pt_edges_  = binning.pt_edges();
+      eta_edges_ = binning.eta_edges();
       fin->Close();
     }
     else { // toys mode
-      pt_edges_  = {25.0, 30.0, 35.0, 40.0, 45.0, 50.0, 55.0}; 
-      eta_edges_ = {-2.4, -2.2, -2.0, -1.8, -1.6, -1.4, -1.2, -1.0, -0.8, -0.6, -0.4, -0.2, 0.0,
-	                  0.2, 0.4, 0.6, 0.8, 1.0, 1.2, 1.4, 1.6, 1.8, 2.0, 2.2, 2.4};
+      Binning4D binning = Binning4D::nominal();
+      pt_edges_  = binning.pt_edges();
+      eta_edges_ = binning.eta_edges();
     }
 
     n_pt_bins_  = pt_edges_.size()-1;
@@ -18,6 +18,23 @@ parser.add_argument('--dryrun', action='store_true'  , help = 'dry run')
 parser.add_argument('--tag',   default='PostVFP' , help = 'type of data used')
 parser.add_argument('--niter', dest = 'niter'  , type = int,  default=1, help='number of iterations after the 0th')
 parser.add_argument('--forceIter', dest = 'forceIter'  , type = int,  default=-1, help='will only do a specific iteration and skip the rest')
+parser.add_argument('--skim', action='store_true'  , help = 'write a skim of the selected dimuons in Iter0 and read it in the following iterations')
+parser.add_argument('--skimDir', default='./' , help = 'directory of the skim')
+parser.add_argument('--inFilesData', default='' , help = 'comma-separated data input files instead of the ones of the year (e.g. from make_fixture)')
+parser.add_argument('--inFilesMC', default='' , help = 'comma-separated MC input files instead of the ones of the year')
+parser.add_argument('--concurrent', action='store_true'  , help = 'run the data and MC event loops of massscales_data together')
+parser.add_argument('--jacFromMoments', action='store_true'  , help = 'rebuild the jacobian histograms of massscales_data from the moments filled in the MC event loop of iter 0, without a second MC event loop')
+parser.add_argument('--fastMoments', action='store_true'  , help = 'take the Gaussian mean and rms of each 4D bin from the exact moments of the MC event loop instead of fitting them (quick-look iterations)')
+parser.add_argument('--entryIndex', action='store_true'  , help = 'index the selected NanoAOD entries in Iter0 and iterate only over them in the following iterations')
+parser.add_argument('--entryIndexDir', default='./' , help = 'directory of the entry indexes')
+parser.add_argument('--stepScales', default='' , help = 'comma-separated steps along the last fits of the smear0 variants filled from Iter1 on (e.g. 0,0.5), the mass fit uses the one closest to the data')
+parser.add_argument('--dualTrackFit', action='store_true'  , help = 'fill the KF histograms in the same massscales_data event loops as the CVH ones and run massfit and resolfit on both (tag <tag>_kf)')
+parser.add_argument('--cutVariations', default='' , help = 'comma-separated variations of the muon selection name:key=value:... whose data and MC spectra are filled in the same massscales_data event loops (e.g. iso10:iso=0.10,noMedium:mediumId=0)')
+parser.add_argument('--nBootstrap', type = int, default=0, help = 'number of Poisson bootstrap replicas of the data and MC spectra filled by massscales_data and fitted by massfit (bootstrap errors of A,e,M)')
+parser.add_argument('--fileCache', default='' , help = 'directory of the partial histograms of blocks of input files of massscales_data: only the input files added or changed since the last run are read in iter -1 and 0')
+parser.add_argument('--fileCacheBlock', type = int, default=4, help = 'maximum number of input files per event loop and partial with --fileCache, 1 for one partial per file, 0 for all the files without a partial in one loop')
+parser.add_argument('--refillData', action='store_true'  , help = 'fill the data histograms again in every iteration instead of importing the ones of Iter0')
+parser.add_argument('--resident', action='store_true'  , help = 'run all the iterations in a single massscales_data process, keeping the selected MC dimuons in memory')
 
 args = parser.parse_args()
 
@@ -34,48 +51,100 @@ def loop_one():
         ' --rebin=2 '+\
         ' --fitNorm --fitWidth '+\
         '  --y2016 --scaleToData '
+    if args.skim:
+        cmd_histo_iter0 += ' --skimDir='+args.skimDir+' '
+    if args.inFilesData!='':
+        cmd_histo_iter0 += ' --inFilesData='+args.inFilesData+' '
+    if args.inFilesMC!='':
+        cmd_histo_iter0 += ' --inFilesMC='+args.inFilesMC+' '
+    if args.concurrent:
+        cmd_histo_iter0 += ' --concurrentLoops '
+    if args.jacFromMoments:
+        cmd_histo_iter0 += ' --jacFromMoments '
+    if args.fastMoments:
+        cmd_histo_iter0 += ' --fastMoments '
+    if args.entryIndex:
+        cmd_histo_iter0 += ' --entryIndex --entryIndexDir='+args.entryIndexDir+' '
+    if args.nBootstrap>0:
+        assert not (args.resident or args.skim)
+        cmd_histo_iter0 += ' --nBootstrap='+str(args.nBootstrap)+' '
+    if args.cutVariations!='':
+        assert not (args.resident or args.entryIndex or args.skim)
+        cmd_histo_iter0 += ' --cutVariations='+args.cutVariations+' '
+    if args.fileCache!='':
+        assert not (args.resident or args.skim or args.concurrent or args.entryIndex or args.dualTrackFit or args.cutVariations!='' or args.nBootstrap>0)
+        cmd_histo_iter0 += ' --fileCache='+args.fileCache+' '
+        cmd_histo_iter0 += ' --fileCacheBlock='+str(args.fileCacheBlock)+' '
+    if args.dualTrackFit:
+        assert not (args.resident or args.skim or args.concurrent or args.entryIndex)
+        cmd_histo_iter0 += ' --dualTrackFit '
+    # The data histograms of Iter0 are imported by the following iterations, not with the options filling other data histograms
+    import_data = not (args.refillData or args.dualTrackFit or args.cutVariations!='' or args.nBootstrap>0)
+    # The fits are run on the histograms of each track fit, the KF ones have the tag <tag>_kf
+    tags_fit = [tag, tag+'_kf'] if args.dualTrackFit else [tag]
     # --lumi
+    if args.resident:
+        assert args.forceIter<0
+        cmd_resident = cmd_histo_iter0+' --nResidentIter='+str(args.niter)+' '
+        print(cmd_resident)
+        if not args.dryrun:
+            os.system(cmd_resident)
+        return
     if not args.forceIter>0:
-        print(cmd_histo_iter0)
+        print(cmd_histo_iter0+(' --writeSkim ' if args.skim else ''))
     if not (args.dryrun or args.forceIter>0):
-        os.system(cmd_histo_iter0)
+        os.system(cmd_histo_iter0+(' --writeSkim ' if args.skim else ''))
     cmd_fit_iter0 = './massfit --ntoys=1 --bias=-1 '+\
         '--tag='+tag+' '+\
         '--run=Iter0 '
-    if not args.forceIter>0:
-        print(cmd_fit_iter0)
-    if not (args.dryrun or args.forceIter>0):
-        os.system(cmd_fit_iter0)
+    if args.nBootstrap>0:
+        cmd_fit_iter0 += ' --bootstrap '
+    for tag_fit in tags_fit:
+        cmd = cmd_fit_iter0.replace('--tag='+tag+' ', '--tag='+tag_fit+' ')
+        if not args.forceIter>0:
+            print(cmd)
+        if not (args.dryrun or args.forceIter>0):
+            os.system(cmd)
     cmd_resol_iter0 = './resolfit --ntoys=1 --bias=-1 '+\
         ' --tag='+tag+' '+\
         ' --run=Iter0 '+\
         ' --maxSigmaErr=0.1 '
-    if not args.forceIter>0:
-        print(cmd_resol_iter0)
-    if not (args.dryrun or args.forceIter>0):
-        os.system(cmd_resol_iter0)
+    for tag_fit in tags_fit:
+        cmd = cmd_resol_iter0.replace('--tag='+tag+' ', '--tag='+tag_fit+' ')
+        if not args.forceIter>0:
+            print(cmd)
+        if not (args.dryrun or args.forceIter>0):
+            os.system(cmd)
 
     for iter in range(1, args.niter+1):
         if (args.forceIter>0 and iter!=args.forceIter) or args.forceIter==0 :
             continue
         cmd_histo_iteri = cmd_histo_iter0.replace('--run=Iter0', '--run=Iter'+str(iter))
+        if args.skim:
+            cmd_histo_iteri += ' --readSkim '
         cmd_histo_iteri += ' --usePrevMassFit '+\
             ' --tagPrevMassFit='+tag+' '+\
             ' --runPrevMassFit=Iter'+str(iter-1)+' '
         cmd_histo_iteri += ' --usePrevResolFit '+\
             ' --tagPrevResolFit='+tag+' '+\
             ' --runPrevResolFit=Iter'+str(iter-1)+' '
+        if args.stepScales!='':
+            cmd_histo_iteri += ' --stepScales='+args.stepScales+' '
+        if import_data:
+            cmd_histo_iteri += ' --dataFrom=./massscales_'+tag+'_Iter0.root '
         print(cmd_histo_iteri)
         if not args.dryrun:
             os.system(cmd_histo_iteri)
-        cmd_fit_iteri = cmd_fit_iter0.replace('--run=Iter0', '--run=Iter'+str(iter))
-        print(cmd_fit_iteri)
-        if not args.dryrun:
-            os.system(cmd_fit_iteri)
-        cmd_resol_iteri = cmd_resol_iter0.replace('--run=Iter0', '--run=Iter'+str(iter))
-        print(cmd_resol_iteri)
-        if not args.dryrun:
-            os.system(cmd_resol_iteri)
+        for tag_fit in tags_fit:
+            cmd_fit_iteri = cmd_fit_iter0.replace('--run=Iter0', '--run=Iter'+str(iter)).replace('--tag='+tag+' ', '--tag='+tag_fit+' ')
+            print(cmd_fit_iteri)
+            if not args.dryrun:
+                os.system(cmd_fit_iteri)
+        for tag_fit in tags_fit:
+            cmd_resol_iteri = cmd_resol_iter0.replace('--run=Iter0', '--run=Iter'+str(iter)).replace('--tag='+tag+' ', '--tag='+tag_fit+' ')
+            print(cmd_resol_iteri)
+            if not args.dryrun:
+                os.system(cmd_resol_iteri)
     return
 
 
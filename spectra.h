@@ -0,0 +1,167 @@
+// Sparse storage of the (4D bin) x (mass) histograms of massscales_data.cpp: only the populated 4D bins are kept
+// Converts to and from the dense TH2D layout (x: 4D bin index, y: mass or mass - gen mass), including under/overflows
+
+#ifndef SPECTRA_H
+#define SPECTRA_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cmath>
+#include "TH1D.h"
+#include "TH2D.h"
+#include "TTree.h"
+#include "TList.h"
+#include "TDirectory.h"
+#include "TVectorD.h"
+
+class BinSpectra {
+
+public:
+  BinSpectra(const std::string& name, const std::string& title, unsigned int n_bins, unsigned int n_y, double y_low, double y_high)
+    : name_(name), title_(title), n_bins_(n_bins), n_y_(n_y), y_low_(y_low), y_high_(y_high), entries_(0.), has_sumw2_(false),
+      offset_(n_bins+2, kEmpty) {}
+
+  // Keeps the x bins (4D bins, under/overflow included) with any non-zero content or error
+  static BinSpectra from_th2(const TH2D* h) {
+    BinSpectra out( h->GetName(), h->GetTitle(), h->GetXaxis()->GetNbins(), h->GetYaxis()->GetNbins(),
+                    h->GetYaxis()->GetXmin(), h->GetYaxis()->GetXmax() );
+    out.entries_ = h->GetEntries();
+    out.has_sumw2_ = h->GetSumw2N()>0;
+    unsigned int ny = out.n_y_+2;
+    for(unsigned int ix = 0; ix<out.n_bins_+2; ix++) {
+      bool populated = false;
+      for(unsigned int iy = 0; iy<ny && !populated; iy++)
+        populated = h->GetBinContent(ix, iy)!=0. || (out.has_sumw2_ && h->GetBinError(ix, iy)!=0.);
+      if(!populated) continue;
+      out.offset_[ix] = out.sumw_.size();
+      for(unsigned int iy = 0; iy<ny; iy++) {
+        out.sumw_.push_back( h->GetBinContent(ix, iy) );
+        if(out.has_sumw2_) out.sumw2_.push_back( h->GetBinError(ix, iy)*h->GetBinError(ix, iy) );
+      }
+    }
+    return out;
+  }
+
+  // Dense histogram, not attached to any directory
+  TH2D* to_th2() const {
+    TH2D* h = new TH2D(name_.c_str(), title_.c_str(), n_bins_, 0, double(n_bins_), n_y_, y_low_, y_high_);
+    h->SetDirectory(0);
+    if(has_sumw2_) h->Sumw2();
+    for(unsigned int ix = 0; ix<n_bins_+2; ix++) {
+      if(offset_[ix]==kEmpty) continue;
+      for(unsigned int iy = 0; iy<n_y_+2; iy++) {
+        h->SetBinContent(ix, iy, sumw_[offset_[ix]+iy]);
+        if(has_sumw2_) h->SetBinError(ix, iy, std::sqrt(sumw2_[offset_[ix]+iy]));
+      }
+    }
+    h->SetEntries(entries_);
+    return h;
+  }
+
+  // Same as TH2D::ProjectionY(name, ibin+1, ibin+1) with the statistics computed from the bin contents
+  // The projection is not attached to any directory
+  TH1D* projection(unsigned int ibin, const char* name) const {
+    TH1D* h = new TH1D(name, "", n_y_, y_low_, y_high_);
+    h->SetDirectory(0);
+    if(has_sumw2_) h->Sumw2();
+    unsigned int ix = ibin+1;
+    if(ix<n_bins_+2 && offset_[ix]!=kEmpty) {
+      for(unsigned int iy = 0; iy<n_y_+2; iy++) {
+        h->SetBinContent(iy, sumw_[offset_[ix]+iy]);
+        if(has_sumw2_) h->SetBinError(iy, std::sqrt(sumw2_[offset_[ix]+iy]));
+      }
+    }
+    h->ResetStats();
+    return h;
+  }
+
+  // Same as TH2D::GetBinContent(ix, iy), under/overflow included
+  double content(unsigned int ix, unsigned int iy) const {
+    if(ix>=n_bins_+2 || iy>=n_y_+2 || offset_[ix]==kEmpty) return 0.;
+    return sumw_[offset_[ix]+iy];
+  }
+
+  bool populated(unsigned int ibin) const { return ibin+1<n_bins_+2 && offset_[ibin+1]!=kEmpty; }
+  unsigned int n_populated() const { return sumw_.size()/(n_y_+2); }
+  const std::string& name() const { return name_; }
+  double entries() const { return entries_; }
+
+  // Stored as a TTree with one entry per populated x bin, the axes and entries are in the UserInfo of the tree
+  void write(TDirectory* dir) const {
+    TDirectory* prev = gDirectory;
+    dir->cd();
+    TTree* tree = new TTree(name_.c_str(), title_.c_str());
+    int ix_t = 0;
+    std::vector<double> sumw(n_y_+2, 0.), sumw2(n_y_+2, 0.);
+    tree->Branch("ix", &ix_t, "ix/I");
+    tree->Branch("sumw", sumw.data(), Form("sumw[%d]/D", n_y_+2));
+    if(has_sumw2_) tree->Branch("sumw2", sumw2.data(), Form("sumw2[%d]/D", n_y_+2));
+    for(unsigned int ix = 0; ix<n_bins_+2; ix++) {
+      if(offset_[ix]==kEmpty) continue;
+      ix_t = ix;
+      for(unsigned int iy = 0; iy<n_y_+2; iy++) {
+        sumw[iy] = sumw_[offset_[ix]+iy];
+        if(has_sumw2_) sumw2[iy] = sumw2_[offset_[ix]+iy];
+      }
+      tree->Fill();
+    }
+    TVectorD* axes = new TVectorD(6);
+    (*axes)[0] = n_bins_;
+    (*axes)[1] = n_y_;
+    (*axes)[2] = y_low_;
+    (*axes)[3] = y_high_;
+    (*axes)[4] = entries_;
+    (*axes)[5] = has_sumw2_ ? 1. : 0.;
+    tree->GetUserInfo()->Add(axes);
+    tree->Write(0, TObject::kOverwrite);
+    delete tree;
+    prev->cd();
+  }
+
+  // Reads either the sparse (TTree) or the dense (TH2D) format, nullptr if not found
+  static std::unique_ptr<BinSpectra> read(TDirectory* dir, const std::string& name) {
+    TObject* obj = dir->Get(name.c_str());
+    if(obj==0) return nullptr;
+    if(obj->InheritsFrom(TH2D::Class())) return std::make_unique<BinSpectra>( from_th2((TH2D*)obj) );
+    if(!obj->InheritsFrom(TTree::Class())) return nullptr;
+    TTree* tree = (TTree*)obj;
+    TVectorD* axes = (TVectorD*)tree->GetUserInfo()->At(0);
+    std::unique_ptr<BinSpectra> out = std::make_unique<BinSpectra>( name, tree->GetTitle(), (unsigned int)(*axes)[0], (unsigned int)(*axes)[1], (*axes)[2], (*axes)[3] );
+    out->entries_ = (*axes)[4];
+    out->has_sumw2_ = (*axes)[5]>0.5;
+    unsigned int ny = out->n_y_+2;
+    int ix_t = 0;
+    std::vector<double> sumw(ny, 0.), sumw2(ny, 0.);
+    tree->SetBranchAddress("ix", &ix_t);
+    tree->SetBranchAddress("sumw", sumw.data());
+    if(out->has_sumw2_) tree->SetBranchAddress("sumw2", sumw2.data());
+    for(Long64_t i = 0; i<tree->GetEntries(); i++) {
+      tree->GetEntry(i);
+      out->offset_[ix_t] = out->sumw_.size();
+      out->sumw_.insert(out->sumw_.end(), sumw.begin(), sumw.end());
+      if(out->has_sumw2_) out->sumw2_.insert(out->sumw2_.end(), sumw2.begin(), sumw2.end());
+    }
+    tree->ResetBranchAddresses();
+    return out;
+  }
+
+private:
+  static constexpr unsigned int kEmpty = ~0u;
+
+  std::string name_;
+  std::string title_;
+  unsigned int n_bins_;
+  unsigned int n_y_;
+  double y_low_;
+  double y_high_;
+  double entries_;
+  bool has_sumw2_;
+  // Position in sumw_ of the y underflow bin of each x bin (TH2D numbering), kEmpty if the x bin is not populated
+  std::vector<unsigned int> offset_;
+  // Sum of weights (and of squared weights) of the y bins, under/overflow included, of the populated x bins
+  std::vector<double> sumw_;
+  std::vector<double> sumw2_;
+};
+
+#endif